@@ -0,0 +1,309 @@
+/* Copyright (c) 2010 Ian C. Good
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "ratchet.h"
+
+#ifndef RATCHET_BUFFER_MIN_SIZE
+#define RATCHET_BUFFER_MIN_SIZE 4096
+#endif
+
+#define get_buffer(L, i) ((struct ratchet_buffer *) luaL_checkudata (L, i, "ratchet_buffer_meta"))
+
+/* {{{ relative_index() */
+/* Converts a string.sub() style index, negative counting from the end, to an
+ * offset from 1, as lstrlib.c does. */
+static size_t relative_index (lua_Integer pos, size_t len)
+{
+	if (pos >= 0)
+		return (size_t) pos;
+	else if (0u - (size_t) pos > len)
+		return 0;
+	else
+		return len - ((size_t) -pos) + 1;
+}
+/* }}} */
+
+/* {{{ ratchet_buffer_check() */
+struct ratchet_buffer *ratchet_buffer_check (lua_State *L, int index)
+{
+	return get_buffer (L, index);
+}
+/* }}} */
+
+/* {{{ ratchet_buffer_prep() */
+char *ratchet_buffer_prep (lua_State *L, struct ratchet_buffer *buf, size_t len)
+{
+	size_t need = buf->len + len;
+	if (buf->start + need <= buf->size)
+		return buf->data + buf->start + buf->len;
+
+	/* Consumed data at the front is reclaimed before growing. */
+	if (buf->start)
+	{
+		memmove (buf->data, buf->data + buf->start, buf->len);
+		buf->start = 0;
+		if (need <= buf->size)
+			return buf->data + buf->len;
+	}
+
+	size_t size = buf->size * 2;
+	if (size < need)
+		size = need;
+	if (size < RATCHET_BUFFER_MIN_SIZE)
+		size = RATCHET_BUFFER_MIN_SIZE;
+
+	char *data = (char *) realloc (buf->data, size);
+	if (!data)
+	{
+		errno = ENOMEM;
+		ratchet_error_errno (L, "ratchet.buffer", "realloc");
+		return NULL;
+	}
+	buf->data = data;
+	buf->size = size;
+
+	return buf->data + buf->len;
+}
+/* }}} */
+
+/* ---- Namespace Functions ------------------------------------------------- */
+
+/* {{{ rbuffer_new() */
+static int rbuffer_new (lua_State *L)
+{
+	size_t size = (size_t) luaL_optunsigned (L, 1, 0);
+
+	struct ratchet_buffer *buf = (struct ratchet_buffer *) lua_newuserdata (L, sizeof (struct ratchet_buffer));
+	memset (buf, 0, sizeof (struct ratchet_buffer));
+
+	luaL_getmetatable (L, "ratchet_buffer_meta");
+	lua_setmetatable (L, -2);
+
+	if (size)
+		ratchet_buffer_prep (L, buf, size);
+
+	return 1;
+}
+/* }}} */
+
+/* {{{ rbuffer_call() */
+static int rbuffer_call (lua_State *L)
+{
+	lua_remove (L, 1);
+	return rbuffer_new (L);
+}
+/* }}} */
+
+/* ---- Member Functions ---------------------------------------------------- */
+
+/* {{{ rbuffer_gc() */
+static int rbuffer_gc (lua_State *L)
+{
+	struct ratchet_buffer *buf = get_buffer (L, 1);
+	free (buf->data);
+	memset (buf, 0, sizeof (struct ratchet_buffer));
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ rbuffer_len() */
+static int rbuffer_len (lua_State *L)
+{
+	struct ratchet_buffer *buf = get_buffer (L, 1);
+	lua_pushunsigned (L, (lua_Unsigned) buf->len);
+	return 1;
+}
+/* }}} */
+
+/* {{{ rbuffer_append() */
+static int rbuffer_append (lua_State *L)
+{
+	struct ratchet_buffer *buf = get_buffer (L, 1);
+	int i, top = lua_gettop (L);
+	size_t len;
+
+	for (i=2; i<=top; i++)
+	{
+		const char *data = luaL_checklstring (L, i, &len);
+		char *prepped = ratchet_buffer_prep (L, buf, len);
+		memcpy (prepped, data, len);
+		ratchet_buffer_add (buf, len);
+	}
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ rbuffer_find() */
+static int rbuffer_find (lua_State *L)
+{
+	struct ratchet_buffer *buf = get_buffer (L, 1);
+	size_t needle_len;
+	const char *needle = luaL_checklstring (L, 2, &needle_len);
+	size_t init = relative_index (luaL_optinteger (L, 3, 1), buf->len);
+	if (init < 1)
+		init = 1;
+	if (init > buf->len + 1 || needle_len > buf->len - (init - 1))
+	{
+		lua_pushnil (L);
+		return 1;
+	}
+
+	const char *data = buf->data + buf->start;
+	const char *p = data + init - 1;
+	const char *last = data + buf->len - needle_len;
+
+	if (!needle_len)
+		goto found;
+	while (p <= last)
+	{
+		p = (const char *) memchr (p, needle[0], (size_t) (last - p) + 1);
+		if (!p)
+			break;
+		if (0 == memcmp (p+1, needle+1, needle_len-1))
+			goto found;
+		p++;
+	}
+
+	lua_pushnil (L);
+	return 1;
+
+found:
+	lua_pushunsigned (L, (lua_Unsigned) (p - data) + 1);
+	lua_pushunsigned (L, (lua_Unsigned) (p - data) + needle_len);
+	return 2;
+}
+/* }}} */
+
+/* {{{ rbuffer_sub() */
+static int rbuffer_sub (lua_State *L)
+{
+	struct ratchet_buffer *buf = get_buffer (L, 1);
+	size_t i = relative_index (luaL_checkinteger (L, 2), buf->len);
+	size_t j = relative_index (luaL_optinteger (L, 3, -1), buf->len);
+	if (i < 1)
+		i = 1;
+	if (j > buf->len)
+		j = buf->len;
+
+	if (i <= j)
+		lua_pushlstring (L, buf->data + buf->start + i - 1, j - i + 1);
+	else
+		lua_pushliteral (L, "");
+
+	return 1;
+}
+/* }}} */
+
+/* {{{ rbuffer_consume() */
+static int rbuffer_consume (lua_State *L)
+{
+	struct ratchet_buffer *buf = get_buffer (L, 1);
+	size_t len = (size_t) luaL_optunsigned (L, 2, (lua_Unsigned) buf->len);
+	if (len > buf->len)
+		len = buf->len;
+
+	buf->start += len;
+	buf->len -= len;
+	if (!buf->len)
+		buf->start = 0;
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ rbuffer_tostring() */
+static int rbuffer_tostring (lua_State *L)
+{
+	struct ratchet_buffer *buf = get_buffer (L, 1);
+	lua_pushlstring (L, buf->data + buf->start, buf->len);
+	return 1;
+}
+/* }}} */
+
+/* ---- Public Functions ---------------------------------------------------- */
+
+/* {{{ luaopen_ratchet_buffer() */
+int luaopen_ratchet_buffer (lua_State *L)
+{
+	/* Static functions in the ratchet.buffer namespace. */
+	const luaL_Reg funcs[] = {
+		{"new", rbuffer_new},
+		{NULL}
+	};
+
+	/* Meta-methods for ratchet.buffer object metatables. */
+	const luaL_Reg metameths[] = {
+		{"__gc", rbuffer_gc},
+		{"__len", rbuffer_len},
+		{"__tostring", rbuffer_tostring},
+		{NULL}
+	};
+
+	/* Methods in the ratchet.buffer class. */
+	const luaL_Reg meths[] = {
+		/* Documented methods. */
+		{"len", rbuffer_len},
+		{"append", rbuffer_append},
+		{"find", rbuffer_find},
+		{"sub", rbuffer_sub},
+		{"consume", rbuffer_consume},
+		{"tostring", rbuffer_tostring},
+		/* Undocumented, helper methods. */
+		{NULL}
+	};
+
+	/* Set up the ratchet.buffer namespace functions. */
+	luaL_newlib (L, funcs);
+	lua_pushvalue (L, -1);
+	lua_setfield (L, LUA_REGISTRYINDEX, "ratchet_buffer_class");
+
+	/* Allow ratchet.buffer() as a shortcut for new(). */
+	lua_createtable (L, 0, 1);
+	lua_pushcfunction (L, rbuffer_call);
+	lua_setfield (L, -2, "__call");
+	lua_setmetatable (L, -2);
+
+	/* Set up the ratchet.buffer class and metatables. */
+	luaL_newmetatable (L, "ratchet_buffer_meta");
+	luaL_setfuncs (L, metameths, 0);
+	lua_newtable (L);
+	luaL_setfuncs (L, meths, 0);
+	lua_setfield (L, -2, "__index");
+	lua_pop (L, 1);
+
+	return 1;
+}
+/* }}} */
+
+// vim:fdm=marker:ai:ts=4:sw=4:noet:
@@ -0,0 +1,590 @@
+/* Copyright (c) 2010 Ian C. Good
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "ratchet.h"
+#include "misc.h"
+
+#define get_channel(L, i) ((struct channel *) luaL_checkudata (L, i, "ratchet_channel_meta"))
+
+/* {{{ struct channel */
+/* Buffered values live in slots 1 to capacity of the uservalue table, used as
+ * a ring. Blocked senders are queued in "senders" and their values, in the
+ * same order, in "sent". */
+struct channel
+{
+	int capacity;
+	int head;
+	int count;
+	int closed;
+	struct ratchet_waitq receivers;
+	struct ratchet_waitq senders;
+	struct ratchet_waitq sent;
+	int signal_fd[2];
+	int signaled;
+};
+/* }}} */
+
+/* {{{ update_signal() */
+/* The signal pipe, created by get_fd(), is readable whenever recv() would
+ * not block, so channels can be given to ratchet.thread.block_on(). */
+static void update_signal (struct channel *ch)
+{
+	if (ch->signal_fd[0] < 0)
+		return;
+
+	int want = (ch->count > 0 || !ratchet_waitq_empty (&ch->senders) || ch->closed);
+	if (want && !ch->signaled)
+	{
+		if (1 == write (ch->signal_fd[1], "", 1))
+			ch->signaled = 1;
+	}
+	else if (!want && ch->signaled)
+	{
+		char drain[16];
+		while (read (ch->signal_fd[0], drain, sizeof (drain)) > 0);
+		ch->signaled = 0;
+	}
+}
+/* }}} */
+
+/* {{{ buffer_push() */
+static void buffer_push (lua_State *L, struct channel *ch, int uv, int index)
+{
+	lua_pushvalue (L, index);
+	lua_rawseti (L, uv, (ch->head + ch->count) % ch->capacity + 1);
+	ch->count++;
+}
+/* }}} */
+
+/* {{{ buffer_pop() */
+static void buffer_pop (lua_State *L, struct channel *ch, int uv)
+{
+	lua_rawgeti (L, uv, ch->head + 1);
+	lua_pushnil (L);
+	lua_rawseti (L, uv, ch->head + 1);
+	ch->head = (ch->head + 1) % ch->capacity;
+	ch->count--;
+}
+/* }}} */
+
+/* {{{ take_from_sender() */
+/* Wakes the first live blocked sender and pushes the value it was sending,
+ * or pushes nothing if there are none. The ratchet object must be at index
+ * 1. */
+static int take_from_sender (lua_State *L, struct channel *ch, int uv)
+{
+	lua_getfield (L, uv, "senders");
+	lua_getfield (L, uv, "sent");
+
+	while (!ratchet_waitq_empty (&ch->senders))
+	{
+		ratchet_waitq_pop (L, &ch->sent, -1);
+		ratchet_waitq_pop (L, &ch->senders, -3);
+		lua_pushboolean (L, 1);
+		int woken = ratchet_wake_thread (L, -2, 1);
+		lua_pop (L, 1);
+		if (woken)
+		{
+			lua_insert (L, -3);
+			lua_pop (L, 2);
+			return 1;
+		}
+		lua_pop (L, 1);
+	}
+
+	lua_pop (L, 2);
+	return 0;
+}
+/* }}} */
+
+/* {{{ receive() */
+/* Pushes the next value, taken from the buffer or straight from a blocked
+ * sender, or pushes nothing if there is none. The ratchet object must be at
+ * index 1. */
+static int receive (lua_State *L, struct channel *ch, int uv)
+{
+	int ret = 1;
+
+	if (ch->count > 0)
+	{
+		buffer_pop (L, ch, uv);
+
+		/* Room was made, move the first blocked sender's value in. */
+		if (take_from_sender (L, ch, uv))
+		{
+			buffer_push (L, ch, uv, -1);
+			lua_pop (L, 1);
+		}
+	}
+	else
+		ret = take_from_sender (L, ch, uv);
+
+	update_signal (ch);
+	return ret;
+}
+/* }}} */
+
+/* {{{ handoff_to_receiver() */
+/* Gives the value at index to the first live waiting receiver. The ratchet
+ * object must be at index 1. */
+static int handoff_to_receiver (lua_State *L, struct channel *ch, int uv, int index)
+{
+	lua_getfield (L, uv, "receivers");
+	lua_pushvalue (L, index);
+	int ret = ratchet_waitq_wake (L, &ch->receivers, -2, 1);
+	lua_pop (L, 1);
+
+	return ret;
+}
+/* }}} */
+
+/* {{{ get_kernel() */
+static int get_kernel (lua_State *L, lua_CFunction k)
+{
+	lua_pushlightuserdata (L, RATCHET_YIELD_GET);
+	return lua_yieldk (L, 1, 1, k);
+}
+/* }}} */
+
+/* ---- Namespace Functions ------------------------------------------------- */
+
+/* {{{ rchan_new() */
+static int rchan_new (lua_State *L)
+{
+	int capacity = luaL_optint (L, 1, 1);
+	luaL_argcheck (L, capacity >= 0, 1, "capacity must not be negative");
+
+	struct channel *ch = (struct channel *) lua_newuserdata (L, sizeof (struct channel));
+	memset (ch, 0, sizeof (struct channel));
+	ch->capacity = capacity;
+	ch->signal_fd[0] = ch->signal_fd[1] = -1;
+
+	luaL_getmetatable (L, "ratchet_channel_meta");
+	lua_setmetatable (L, -2);
+
+	lua_createtable (L, capacity, 3);
+	lua_newtable (L);
+	lua_setfield (L, -2, "receivers");
+	lua_newtable (L);
+	lua_setfield (L, -2, "senders");
+	lua_newtable (L);
+	lua_setfield (L, -2, "sent");
+	lua_setuservalue (L, -2);
+
+	return 1;
+}
+/* }}} */
+
+/* {{{ rchan_call() */
+static int rchan_call (lua_State *L)
+{
+	lua_remove (L, 1);
+	return rchan_new (L);
+}
+/* }}} */
+
+/* ---- Member Functions ---------------------------------------------------- */
+
+/* {{{ rchan_gc() */
+static int rchan_gc (lua_State *L)
+{
+	struct channel *ch = get_channel (L, 1);
+	if (ch->signal_fd[0] >= 0)
+	{
+		close (ch->signal_fd[0]);
+		close (ch->signal_fd[1]);
+	}
+	ch->signal_fd[0] = ch->signal_fd[1] = -1;
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ rchan_len() */
+static int rchan_len (lua_State *L)
+{
+	struct channel *ch = get_channel (L, 1);
+	lua_pushinteger (L, ch->count);
+	return 1;
+}
+/* }}} */
+
+/* {{{ rchan_get_fd() */
+static int rchan_get_fd (lua_State *L)
+{
+	struct channel *ch = get_channel (L, 1);
+
+	if (ch->signal_fd[0] < 0)
+	{
+		if (pipe (ch->signal_fd) < 0)
+			return ratchet_error_errno (L, "ratchet.channel.get_fd()", "pipe");
+		set_nonblocking (ch->signal_fd[0]);
+		set_nonblocking (ch->signal_fd[1]);
+		set_closeonexec (ch->signal_fd[0]);
+		set_closeonexec (ch->signal_fd[1]);
+		ch->signaled = 0;
+		update_signal (ch);
+	}
+
+	lua_pushinteger (L, ch->signal_fd[0]);
+	return 1;
+}
+/* }}} */
+
+/* {{{ rchan_send() */
+static int rchan_send (lua_State *L)
+{
+	struct channel *ch = get_channel (L, 1);
+	int ctx = 0;
+	lua_getctx (L, &ctx);
+
+	if (ctx == 2)
+	{
+		/* Woken by a receiver taking the value, or by close(). If still
+		 * queued, something else woke it and the value goes unsent. */
+		int pos = lua_tointeger (L, 3);
+		int taken = lua_toboolean (L, 4);
+		lua_settop (L, 2);
+		lua_getuservalue (L, 1);
+		lua_getfield (L, 3, "senders");
+		lua_pushthread (L);
+		if (ratchet_waitq_remove (L, &ch->senders, 4, pos))
+		{
+			lua_getfield (L, 3, "sent");
+			lua_pushvalue (L, 2);
+			ratchet_waitq_remove (L, &ch->sent, 5, pos);
+			update_signal (ch);
+			return ratchet_error_str (L, "ratchet.channel.send()", "ECANCELED", "Woken while waiting to send.");
+		}
+		if (!taken)
+			return ratchet_error_str (L, "ratchet.channel.send()", "CLOSED", "Channel was closed.");
+		return 0;
+	}
+
+	if (ctx == 0)
+	{
+		lua_settop (L, 2);
+		luaL_argcheck (L, !lua_isnil (L, 2), 2, "cannot send nil");
+		if (ch->closed)
+			return ratchet_error_str (L, "ratchet.channel.send()", "CLOSED", "Channel is closed.");
+
+		if (!ratchet_waitq_empty (&ch->receivers))
+			return get_kernel (L, rchan_send);
+	}
+	else
+	{
+		/* The ratchet object is at the top, move it to the bottom. */
+		lua_insert (L, 1);
+		lua_getuservalue (L, 2);
+		if (handoff_to_receiver (L, ch, 4, 3))
+			return 0;
+		lua_settop (L, 3);
+		lua_remove (L, 1);
+	}
+
+	lua_getuservalue (L, 1);
+	if (ch->count < ch->capacity)
+	{
+		buffer_push (L, ch, 3, 2);
+		update_signal (ch);
+		return 0;
+	}
+
+	/* Full, wait for a receiver to take the value. */
+	lua_getfield (L, 3, "senders");
+	lua_pushthread (L);
+	int pos = ratchet_waitq_push (L, &ch->senders, 4);
+	lua_getfield (L, 3, "sent");
+	lua_pushvalue (L, 2);
+	ratchet_waitq_push (L, &ch->sent, 5);
+	lua_settop (L, 2);
+	lua_pushinteger (L, pos);
+	update_signal (ch);
+
+	lua_pushlightuserdata (L, RATCHET_YIELD_PAUSE);
+	return lua_yieldk (L, 1, 2, rchan_send);
+}
+/* }}} */
+
+/* {{{ rchan_try_send() */
+static int rchan_try_send (lua_State *L)
+{
+	struct channel *ch = get_channel (L, 1);
+	int ctx = 0;
+	lua_getctx (L, &ctx);
+
+	if (ctx == 0)
+	{
+		lua_settop (L, 2);
+		luaL_argcheck (L, !lua_isnil (L, 2), 2, "cannot send nil");
+		if (ch->closed)
+		{
+			lua_pushboolean (L, 0);
+			return 1;
+		}
+
+		if (!ratchet_waitq_empty (&ch->receivers))
+			return get_kernel (L, rchan_try_send);
+	}
+	else
+	{
+		lua_insert (L, 1);
+		lua_getuservalue (L, 2);
+		if (handoff_to_receiver (L, ch, 4, 3))
+		{
+			lua_pushboolean (L, 1);
+			return 1;
+		}
+		lua_settop (L, 3);
+		lua_remove (L, 1);
+	}
+
+	lua_getuservalue (L, 1);
+	if (ch->count < ch->capacity)
+	{
+		buffer_push (L, ch, 3, 2);
+		update_signal (ch);
+		lua_pushboolean (L, 1);
+		return 1;
+	}
+
+	lua_pushboolean (L, 0);
+	return 1;
+}
+/* }}} */
+
+/* {{{ rchan_recv() */
+static int rchan_recv (lua_State *L)
+{
+	struct channel *ch = get_channel (L, 1);
+	int ctx = 0;
+	lua_getctx (L, &ctx);
+
+	if (ctx == 2)
+	{
+		/* Woken by a sender handing off a value, or by close(). If still
+		 * queued, something else woke it. */
+		int pos = lua_tointeger (L, 2);
+		int nresults = lua_gettop (L) - 2;
+		lua_getuservalue (L, 1);
+		lua_getfield (L, -1, "receivers");
+		lua_pushthread (L);
+		if (ratchet_waitq_remove (L, &ch->receivers, -2, pos))
+			return ratchet_error_str (L, "ratchet.channel.recv()", "ECANCELED", "Woken while waiting to receive.");
+		lua_pop (L, 2);
+		return nresults;
+	}
+
+	if (ctx == 0)
+	{
+		lua_settop (L, 1);
+
+		/* Nothing needs waking, skip fetching the ratchet object. */
+		if (ch->count > 0 && ratchet_waitq_empty (&ch->senders))
+		{
+			lua_getuservalue (L, 1);
+			buffer_pop (L, ch, 2);
+			update_signal (ch);
+			return 1;
+		}
+
+		if (ch->count > 0 || !ratchet_waitq_empty (&ch->senders))
+			return get_kernel (L, rchan_recv);
+	}
+	else
+	{
+		lua_insert (L, 1);
+		lua_getuservalue (L, 2);
+		if (receive (L, ch, 3))
+			return 1;
+		lua_settop (L, 2);
+		lua_remove (L, 1);
+	}
+
+	if (ch->closed)
+		return 0;
+
+	/* Empty, wait for a sender. */
+	lua_getuservalue (L, 1);
+	lua_getfield (L, 2, "receivers");
+	lua_pushthread (L);
+	int pos = ratchet_waitq_push (L, &ch->receivers, 3);
+	lua_settop (L, 1);
+	lua_pushinteger (L, pos);
+
+	lua_pushlightuserdata (L, RATCHET_YIELD_PAUSE);
+	return lua_yieldk (L, 1, 2, rchan_recv);
+}
+/* }}} */
+
+/* {{{ rchan_try_recv() */
+static int rchan_try_recv (lua_State *L)
+{
+	struct channel *ch = get_channel (L, 1);
+	int ctx = 0;
+	lua_getctx (L, &ctx);
+
+	if (ctx == 0)
+	{
+		lua_settop (L, 1);
+
+		if (ch->count > 0 && ratchet_waitq_empty (&ch->senders))
+		{
+			lua_getuservalue (L, 1);
+			lua_pushboolean (L, 1);
+			buffer_pop (L, ch, 2);
+			update_signal (ch);
+			return 2;
+		}
+
+		if (ch->count > 0 || !ratchet_waitq_empty (&ch->senders))
+			return get_kernel (L, rchan_try_recv);
+	}
+	else
+	{
+		lua_insert (L, 1);
+		lua_getuservalue (L, 2);
+		lua_pushboolean (L, 1);
+		if (receive (L, ch, 3))
+			return 2;
+	}
+
+	lua_pushboolean (L, 0);
+	return 1;
+}
+/* }}} */
+
+/* {{{ rchan_close() */
+static int rchan_close (lua_State *L)
+{
+	struct channel *ch = get_channel (L, 1);
+	int ctx = 0;
+	lua_getctx (L, &ctx);
+
+	if (ctx == 0)
+	{
+		lua_settop (L, 1);
+		ch->closed = 1;
+		update_signal (ch);
+
+		if (ratchet_waitq_empty (&ch->receivers) && ratchet_waitq_empty (&ch->senders))
+			return 0;
+		return get_kernel (L, rchan_close);
+	}
+
+	lua_insert (L, 1);
+	lua_getuservalue (L, 2);
+
+	/* Waiting receivers get nil, blocked senders throw an error. */
+	lua_getfield (L, 3, "receivers");
+	while (!ratchet_waitq_empty (&ch->receivers))
+		ratchet_waitq_wake (L, &ch->receivers, 4, 0);
+	lua_getfield (L, 3, "senders");
+	while (!ratchet_waitq_empty (&ch->senders))
+	{
+		lua_pushboolean (L, 0);
+		ratchet_waitq_wake (L, &ch->senders, 5, 1);
+	}
+	ch->sent.head = ch->sent.tail = ch->sent.size = 0;
+	lua_newtable (L);
+	lua_setfield (L, 3, "sent");
+	update_signal (ch);
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ rchan_is_closed() */
+static int rchan_is_closed (lua_State *L)
+{
+	struct channel *ch = get_channel (L, 1);
+	lua_pushboolean (L, ch->closed);
+	return 1;
+}
+/* }}} */
+
+/* ---- Public Functions ---------------------------------------------------- */
+
+/* {{{ luaopen_ratchet_channel() */
+int luaopen_ratchet_channel (lua_State *L)
+{
+	/* Static functions in the ratchet.channel namespace. */
+	const luaL_Reg funcs[] = {
+		{"new", rchan_new},
+		{NULL}
+	};
+
+	/* Meta-methods for ratchet.channel object metatables. */
+	const luaL_Reg metameths[] = {
+		{"__gc", rchan_gc},
+		{"__len", rchan_len},
+		{NULL}
+	};
+
+	/* Methods in the ratchet.channel class. */
+	const luaL_Reg meths[] = {
+		/* Documented methods. */
+		{"get_fd", rchan_get_fd},
+		{"send", rchan_send},
+		{"recv", rchan_recv},
+		{"try_send", rchan_try_send},
+		{"try_recv", rchan_try_recv},
+		{"close", rchan_close},
+		{"is_closed", rchan_is_closed},
+		/* Undocumented, helper methods. */
+		{NULL}
+	};
+
+	/* Set up the ratchet.channel namespace functions. */
+	luaL_newlib (L, funcs);
+	lua_pushvalue (L, -1);
+	lua_setfield (L, LUA_REGISTRYINDEX, "ratchet_channel_class");
+
+	/* Allow ratchet.channel(capacity) as a shortcut for new(). */
+	lua_createtable (L, 0, 1);
+	lua_pushcfunction (L, rchan_call);
+	lua_setfield (L, -2, "__call");
+	lua_setmetatable (L, -2);
+
+	/* Set up the ratchet.channel class and metatables. */
+	luaL_newmetatable (L, "ratchet_channel_meta");
+	lua_newtable (L);
+	luaL_setfuncs (L, meths, 0);
+	lua_setfield (L, -2, "__index");
+	luaL_setfuncs (L, metameths, 0);
+	lua_pop (L, 1);
+
+	return 1;
+}
+/* }}} */
+
+// vim:fdm=marker:ai:ts=4:sw=4:noet:
@@ -0,0 +1,352 @@
+/* Copyright (c) 2010 Ian C. Good
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include "config.h"
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#if HAVE_SCHED_H
+#include <sched.h>
+#endif
+
+#include "ratchet.h"
+#include "misc.h"
+
+#ifndef RATCHET_CLUSTER_RESTART_DELAY
+#define RATCHET_CLUSTER_RESTART_DELAY 1
+#endif
+
+/* {{{ struct cluster_worker */
+struct cluster_worker
+{
+	pid_t pid;
+	time_t started;
+};
+/* }}} */
+
+/* {{{ struct cluster_cpus */
+/* The CPUs the supervisor was allowed to run on when it started, which need
+ * not be numbered from 0 under cpusets or in containers. count is 0 if they
+ * are unknown, and workers are then left unpinned. */
+struct cluster_cpus
+{
+	int count;
+#if HAVE_SCHED_SETAFFINITY
+	cpu_set_t allowed;
+#endif
+};
+/* }}} */
+
+/* {{{ get_allowed_cpus() */
+static void get_allowed_cpus (struct cluster_cpus *cpus)
+{
+	cpus->count = 0;
+#if HAVE_SCHED_SETAFFINITY
+	CPU_ZERO (&cpus->allowed);
+	if (0 == sched_getaffinity (0, sizeof (cpus->allowed), &cpus->allowed))
+		cpus->count = CPU_COUNT (&cpus->allowed);
+#endif
+}
+/* }}} */
+
+/* {{{ get_num_cpus() */
+static int get_num_cpus (const struct cluster_cpus *cpus)
+{
+	if (cpus->count > 0)
+		return cpus->count;
+
+	long n = sysconf (_SC_NPROCESSORS_ONLN);
+	return (n > 0 ? (int) n : 1);
+}
+/* }}} */
+
+/* {{{ pin_to_cpu() */
+/* Pins the calling process to the i-th allowed CPU, wrapping around. */
+static void pin_to_cpu (const struct cluster_cpus *cpus, int i)
+{
+#if HAVE_SCHED_SETAFFINITY
+	if (cpus->count <= 0)
+		return;
+
+	int cpu, n = i % cpus->count;
+	for (cpu=0; cpu<CPU_SETSIZE; cpu++)
+	{
+		if (CPU_ISSET (cpu, &cpus->allowed) && 0 == n--)
+			break;
+	}
+	if (cpu >= CPU_SETSIZE)
+		return;
+
+	/* A worker that cannot be pinned still runs, just anywhere. */
+	cpu_set_t set;
+	CPU_ZERO (&set);
+	CPU_SET (cpu, &set);
+	(void) sched_setaffinity (0, sizeof (set), &set);
+#endif
+}
+/* }}} */
+
+/* {{{ start_worker() */
+static pid_t start_worker (lua_State *L, int i, const struct cluster_cpus *cpus, int affinity, sigset_t *oldmask)
+{
+	/* Nothing buffered before the fork may be written twice. */
+	fflush (NULL);
+	pid_t pid = fork ();
+
+	if (pid == 0)
+	{
+		sigprocmask (SIG_SETMASK, oldmask, NULL);
+		if (affinity)
+			pin_to_cpu (cpus, i);
+
+		lua_pushvalue (L, 1);
+		lua_pushinteger (L, i+1);
+		if (LUA_OK != lua_pcall (L, 1, 0, 0))
+		{
+			fprintf (stderr, "ratchet.cluster worker %d: %s\n", i+1, luaL_tolstring (L, -1, NULL));
+			fflush (stderr);
+			_exit (1);
+		}
+
+		/* _exit() skips the parent's atexit handlers, so flush by hand. */
+		fflush (stdout);
+		fflush (stderr);
+		_exit (0);
+	}
+
+	return pid;
+}
+/* }}} */
+
+/* {{{ stop_workers() */
+static void stop_workers (struct cluster_worker *workers, int nworkers)
+{
+	int i;
+	for (i=0; i<nworkers; i++)
+		if (workers[i].pid > 0)
+			kill (workers[i].pid, SIGTERM);
+}
+/* }}} */
+
+/* {{{ reap_workers() */
+static int reap_workers (lua_State *L, struct cluster_worker *workers, int nworkers, int *failures, int restart, const struct cluster_cpus *cpus, int affinity, sigset_t *oldmask)
+{
+	int i, status, reaped = 0;
+
+	for (i=0; i<nworkers; i++)
+	{
+		if (workers[i].pid <= 0)
+			continue;
+		if (workers[i].pid != waitpid (workers[i].pid, &status, WNOHANG))
+			continue;
+
+		if (WIFEXITED (status) ? WEXITSTATUS (status) != 0 : WTERMSIG (status) != SIGTERM)
+			(*failures)++;
+		workers[i].pid = 0;
+
+		if (restart)
+		{
+			/* Workers that die right away are not restarted in a tight loop. */
+			if (time (NULL) - workers[i].started < RATCHET_CLUSTER_RESTART_DELAY)
+				sleep (RATCHET_CLUSTER_RESTART_DELAY);
+
+			workers[i].pid = start_worker (L, i, cpus, affinity, oldmask);
+			workers[i].started = time (NULL);
+			if (workers[i].pid > 0)
+				continue;
+		}
+
+		reaped++;
+	}
+
+	return reaped;
+}
+/* }}} */
+
+/* ---- Namespace Functions ------------------------------------------------- */
+
+/* {{{ rcluster_get_num_cpus() */
+static int rcluster_get_num_cpus (lua_State *L)
+{
+	struct cluster_cpus cpus;
+	get_allowed_cpus (&cpus);
+	lua_pushinteger (L, get_num_cpus (&cpus));
+	return 1;
+}
+/* }}} */
+
+/* {{{ rcluster_listen() */
+static int rcluster_listen (lua_State *L)
+{
+	luaL_checktype (L, 1, LUA_TTABLE);
+	lua_settop (L, 2);
+
+	/* Create the socket with ratchet.socket.new(). */
+	lua_getfield (L, LUA_REGISTRYINDEX, "ratchet_socket_class");
+	lua_getfield (L, -1, "new");
+	lua_getfield (L, 1, "family");
+	lua_getfield (L, 1, "socktype");
+	lua_getfield (L, 1, "protocol");
+	lua_call (L, 3, 1);
+	lua_replace (L, 3);
+
+	int fd = *((int *) luaL_checkudata (L, 3, "ratchet_socket_meta"));
+	int on = 1;
+	if (setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on)) < 0)
+		return ratchet_error_errno (L, "ratchet.cluster.listen()", "setsockopt");
+#ifdef SO_REUSEPORT
+	if (setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof (on)) < 0)
+		return ratchet_error_errno (L, "ratchet.cluster.listen()", "setsockopt");
+#else
+	return ratchet_error_str (L, "ratchet.cluster.listen()", "ENOPROTOOPT", "SO_REUSEPORT is not supported.");
+#endif
+
+	/* Call socket:bind(rec.addr). */
+	lua_getfield (L, 3, "bind");
+	lua_pushvalue (L, 3);
+	lua_getfield (L, 1, "addr");
+	lua_call (L, 2, 0);
+
+	/* Call socket:listen(backlog). */
+	lua_getfield (L, 3, "listen");
+	lua_pushvalue (L, 3);
+	lua_pushvalue (L, 2);
+	lua_call (L, 2, 0);
+
+	return 1;
+}
+/* }}} */
+
+/* {{{ rcluster_run() */
+static int rcluster_run (lua_State *L)
+{
+	luaL_checkany (L, 1);
+	lua_settop (L, 2);
+
+	struct cluster_cpus cpus;
+	get_allowed_cpus (&cpus);
+	int ncpus = get_num_cpus (&cpus);
+	int nworkers = ncpus, affinity = 0, restart = 1;
+	if (!lua_isnil (L, 2))
+	{
+		luaL_checktype (L, 2, LUA_TTABLE);
+		lua_getfield (L, 2, "workers");
+		nworkers = luaL_optint (L, -1, ncpus);
+		lua_getfield (L, 2, "affinity");
+		affinity = lua_toboolean (L, -1);
+		lua_getfield (L, 2, "restart");
+		if (!lua_isnil (L, -1))
+			restart = lua_toboolean (L, -1);
+		lua_settop (L, 2);
+	}
+	if (nworkers < 1)
+		return luaL_argerror (L, 2, "workers must be at least 1");
+
+	struct cluster_worker *workers = (struct cluster_worker *) lua_newuserdata (L, sizeof (struct cluster_worker) * nworkers);
+	memset (workers, 0, sizeof (struct cluster_worker) * nworkers);
+
+	/* Signals are only received through sigwaitinfo() while supervising. */
+	sigset_t mask, oldmask;
+	sigemptyset (&mask);
+	sigaddset (&mask, SIGCHLD);
+	sigaddset (&mask, SIGTERM);
+	sigaddset (&mask, SIGINT);
+	if (-1 == sigprocmask (SIG_BLOCK, &mask, &oldmask))
+		return ratchet_error_errno (L, "ratchet.cluster.run()", "sigprocmask");
+
+	int i, running = 0, failures = 0;
+	for (i=0; i<nworkers; i++)
+	{
+		workers[i].pid = start_worker (L, i, &cpus, affinity, &oldmask);
+		workers[i].started = time (NULL);
+		if (workers[i].pid < 0)
+		{
+			int save_errno = errno;
+			stop_workers (workers, nworkers);
+			sigprocmask (SIG_SETMASK, &oldmask, NULL);
+			errno = save_errno;
+			return ratchet_error_errno (L, "ratchet.cluster.run()", "fork");
+		}
+		running++;
+	}
+
+	while (running > 0)
+	{
+		int sig = sigwaitinfo (&mask, NULL);
+		if (sig == SIGCHLD)
+			running -= reap_workers (L, workers, nworkers, &failures, restart, &cpus, affinity, &oldmask);
+
+		else if (sig == SIGTERM || sig == SIGINT)
+		{
+			restart = 0;
+			stop_workers (workers, nworkers);
+		}
+
+		else if (sig < 0 && errno != EINTR)
+		{
+			int save_errno = errno;
+			stop_workers (workers, nworkers);
+			sigprocmask (SIG_SETMASK, &oldmask, NULL);
+			errno = save_errno;
+			return ratchet_error_errno (L, "ratchet.cluster.run()", "sigwaitinfo");
+		}
+	}
+
+	sigprocmask (SIG_SETMASK, &oldmask, NULL);
+
+	lua_pushinteger (L, failures);
+	return 1;
+}
+/* }}} */
+
+/* ---- Public Functions ---------------------------------------------------- */
+
+/* {{{ luaopen_ratchet_cluster() */
+int luaopen_ratchet_cluster (lua_State *L)
+{
+	/* Static functions in the ratchet.cluster namespace. */
+	const luaL_Reg funcs[] = {
+		{"get_num_cpus", rcluster_get_num_cpus},
+		{"listen", rcluster_listen},
+		{"run", rcluster_run},
+		{NULL}
+	};
+
+	luaL_newlib (L, funcs);
+
+	return 1;
+}
+/* }}} */
+
+// vim:fdm=marker:ai:ts=4:sw=4:noet:
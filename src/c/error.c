@@ -86,6 +86,9 @@ static void build_errno_code_table (lua_State *L)
 	add_errno_code (ENOTCONN);
 	add_errno_code (EPIPE);
 
+	/* From ratchet.socket.relay(). */
+	add_errno_code (ECANCELED);
+
 	/* From ZeroMQ. */
 	add_errno_code (ENODEV);
 	add_errno_code (ENOTSUP);
@@ -51,6 +51,18 @@ struct rexec_state
 	int infds[2];
 	int outfds[2];
 	int errfds[2];
+	int status;
+	int exited; /* 1 once reaped with status, -1 if reaped elsewhere. */
+};
+/* }}} */
+
+/* {{{ struct rexec_file */
+/* The stdin, stdout and stderr objects. The descriptor is owned by the
+ * rexec_state, the copy in the ratchet_io header is kept for the kernel. */
+struct rexec_file
+{
+	struct ratchet_io io;
+	int *fd;
 };
 /* }}} */
 
@@ -141,6 +153,11 @@ static int start_process (lua_State *L, struct rexec_state *state, char *const *
 			_exit (1);
 		close (state->errfds[1]);
 
+		/* Signals blocked for the kernel's signalfd are not the command's. */
+		sigset_t none;
+		sigemptyset (&none);
+		sigprocmask (SIG_SETMASK, &none, NULL);
+
 		if (-1 == execvp (argv[0], argv))
 			_exit (1);
 	}
@@ -235,6 +252,31 @@ static int rexec_new (lua_State *L)
 }
 /* }}} */
 
+/* {{{ close_files() */
+/* Marks the file objects of the exec object at index as closed. */
+static void close_files (lua_State *L, int index)
+{
+	static const char *names[] = {"stdin", "stdout", "stderr", NULL};
+	int i;
+
+	lua_getuservalue (L, index);
+	if (!lua_istable (L, -1))
+	{
+		lua_pop (L, 1);
+		return;
+	}
+	for (i=0; names[i]; i++)
+	{
+		lua_getfield (L, -1, names[i]);
+		struct rexec_file *file = (struct rexec_file *) lua_touserdata (L, -1);
+		if (file)
+			file->io.fd = -1;
+		lua_pop (L, 1);
+	}
+	lua_pop (L, 1);
+}
+/* }}} */
+
 /* ---- Member Functions ---------------------------------------------------- */
 
 /* {{{ rexec_clean_up() */
@@ -247,7 +289,8 @@ static int rexec_clean_up (lua_State *L)
 	state->infds[1] = -1;
 	state->outfds[0] = -1;
 	state->errfds[0] = -1;
-	if (state->pid > 0)
+	close_files (L, 1);
+	if (state->pid > 0 && !state->exited)
 		waitpid (state->pid, NULL, WNOHANG);
 	state->pid = 0;
 	return 0;
@@ -264,6 +307,18 @@ static int rexec_get_argv (lua_State *L)
 }
 /* }}} */
 
+/* {{{ push_file() */
+static void push_file (lua_State *L, int *fd, const char *meta)
+{
+	struct rexec_file *file = (struct rexec_file *) lua_newuserdata (L, sizeof (struct rexec_file));
+	file->io.fd = *fd;
+	file->io.timeout = -1.0;
+	file->fd = fd;
+	luaL_getmetatable (L, meta);
+	lua_setmetatable (L, -2);
+}
+/* }}} */
+
 /* {{{ rexec_start() */
 static int rexec_start (lua_State *L)
 {
@@ -279,25 +334,15 @@ static int rexec_start (lua_State *L)
 	lua_pushnumber (L, (lua_Number) start_time);
 	lua_setfield (L, -2, "start_time");
 
-	int **infd = (int **) lua_newuserdata (L, sizeof (int *));
-	luaL_getmetatable (L, "ratchet_exec_file_write_meta");
-	lua_setmetatable (L, -2);
+	push_file (L, &state->infds[1], "ratchet_exec_file_write_meta");
 	lua_setfield (L, -2, "stdin");
 
-	int **outfd = (int **) lua_newuserdata (L, sizeof (int *));
-	luaL_getmetatable (L, "ratchet_exec_file_read_meta");
-	lua_setmetatable (L, -2);
+	push_file (L, &state->outfds[0], "ratchet_exec_file_read_meta");
 	lua_setfield (L, -2, "stdout");
 
-	int **errfd = (int **) lua_newuserdata (L, sizeof (int *));
-	luaL_getmetatable (L, "ratchet_exec_file_read_meta");
-	lua_setmetatable (L, -2);
+	push_file (L, &state->errfds[0], "ratchet_exec_file_read_meta");
 	lua_setfield (L, -2, "stderr");
 
-	*infd = &state->infds[1];
-	*outfd = &state->outfds[0];
-	*errfd = &state->errfds[0];
-
 	lua_pushinteger (L, (int) state->pid);
 	return 1;
 }
@@ -355,6 +400,34 @@ static int rexec_stderr (lua_State *L)
 }
 /* }}} */
 
+/* {{{ child_exited() */
+/* Called by the kernel once it reaps the process, with the ratchet object
+ * and the wait status, or no status if something else reaped it first. The
+ * exec object is the upvalue. */
+static int child_exited (lua_State *L)
+{
+	struct rexec_state *state = (struct rexec_state *) lua_touserdata (L, lua_upvalueindex (1));
+	if (lua_isnumber (L, 2))
+	{
+		state->status = (int) lua_tointeger (L, 2);
+		state->exited = 1;
+	}
+	else
+		state->exited = -1;
+
+	lua_getuservalue (L, lua_upvalueindex (1));
+	lua_getfield (L, -1, "waiter");
+	if (lua_isthread (L, -1))
+	{
+		lua_pushnil (L);
+		lua_setfield (L, -3, "waiter");
+		ratchet_wake_thread (L, -1, 0);
+	}
+
+	return 0;
+}
+/* }}} */
+
 /* {{{ rexec_wait() */
 static int rexec_wait (lua_State *L)
 {
@@ -366,24 +439,75 @@ static int rexec_wait (lua_State *L)
 	lua_getctx (L, &ctx);
 	if (ctx == 1 && !lua_toboolean (L, 3))
 		timed_out = 1;
+	else if (ctx == 2)
+	{
+		/* The kernel is on top, have it reap the process for this thread. */
+		lua_insert (L, 1);
+		lua_pushvalue (L, 2);
+		lua_pushcclosure (L, child_exited, 1);
+		int watched = ratchet_watch_child (L, state->pid);
+		lua_remove (L, 1);
+		if (watched && !state->exited)
+		{
+			lua_getuservalue (L, 1);
+			lua_pushthread (L);
+			lua_setfield (L, -2, "waiter");
+			lua_settop (L, 2);
+			if (lua_isnumber (L, 2))
+			{
+				lua_pushlightuserdata (L, RATCHET_YIELD_TIMEOUT);
+				lua_pushvalue (L, 2);
+				return lua_yieldk (L, 2, 3, rexec_wait);
+			}
+			lua_pushlightuserdata (L, RATCHET_YIELD_PAUSE);
+			return lua_yieldk (L, 1, 3, rexec_wait);
+		}
+		ctx = 1;
+	}
+	else if (ctx == 3)
+	{
+		timed_out = 1;
+		lua_getuservalue (L, 1);
+		lua_pushnil (L);
+		lua_setfield (L, -2, "waiter");
+	}
 	lua_settop (L, 2);
 
-	int status = 0;
-	pid_t ret = waitpid (state->pid, &status, WNOHANG);
-	if (ret == -1)
+	if (state->exited < 0)
+	{
+		state->pid = 0;
+		state->exited = 0;
+		rexec_clean_up (L);
+		errno = ECHILD;
 		return ratchet_error_errno (L, "ratchet.exec.wait()", "waitpid");
-	else if (0 == ret)
+	}
+
+	int status = state->status;
+	if (!state->exited)
 	{
-		if (timed_out)
-			return ratchet_error_str (L, "ratchet.exec.wait()", "ETIMEDOUT", "Timed out on wait.");
+		pid_t ret = waitpid (state->pid, &status, WNOHANG);
+		if (ret == -1)
+			return ratchet_error_errno (L, "ratchet.exec.wait()", "waitpid");
+		else if (0 == ret)
+		{
+			if (timed_out)
+				return ratchet_error_str (L, "ratchet.exec.wait()", "ETIMEDOUT", "Timed out on wait.");
 
-		lua_pushlightuserdata (L, RATCHET_YIELD_SIGNAL);
-		lua_pushinteger (L, SIGCHLD);
-		lua_pushvalue (L, 2);
-		return lua_yieldk (L, 3, 1, rexec_wait);
+			if (0 == ctx)
+			{
+				lua_pushlightuserdata (L, RATCHET_YIELD_GET);
+				return lua_yieldk (L, 1, 2, rexec_wait);
+			}
+
+			lua_pushlightuserdata (L, RATCHET_YIELD_SIGNAL);
+			lua_pushinteger (L, SIGCHLD);
+			lua_pushvalue (L, 2);
+			return lua_yieldk (L, 3, 1, rexec_wait);
+		}
 	}
 
 	state->pid = 0;
+	state->exited = 0;
 	rexec_clean_up (L);
 
 	lua_pushinteger (L, (lua_Integer) WEXITSTATUS (status));
@@ -621,6 +745,10 @@ static int rexec_kill (lua_State *L)
 	if (-1 == sig)
 		return luaL_argerror (L, 2, "Invalid signal.");
 
+	/* Already reaped by the kernel, waiting for wait() to collect it. */
+	if (state->exited)
+		return 0;
+
 	if (-1 == kill (state->pid, sig))
 		return ratchet_error_errno (L, "ratchet.exec.kill()", "kill");
 
@@ -631,8 +759,8 @@ static int rexec_kill (lua_State *L)
 /* {{{ rexec_file_get_fd() */
 static int rexec_file_get_fd (lua_State *L)
 {
-	int fd = (** (int **) lua_topointer (L, 1));
-	lua_pushinteger (L, fd);
+	struct rexec_file *file = (struct rexec_file *) lua_touserdata (L, 1);
+	lua_pushinteger (L, file->io.fd);
 	return 1;
 }
 /* }}} */
@@ -640,10 +768,11 @@ static int rexec_file_get_fd (lua_State *L)
 /* {{{ rexec_file_close() */
 static int rexec_file_close (lua_State *L)
 {
-	int *fd = (* (int **) lua_topointer (L, 1));
-	if (*fd >= 0)
-		close (*fd);
-	*fd = -1;
+	struct rexec_file *file = (struct rexec_file *) lua_touserdata (L, 1);
+	if (*file->fd >= 0)
+		close (*file->fd);
+	*file->fd = -1;
+	file->io.fd = -1;
 	return 0;
 }
 /* }}} */
@@ -651,7 +780,7 @@ static int rexec_file_close (lua_State *L)
 /* {{{ rexec_file_read() */
 static int rexec_file_read (lua_State *L)
 {
-	int fd = (** (int **) luaL_checkudata (L, 1, "ratchet_exec_file_read_meta"));
+	int fd = ((struct rexec_file *) luaL_checkudata (L, 1, "ratchet_exec_file_read_meta"))->io.fd;
 	luaL_Buffer buffer;
 	ssize_t ret;
 
@@ -684,10 +813,40 @@ static int rexec_file_read (lua_State *L)
 }
 /* }}} */
 
+/* {{{ rexec_file_read_into() */
+static int rexec_file_read_into (lua_State *L)
+{
+	int fd = ((struct rexec_file *) luaL_checkudata (L, 1, "ratchet_exec_file_read_meta"))->io.fd;
+	struct ratchet_buffer *buf = ratchet_buffer_check (L, 2);
+	size_t len = (size_t) luaL_optunsigned (L, 3, (lua_Unsigned) LUAL_BUFFERSIZE);
+	ssize_t ret;
+
+	lua_settop (L, 3);
+
+	char *prepped = ratchet_buffer_prep (L, buf, len);
+	ret = read (fd, prepped, len);
+	if (ret == -1)
+	{
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+		{
+			lua_pushlightuserdata (L, RATCHET_YIELD_READ);
+			lua_pushvalue (L, 1);
+			return lua_yieldk (L, 2, 1, rexec_file_read_into);
+		}
+		else
+			return ratchet_error_errno (L, "ratchet.exec.file.read_into()", "read");
+	}
+	ratchet_buffer_add (buf, (size_t) ret);
+
+	lua_pushinteger (L, (lua_Integer) ret);
+	return 1;
+}
+/* }}} */
+
 /* {{{ rexec_file_write() */
 static int rexec_file_write (lua_State *L)
 {
-	int fd = (** (int **) luaL_checkudata (L, 1, "ratchet_exec_file_write_meta"));
+	int fd = ((struct rexec_file *) luaL_checkudata (L, 1, "ratchet_exec_file_write_meta"))->io.fd;
 	size_t data_len, remaining;
 	const char *data = luaL_checklstring (L, 2, &data_len);
 	ssize_t ret;
@@ -763,6 +922,7 @@ int luaopen_ratchet_exec (lua_State *L)
 		/* Documented methods. */
 		{"get_fd", rexec_file_get_fd},
 		{"read", rexec_file_read},
+		{"read_into", rexec_file_read_into},
 		{"close", rexec_file_close},
 		/* Undocumented, helper methods. */
 		{NULL}
@@ -780,9 +940,11 @@ int luaopen_ratchet_exec (lua_State *L)
 
 	/* Set up file stream metatables. */
 	luaL_newmetatable (L, "ratchet_exec_file_read_meta");
+	ratchet_io_register (L, -1);
 	luaL_newlib (L, readfilemeths);
 	lua_setfield (L, -2, "__index");
 	luaL_newmetatable (L, "ratchet_exec_file_write_meta");
+	ratchet_io_register (L, -1);
 	luaL_newlib (L, writefilemeths);
 	lua_setfield (L, -2, "__index");
 	lua_pop (L, 2);
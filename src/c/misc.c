@@ -26,11 +26,13 @@
 #include <lualib.h>
 
 #include <stdarg.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <time.h>
 #include <signal.h>
 #include <math.h>
 #include <string.h>
@@ -149,6 +151,15 @@ int gettimespec_opt (lua_State *L, int index, struct timespec *tv)
 }
 /* }}} */
 
+/* {{{ monotonic_time() */
+double monotonic_time (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return fromtimespec (&ts);
+}
+/* }}} */
+
 /* {{{ get_signal() */
 int get_signal (lua_State *L, int index, int def)
 {
@@ -306,4 +317,64 @@ void fstackdump_ln (lua_State *L, FILE *out, const char *file, int line)
 }
 /* }}} */
 
+/* {{{ refqueue_init() */
+void refqueue_init (struct refqueue *q)
+{
+	memset (q, 0, sizeof (struct refqueue));
+}
+/* }}} */
+
+/* {{{ refqueue_free() */
+void refqueue_free (lua_State *L, struct refqueue *q)
+{
+	size_t i;
+	for (i=0; i<q->size; i++)
+		luaL_unref (L, LUA_REGISTRYINDEX, q->refs[(q->head + i) & (q->alloc - 1)]);
+	free (q->refs);
+	refqueue_init (q);
+}
+/* }}} */
+
+/* {{{ refqueue_push() */
+void refqueue_push (lua_State *L, struct refqueue *q, int index)
+{
+	if (q->size == q->alloc)
+	{
+		size_t i, new_alloc = (q->alloc ? q->alloc * 2 : 16);
+		int *new_refs = (int *) malloc (sizeof (int) * new_alloc);
+		if (!new_refs)
+		{
+			luaL_error (L, "Could not grow queue to %d entries.", (int) new_alloc);
+			return;
+		}
+		for (i=0; i<q->size; i++)
+			new_refs[i] = q->refs[(q->head + i) & (q->alloc - 1)];
+		free (q->refs);
+		q->refs = new_refs;
+		q->head = 0;
+		q->alloc = new_alloc;
+	}
+
+	lua_pushvalue (L, index);
+	q->refs[(q->head + q->size) & (q->alloc - 1)] = luaL_ref (L, LUA_REGISTRYINDEX);
+	q->size++;
+}
+/* }}} */
+
+/* {{{ refqueue_pop() */
+int refqueue_pop (lua_State *L, struct refqueue *q)
+{
+	if (!q->size)
+		return 0;
+
+	int ref = q->refs[q->head];
+	q->head = (q->head + 1) & (q->alloc - 1);
+	q->size--;
+
+	lua_rawgeti (L, LUA_REGISTRYINDEX, ref);
+	luaL_unref (L, LUA_REGISTRYINDEX, ref);
+	return 1;
+}
+/* }}} */
+
 // vim:fdm=marker:ai:ts=4:sw=4:noet:
@@ -10,6 +10,15 @@
 #define stackdump(L) fstackdump_ln (L, stdout, __FILE__, __LINE__)
 #define fstackdump(L, out) fstackdump_ln (L, out, __FILE__, __LINE__)
 
+/* FIFO ring buffer of registry references, with constant-time push and pop. */
+struct refqueue
+{
+	int *refs;
+	size_t head;
+	size_t size;
+	size_t alloc;
+};
+
 int strmatch (lua_State *L, int index, const char *match);
 int strequal (lua_State *L, int index, const char *s2);
 double fromtimeval (struct timeval *tv);
@@ -20,10 +29,15 @@ double fromtimespec (struct timespec *tv);
 int gettimespec (double secs, struct timespec *tv);
 int gettimespec_arg (lua_State *L, int index, struct timespec *tv);
 int gettimespec_opt (lua_State *L, int index, struct timespec *tv);
+double monotonic_time (void);
 int get_signal (lua_State *L, int index, int def);
 int set_nonblocking (int fd);
 int set_closeonexec (int fd);
 void fstackdump_ln (lua_State *L, FILE *out, const char *file, int line);
+void refqueue_init (struct refqueue *q);
+void refqueue_free (lua_State *L, struct refqueue *q);
+void refqueue_push (lua_State *L, struct refqueue *q, int index);
+int refqueue_pop (lua_State *L, struct refqueue *q);
 
 #endif
 // vim:fdm=marker:ai:ts=4:sw=4:noet:
@@ -0,0 +1,589 @@
+/* Copyright (c) 2010 Ian C. Good
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include <event2/event.h>
+#include <sys/types.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pwd.h>
+
+#include "ratchet.h"
+#include "misc.h"
+
+#ifndef RATCHET_OFFLOAD_THREADS
+#define RATCHET_OFFLOAD_THREADS 4
+#endif
+
+struct offload_kernel;
+
+/* {{{ struct offload_task */
+struct offload_task
+{
+	const struct ratchet_offload_job *job;
+	void *data;
+	int thread_ref;
+	struct offload_kernel *kernel;
+	struct offload_task *next;
+};
+/* }}} */
+
+/* {{{ struct offload_kernel */
+/* Completion state shared between one ratchet object and the pool threads.
+ * It is reference counted by the ratchet object and each task still being
+ * run, so pool threads never see it freed. Tasks move from done, filled by
+ * the pool threads, to finishing, which only the loop thread uses. */
+struct offload_kernel
+{
+	pthread_mutex_t lock;
+	int refs;
+	int fd;
+	struct event *ev;
+	struct offload_task *done;
+	struct offload_task *finishing;
+	int outstanding;
+	lua_State *L;
+};
+/* }}} */
+
+/* {{{ struct offload_pool */
+static struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct offload_task *head;
+	struct offload_task *tail;
+	int started;
+	int atfork;
+} pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0, 0};
+/* }}} */
+
+/* {{{ free_task_list() */
+static void free_task_list (struct offload_task *task)
+{
+	while (task)
+	{
+		struct offload_task *next = task->next;
+		free (task->data);
+		free (task);
+		task = next;
+	}
+}
+/* }}} */
+
+/* {{{ release_offload_kernel() */
+static void release_offload_kernel (struct offload_kernel *k)
+{
+	pthread_mutex_lock (&k->lock);
+	int refs = --k->refs;
+	pthread_mutex_unlock (&k->lock);
+
+	if (refs == 0)
+	{
+		free_task_list (k->done);
+		free_task_list (k->finishing);
+		close (k->fd);
+		pthread_mutex_destroy (&k->lock);
+		free (k);
+	}
+}
+/* }}} */
+
+/* {{{ offload_worker() */
+static void *offload_worker (void *arg)
+{
+	while (1)
+	{
+		pthread_mutex_lock (&pool.lock);
+		while (!pool.head)
+			pthread_cond_wait (&pool.cond, &pool.lock);
+		struct offload_task *task = pool.head;
+		pool.head = task->next;
+		if (!pool.head)
+			pool.tail = NULL;
+		pthread_mutex_unlock (&pool.lock);
+
+		if (task->job->run)
+			task->job->run (task->data);
+
+		/* Hand the task back to its kernel and wake up its event loop. */
+		struct offload_kernel *k = task->kernel;
+		pthread_mutex_lock (&k->lock);
+		task->next = k->done;
+		k->done = task;
+		pthread_mutex_unlock (&k->lock);
+
+		uint64_t one = 1;
+		while (-1 == write (k->fd, &one, sizeof (one)) && errno == EINTR);
+
+		release_offload_kernel (k);
+	}
+
+	return NULL;
+}
+/* }}} */
+
+/* {{{ reset_pool_in_child() */
+static void reset_pool_in_child (void)
+{
+	/* Pool threads do not survive fork(), start new ones if needed. */
+	pthread_mutex_init (&pool.lock, NULL);
+	pthread_cond_init (&pool.cond, NULL);
+	pool.head = pool.tail = NULL;
+	pool.started = 0;
+}
+/* }}} */
+
+/* {{{ submit_task() */
+static int submit_task (struct offload_task *task)
+{
+	int i, ret = 0;
+
+	pthread_mutex_lock (&pool.lock);
+	if (!pool.started)
+	{
+		if (!pool.atfork)
+			pool.atfork = (0 == pthread_atfork (NULL, NULL, reset_pool_in_child));
+
+		/* Pool threads inherit a full signal mask, so signals meant for
+		 * signalfd or sigwait() are only ever pending on the loop thread. */
+		sigset_t all, old;
+		sigfillset (&all);
+		pthread_sigmask (SIG_SETMASK, &all, &old);
+		for (i=0; i<RATCHET_OFFLOAD_THREADS; i++)
+		{
+			pthread_t thread;
+			ret = pthread_create (&thread, NULL, offload_worker, NULL);
+			if (ret != 0)
+				break;
+			pthread_detach (thread);
+		}
+		pthread_sigmask (SIG_SETMASK, &old, NULL);
+		if (i == 0)
+		{
+			pthread_mutex_unlock (&pool.lock);
+			return ret;
+		}
+		pool.started = 1;
+	}
+
+	task->next = NULL;
+	if (pool.tail)
+		pool.tail->next = task;
+	else
+		pool.head = task;
+	pool.tail = task;
+	pthread_cond_signal (&pool.cond);
+	pthread_mutex_unlock (&pool.lock);
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ prepare_task() */
+static int prepare_task (lua_State *L)
+{
+	struct offload_task *task = (struct offload_task *) lua_touserdata (L, 1);
+
+	task->data = task->job->prepare (L, 2);
+	return 0;
+}
+/* }}} */
+
+/* {{{ finish_task() */
+static int finish_task (lua_State *L)
+{
+	struct offload_task *task = (struct offload_task *) lua_touserdata (L, 1);
+	lua_pop (L, 1);
+
+	if (task->job->finish)
+		return task->job->finish (L, task->data);
+	return 0;
+}
+/* }}} */
+
+/* {{{ wake_finished_tasks() */
+static int wake_finished_tasks (lua_State *L)
+{
+	struct offload_kernel *k = (struct offload_kernel *) lua_touserdata (L, 2);
+	lua_settop (L, 2);
+
+	pthread_mutex_lock (&k->lock);
+	struct offload_task *done = k->done, *task = NULL, **tail;
+	k->done = NULL;
+	pthread_mutex_unlock (&k->lock);
+
+	/* Reverse the list, so threads wake in the order their jobs finished,
+	 * behind any left over from a call that raised an error. */
+	while (done)
+	{
+		struct offload_task *next = done->next;
+		done->next = task;
+		task = done;
+		done = next;
+	}
+	for (tail = &k->finishing; *tail; tail = &(*tail)->next);
+	*tail = task;
+
+	/* Each task is released before its thread is woken, so an error can
+	 * only leave the remaining ones behind, not leak them. */
+	while (k->finishing)
+	{
+		task = k->finishing;
+		k->finishing = task->next;
+		k->outstanding--;
+
+		lua_rawgeti (L, LUA_REGISTRYINDEX, task->thread_ref);
+		luaL_unref (L, LUA_REGISTRYINDEX, task->thread_ref);
+
+		/* The thread resumes with true and the results, or false and the error. */
+		lua_pushcfunction (L, finish_task);
+		lua_pushlightuserdata (L, task);
+		int ret = lua_pcall (L, 1, LUA_MULTRET, 0);
+		free (task->data);
+		free (task);
+
+		lua_pushboolean (L, ret == LUA_OK);
+		lua_insert (L, 4);
+		ratchet_wake_thread (L, 3, lua_gettop (L) - 3);
+		lua_settop (L, 2);
+	}
+
+	if (k->outstanding == 0)
+		event_del (k->ev);
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ offload_triggered() */
+static void offload_triggered (int fd, short event, void *arg)
+{
+	struct offload_kernel *k = (struct offload_kernel *) arg;
+
+	uint64_t count;
+	while (-1 == read (fd, &count, sizeof (count)) && errno == EINTR);
+
+	/* k->L holds the ratchet object at index 1. */
+	lua_pushcfunction (k->L, wake_finished_tasks);
+	lua_pushvalue (k->L, 1);
+	lua_pushlightuserdata (k->L, k);
+	if (LUA_OK != lua_pcall (k->L, 2, 0, 0))
+	{
+		ratchet_report_error (k->L, "ratchet.thread.offload()");
+
+		/* Carry on with the tasks left behind on the next iteration. */
+		if (k->finishing)
+			event_active (k->ev, EV_READ, 1);
+	}
+}
+/* }}} */
+
+/* {{{ roffload_kernel_gc() */
+static int roffload_kernel_gc (lua_State *L)
+{
+	struct offload_kernel **k = (struct offload_kernel **) luaL_checkudata (L, 1, "ratchet_offload_kernel_meta");
+	if (*k)
+	{
+		event_free ((*k)->ev);
+		release_offload_kernel (*k);
+		*k = NULL;
+	}
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ get_offload_kernel() */
+static struct offload_kernel *get_offload_kernel (lua_State *L)
+{
+	lua_getuservalue (L, 1);
+	lua_getfield (L, -1, "offload");
+	struct offload_kernel **k = (struct offload_kernel **) lua_touserdata (L, -1);
+	lua_pop (L, 2);
+	if (k)
+		return *k;
+
+	struct event_base *e_b = ratchet_get_event_base (L, 1);
+
+	k = (struct offload_kernel **) lua_newuserdata (L, sizeof (struct offload_kernel *));
+	*k = NULL;
+	if (luaL_newmetatable (L, "ratchet_offload_kernel_meta"))
+	{
+		lua_pushcfunction (L, roffload_kernel_gc);
+		lua_setfield (L, -2, "__gc");
+	}
+	lua_setmetatable (L, -2);
+
+	struct offload_kernel *new = (struct offload_kernel *) malloc (sizeof (struct offload_kernel));
+	if (!new)
+		luaL_error (L, "Failed to allocate offload state.");
+	memset (new, 0, sizeof (struct offload_kernel));
+	new->fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (new->fd < 0)
+	{
+		free (new);
+		ratchet_error_errno (L, "ratchet.thread.offload()", "eventfd");
+	}
+	pthread_mutex_init (&new->lock, NULL);
+	new->refs = 1;
+	new->ev = event_new (e_b, new->fd, EV_READ | EV_PERSIST, offload_triggered, new);
+	*k = new;
+
+	/* A helper thread, holding the ratchet object, runs completions. */
+	lua_createtable (L, 0, 1);
+	new->L = lua_newthread (L);
+	lua_pushvalue (L, 1);
+	lua_xmove (L, new->L, 1);
+	lua_setfield (L, -2, "thread");
+	lua_setuservalue (L, -2);
+
+	lua_getuservalue (L, 1);
+	lua_pushvalue (L, -2);
+	lua_setfield (L, -2, "offload");
+	lua_pop (L, 2);
+
+	return new;
+}
+/* }}} */
+
+/* {{{ check_offload_job() */
+static const struct ratchet_offload_job *check_offload_job (lua_State *L, int index)
+{
+	/* A light userdata is only trusted if it is a registered job. */
+	int is_pointer = lua_islightuserdata (L, index);
+	const char *name = (is_pointer ? NULL : luaL_checkstring (L, index));
+	const struct ratchet_offload_job *job = NULL;
+	lua_getfield (L, LUA_REGISTRYINDEX, "ratchet_offload_jobs");
+	if (lua_istable (L, -1))
+	{
+		if (is_pointer)
+			lua_rawgetp (L, -1, lua_touserdata (L, index));
+		else
+			lua_getfield (L, -1, name);
+		job = (const struct ratchet_offload_job *) lua_touserdata (L, -1);
+		lua_pop (L, 1);
+	}
+	lua_pop (L, 1);
+
+	if (!job && is_pointer)
+		luaL_argerror (L, index, "unknown offload job");
+	else if (!job)
+		luaL_argerror (L, index, lua_pushfstring (L, "unknown offload job: %s", name));
+	return job;
+}
+/* }}} */
+
+/* ---- getpwnam Job -------------------------------------------------------- */
+
+/* {{{ struct getpwnam_data */
+struct getpwnam_data
+{
+	struct passwd pwd;
+	struct passwd *result;
+	int error;
+	char *name;
+	size_t buflen;
+	char buf[1];
+};
+/* }}} */
+
+/* {{{ getpwnam_prepare() */
+static void *getpwnam_prepare (lua_State *L, int index)
+{
+	size_t name_len;
+	const char *name = luaL_checklstring (L, index, &name_len);
+
+	long buflen = sysconf (_SC_GETPW_R_SIZE_MAX);
+	if (buflen <= 0)
+		buflen = 16384;
+
+	struct getpwnam_data *data = (struct getpwnam_data *) malloc (sizeof (struct getpwnam_data) + buflen + name_len + 1);
+	if (!data)
+		luaL_error (L, "Failed to allocate getpwnam job.");
+	data->buflen = (size_t) buflen;
+	data->name = data->buf + buflen;
+	memcpy (data->name, name, name_len+1);
+
+	return data;
+}
+/* }}} */
+
+/* {{{ getpwnam_run() */
+static void getpwnam_run (void *arg)
+{
+	struct getpwnam_data *data = (struct getpwnam_data *) arg;
+	data->error = getpwnam_r (data->name, &data->pwd, data->buf, data->buflen, &data->result);
+}
+/* }}} */
+
+/* {{{ getpwnam_finish() */
+static int getpwnam_finish (lua_State *L, void *arg)
+{
+	struct getpwnam_data *data = (struct getpwnam_data *) arg;
+
+	if (data->error)
+	{
+		errno = data->error;
+		return ratchet_error_errno (L, "ratchet.thread.offload()", "getpwnam_r");
+	}
+
+	if (!data->result)
+	{
+		lua_pushnil (L);
+		return 1;
+	}
+
+	lua_createtable (L, 0, 6);
+	lua_pushstring (L, data->pwd.pw_name);
+	lua_setfield (L, -2, "name");
+	lua_pushinteger (L, (lua_Integer) data->pwd.pw_uid);
+	lua_setfield (L, -2, "uid");
+	lua_pushinteger (L, (lua_Integer) data->pwd.pw_gid);
+	lua_setfield (L, -2, "gid");
+	lua_pushstring (L, data->pwd.pw_gecos);
+	lua_setfield (L, -2, "gecos");
+	lua_pushstring (L, data->pwd.pw_dir);
+	lua_setfield (L, -2, "dir");
+	lua_pushstring (L, data->pwd.pw_shell);
+	lua_setfield (L, -2, "shell");
+
+	return 1;
+}
+/* }}} */
+
+static const struct ratchet_offload_job getpwnam_job = {"getpwnam", getpwnam_prepare, getpwnam_run, getpwnam_finish};
+
+/* ---- Public Functions ---------------------------------------------------- */
+
+/* {{{ ratchet_offload_register() */
+void ratchet_offload_register (lua_State *L, const struct ratchet_offload_job *job)
+{
+	lua_getfield (L, LUA_REGISTRYINDEX, "ratchet_offload_jobs");
+	if (!lua_istable (L, -1))
+	{
+		lua_pop (L, 1);
+		lua_newtable (L);
+		lua_pushvalue (L, -1);
+		lua_setfield (L, LUA_REGISTRYINDEX, "ratchet_offload_jobs");
+	}
+
+	lua_pushlightuserdata (L, (void *) job);
+	lua_setfield (L, -2, job->name);
+	lua_pushlightuserdata (L, (void *) job);
+	lua_rawsetp (L, -2, job);
+	lua_pop (L, 1);
+}
+/* }}} */
+
+/* {{{ ratchet_offload() */
+static int ratchet_offload (lua_State *L)
+{
+	int ctx = 0;
+	if (LUA_OK == lua_getctx (L, &ctx))
+	{
+		lua_pushlightuserdata (L, RATCHET_YIELD_GET);
+		return lua_yieldk (L, 1, 1, ratchet_offload);
+	}
+
+	/* Resumed with the results of the job. */
+	if (ctx == 2)
+	{
+		if (!lua_toboolean (L, 1))
+			return lua_error (L);
+		return lua_gettop (L) - 1;
+	}
+
+	lua_insert (L, 1);
+	const struct ratchet_offload_job *job = check_offload_job (L, 2);
+	struct offload_kernel *k = get_offload_kernel (L);
+
+	struct offload_task *task = (struct offload_task *) malloc (sizeof (struct offload_task));
+	if (!task)
+		return luaL_error (L, "Failed to allocate offload task.");
+	memset (task, 0, sizeof (struct offload_task));
+	task->job = job;
+	task->kernel = k;
+
+	/* prepare() may raise an error, which must not leak the task. */
+	if (job->prepare)
+	{
+		lua_pushcfunction (L, prepare_task);
+		lua_pushlightuserdata (L, task);
+		lua_insert (L, 3);
+		lua_insert (L, 3);
+		if (LUA_OK != lua_pcall (L, lua_gettop (L) - 3, 0, 0))
+		{
+			free (task);
+			return lua_error (L);
+		}
+	}
+
+	lua_pushthread (L);
+	task->thread_ref = luaL_ref (L, LUA_REGISTRYINDEX);
+
+	pthread_mutex_lock (&k->lock);
+	k->refs++;
+	pthread_mutex_unlock (&k->lock);
+
+	int ret = submit_task (task);
+	if (ret != 0)
+	{
+		release_offload_kernel (k);
+		luaL_unref (L, LUA_REGISTRYINDEX, task->thread_ref);
+		free (task->data);
+		free (task);
+		errno = ret;
+		return ratchet_error_errno (L, "ratchet.thread.offload()", "pthread_create");
+	}
+
+	/* The completion event only stays added while there are jobs running. */
+	if (0 == k->outstanding++)
+		event_add (k->ev, NULL);
+
+	lua_settop (L, 0);
+	lua_pushlightuserdata (L, RATCHET_YIELD_PAUSE);
+	return lua_yieldk (L, 1, 2, ratchet_offload);
+}
+/* }}} */
+
+/* {{{ luaopen_ratchet_offload() */
+int luaopen_ratchet_offload (lua_State *L)
+{
+	ratchet_offload_register (L, &getpwnam_job);
+
+	lua_pushcfunction (L, ratchet_offload);
+	return 1;
+}
+/* }}} */
+
+// vim:fdm=marker:ai:ts=4:sw=4:noet:
@@ -0,0 +1,422 @@
+/* Copyright (c) 2010 Ian C. Good
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include <string.h>
+#include <event2/event.h>
+
+#include "ratchet.h"
+
+#define get_pollset(L, i) ((struct pollset *) luaL_checkudata (L, i, "ratchet_pollset_meta"))
+#define item_event(item) ((struct event *) ((item) + 1))
+
+/* {{{ struct pollset_item */
+/* One registered object. Its struct event lives directly after this struct
+ * in the same userdata and is assigned once, then armed one-shot: an item
+ * that fires stays out of the event loop on the ready list until wait()
+ * returns it, and is re-armed by the following wait(). Idle items cost
+ * nothing per wait. */
+struct pollset_item
+{
+	struct pollset *ps;
+	int fd;
+	short events;
+	int assigned;
+	struct pollset_item *next;
+	struct pollset_item **pprev;
+};
+/* }}} */
+
+/* {{{ struct pollset */
+struct pollset
+{
+	struct event_base *base;
+	lua_State *waiter;
+	struct pollset_item *ready;
+	struct pollset_item *pending;
+};
+/* }}} */
+
+/* {{{ item_unlink() */
+static void item_unlink (struct pollset_item *item)
+{
+	if (item->pprev)
+	{
+		*item->pprev = item->next;
+		if (item->next)
+			item->next->pprev = item->pprev;
+	}
+	item->next = NULL;
+	item->pprev = NULL;
+}
+/* }}} */
+
+/* {{{ item_link() */
+static void item_link (struct pollset_item **head, struct pollset_item *item)
+{
+	item_unlink (item);
+	item->next = *head;
+	if (*head)
+		(*head)->pprev = &item->next;
+	item->pprev = head;
+	*head = item;
+}
+/* }}} */
+
+/* {{{ item_triggered() */
+static void item_triggered (int fd, short event, void *arg)
+{
+	struct pollset_item *item = (struct pollset_item *) arg;
+	struct pollset *ps = item->ps;
+	if (!ps)
+		return;
+
+	item_link (&ps->ready, item);
+
+	/* Ready the waiting thread, it collects everything that fired. */
+	lua_State *L1 = ps->waiter;
+	ps->waiter = NULL;
+	if (L1 && lua_isthread (L1, 1))
+	{
+		lua_State *L = lua_tothread (L1, 1);
+		lua_pushthread (L1);
+		lua_xmove (L1, L, 1);
+		lua_pushboolean (L, 1);
+		ratchet_wake_thread (L, -2, 1);
+		lua_pop (L, 1);
+	}
+}
+/* }}} */
+
+/* {{{ arm_pending() */
+static void arm_pending (struct pollset *ps)
+{
+	while (ps->pending)
+	{
+		struct pollset_item *item = ps->pending;
+		item_unlink (item);
+
+		if (!item->assigned)
+		{
+			event_assign (item_event (item), ps->base, item->fd, item->events, item_triggered, item);
+			item->assigned = 1;
+		}
+		event_add (item_event (item), NULL);
+	}
+}
+/* }}} */
+
+/* {{{ return_ready() */
+/* Returns a table of the objects that fired, moving them back to be armed by
+ * the next wait(), or nil if there are none. */
+static int return_ready (lua_State *L, struct pollset *ps, int uv)
+{
+	if (!ps->ready)
+		return 0;
+
+	int i = 0;
+	lua_newtable (L);
+	lua_getfield (L, uv, "objects");
+	while (ps->ready)
+	{
+		struct pollset_item *item = ps->ready;
+		item_link (&ps->pending, item);
+
+		lua_pushlightuserdata (L, item);
+		lua_rawget (L, -2);
+		lua_rawseti (L, -3, ++i);
+	}
+	lua_pop (L, 1);
+
+	return 1;
+}
+/* }}} */
+
+/* ---- Namespace Functions ------------------------------------------------- */
+
+/* {{{ rpollset_new() */
+static int rpollset_new (lua_State *L)
+{
+	struct pollset *ps = (struct pollset *) lua_newuserdata (L, sizeof (struct pollset));
+	memset (ps, 0, sizeof (struct pollset));
+
+	luaL_getmetatable (L, "ratchet_pollset_meta");
+	lua_setmetatable (L, -2);
+
+	lua_createtable (L, 0, 2);
+	lua_newtable (L);
+	lua_setfield (L, -2, "items");
+	lua_newtable (L);
+	lua_setfield (L, -2, "objects");
+	lua_setuservalue (L, -2);
+
+	return 1;
+}
+/* }}} */
+
+/* {{{ rpollset_call() */
+static int rpollset_call (lua_State *L)
+{
+	lua_remove (L, 1);
+	return rpollset_new (L);
+}
+/* }}} */
+
+/* ---- Member Functions ---------------------------------------------------- */
+
+/* {{{ rpollset_item_gc() */
+static int rpollset_item_gc (lua_State *L)
+{
+	struct pollset_item *item = (struct pollset_item *) lua_touserdata (L, 1);
+	if (item->assigned)
+		event_del (item_event (item));
+	item->assigned = 0;
+	item->ps = NULL;
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ rpollset_add() */
+static int rpollset_add (lua_State *L)
+{
+	struct pollset *ps = get_pollset (L, 1);
+	luaL_checkany (L, 2);
+	static const char *lst[] = {"read", "write", "both", NULL};
+	static const short events[] = {EV_READ, EV_WRITE, EV_READ | EV_WRITE};
+	int mode = luaL_checkoption (L, 3, "read", lst);
+	int fd = ratchet_get_fd (L, 2);
+	lua_settop (L, 2);
+
+	lua_getuservalue (L, 1);
+	lua_getfield (L, 3, "items");
+	lua_pushvalue (L, 2);
+	lua_rawget (L, 4);
+	struct pollset_item *item = (struct pollset_item *) lua_touserdata (L, -1);
+	if (item)
+	{
+		/* Already added, change what it waits for. */
+		if (item->assigned)
+			event_del (item_event (item));
+		item->assigned = 0;
+	}
+	else
+	{
+		item = (struct pollset_item *) lua_newuserdata (L, sizeof (struct pollset_item) + event_get_struct_event_size ());
+		memset (item, 0, sizeof (struct pollset_item));
+		item->ps = ps;
+		if (luaL_newmetatable (L, "ratchet_pollset_item_meta"))
+		{
+			lua_pushcfunction (L, rpollset_item_gc);
+			lua_setfield (L, -2, "__gc");
+		}
+		lua_setmetatable (L, -2);
+
+		/* Keeps the pollset alive until the item is finalized. */
+		lua_pushvalue (L, 1);
+		lua_setuservalue (L, -2);
+
+		lua_pushvalue (L, 2);
+		lua_pushvalue (L, -2);
+		lua_rawset (L, 4);
+		lua_getfield (L, 3, "objects");
+		lua_pushlightuserdata (L, item);
+		lua_pushvalue (L, 2);
+		lua_rawset (L, -3);
+	}
+
+	item->fd = fd;
+	item->events = events[mode];
+	item_link (&ps->pending, item);
+	if (ps->base)
+		arm_pending (ps);
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ rpollset_remove() */
+static int rpollset_remove (lua_State *L)
+{
+	(void) get_pollset (L, 1);
+	luaL_checkany (L, 2);
+	lua_settop (L, 2);
+
+	lua_getuservalue (L, 1);
+	lua_getfield (L, 3, "items");
+	lua_pushvalue (L, 2);
+	lua_rawget (L, 4);
+	struct pollset_item *item = (struct pollset_item *) lua_touserdata (L, -1);
+	if (!item)
+	{
+		lua_pushboolean (L, 0);
+		return 1;
+	}
+
+	if (item->assigned)
+		event_del (item_event (item));
+	item->assigned = 0;
+	item->ps = NULL;
+	item_unlink (item);
+
+	lua_pushvalue (L, 2);
+	lua_pushnil (L);
+	lua_rawset (L, 4);
+	lua_getfield (L, 3, "objects");
+	lua_pushlightuserdata (L, item);
+	lua_pushnil (L);
+	lua_rawset (L, -3);
+
+	lua_pushboolean (L, 1);
+	return 1;
+}
+/* }}} */
+
+/* {{{ rpollset_wait() */
+static int rpollset_wait (lua_State *L)
+{
+	struct pollset *ps = get_pollset (L, 1);
+	int ctx = 0;
+	lua_getctx (L, &ctx);
+
+	if (ctx == 2)
+	{
+		/* Woken by an item firing, or the timeout expiring. */
+		ps->waiter = NULL;
+		lua_settop (L, 2);
+		lua_getuservalue (L, 1);
+		lua_pushnil (L);
+		lua_setfield (L, 3, "waiter");
+		return return_ready (L, ps, 3);
+	}
+
+	if (ctx == 0)
+	{
+		lua_settop (L, 2);
+		if (ps->waiter && lua_isthread (ps->waiter, 1))
+			return ratchet_error_str (L, "ratchet.pollset.wait()", "EBUSY", "Another thread is waiting on the pollset.");
+
+		/* Items are registered with the event base of the first waiter. */
+		if (!ps->base)
+		{
+			lua_pushlightuserdata (L, RATCHET_YIELD_GET);
+			return lua_yieldk (L, 1, 1, rpollset_wait);
+		}
+	}
+	else
+	{
+		ps->base = ratchet_get_event_base (L, 3);
+		lua_settop (L, 2);
+	}
+
+	double timeout = (double) luaL_optnumber (L, 2, -1.0);
+	arm_pending (ps);
+
+	lua_getuservalue (L, 1);
+	if (return_ready (L, ps, 3))
+		return 1;
+	if (timeout == 0.0)
+		return 0;
+
+	ps->waiter = L;
+	lua_pushthread (L);
+	lua_setfield (L, 3, "waiter");
+	lua_settop (L, 2);
+
+	if (timeout > 0.0)
+	{
+		lua_pushlightuserdata (L, RATCHET_YIELD_TIMEOUT);
+		lua_pushnumber (L, timeout);
+		return lua_yieldk (L, 2, 2, rpollset_wait);
+	}
+
+	lua_pushlightuserdata (L, RATCHET_YIELD_PAUSE);
+	return lua_yieldk (L, 1, 2, rpollset_wait);
+}
+/* }}} */
+
+/* {{{ rpollset_get_num_items() */
+static int rpollset_get_num_items (lua_State *L)
+{
+	(void) get_pollset (L, 1);
+	int n = 0;
+
+	lua_getuservalue (L, 1);
+	lua_getfield (L, -1, "items");
+	for (lua_pushnil (L); lua_next (L, -2) != 0; lua_pop (L, 1))
+		n++;
+
+	lua_pushinteger (L, n);
+	return 1;
+}
+/* }}} */
+
+/* ---- Public Functions ---------------------------------------------------- */
+
+/* {{{ luaopen_ratchet_pollset() */
+int luaopen_ratchet_pollset (lua_State *L)
+{
+	/* Static functions in the ratchet.pollset namespace. */
+	const luaL_Reg funcs[] = {
+		{"new", rpollset_new},
+		{NULL}
+	};
+
+	/* Methods in the ratchet.pollset class. */
+	const luaL_Reg meths[] = {
+		/* Documented methods. */
+		{"add", rpollset_add},
+		{"remove", rpollset_remove},
+		{"wait", rpollset_wait},
+		{"get_num_items", rpollset_get_num_items},
+		/* Undocumented, helper methods. */
+		{NULL}
+	};
+
+	/* Set up the ratchet.pollset namespace functions. */
+	luaL_newlib (L, funcs);
+	lua_pushvalue (L, -1);
+	lua_setfield (L, LUA_REGISTRYINDEX, "ratchet_pollset_class");
+
+	/* Allow ratchet.pollset() as a shortcut for new(). */
+	lua_createtable (L, 0, 1);
+	lua_pushcfunction (L, rpollset_call);
+	lua_setfield (L, -2, "__call");
+	lua_setmetatable (L, -2);
+
+	/* Set up the ratchet.pollset class and metatables. */
+	luaL_newmetatable (L, "ratchet_pollset_meta");
+	lua_newtable (L);
+	luaL_setfuncs (L, meths, 0);
+	lua_setfield (L, -2, "__index");
+	lua_pop (L, 1);
+
+	return 1;
+}
+/* }}} */
+
+// vim:fdm=marker:ai:ts=4:sw=4:noet:
@@ -28,16 +28,205 @@
 
 #include <event2/event.h>
 #include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#if HAVE_SIGNALFD
+#include <sys/signalfd.h>
+#include <pthread.h>
+#endif
+#if HAVE_LIBURING
+#include <liburing.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#endif
 
 #include "ratchet.h"
 #include "misc.h"
+#include "timerwheel.h"
 
-#define get_event_base(L, index) (*(struct event_base **) luaL_checkudata (L, index, "ratchet_meta"))
+#define get_ratchet(L, index) ((struct ratchet *) luaL_checkudata (L, index, "ratchet_meta"))
+#define get_event_base(L, index) (get_ratchet (L, index)->base)
 #define get_thread(L, index, s) luaL_checktype (L, index, LUA_TTHREAD); lua_State *s = lua_tothread (L, index)
+#define thread_event(state) ((struct event *) ((state) + 1))
+
+#ifndef RATCHET_RUN_BUDGET
+#define RATCHET_RUN_BUDGET 64
+#endif
+
+#ifndef RATCHET_THREAD_POOL_SIZE
+#define RATCHET_THREAD_POOL_SIZE 0
+#endif
+
+#ifndef RATCHET_TIMER_GRANULARITY
+#define RATCHET_TIMER_GRANULARITY 10
+#endif
+
+/* Instructions between checks of a running thread against the watchdog. */
+#ifndef RATCHET_WATCHDOG_HOOK_COUNT
+#define RATCHET_WATCHDOG_HOOK_COUNT 1000
+#endif
+
+/* Size of the submission queue of kernels created with io_uring. */
+#ifndef RATCHET_URING_ENTRIES
+#define RATCHET_URING_ENTRIES 256
+#endif
+
+/* Signals read from the signalfd by each read() call. */
+#ifndef RATCHET_SIGNAL_BATCH
+#define RATCHET_SIGNAL_BATCH 16
+#endif
+
+#define RATCHET_NUM_PRIORITIES 3
+#define RATCHET_PRIORITY_NORMAL 1
+
+/* Resumes are counted by what the thread was waiting on, indexed by the small
+ * integers behind the RATCHET_YIELD_* values. Index 0 counts first starts. */
+#define RATCHET_NUM_WAIT_REASONS 9
+#define RATCHET_NUM_HIST_BUCKETS 5
+
+/* {{{ struct ratchet_stats */
+struct ratchet_stats
+{
+	double reset_time;
+	double busy_time;
+	double max_resume;
+	unsigned long iterations;
+	unsigned long pool_hits;
+	unsigned long pool_misses;
+	unsigned long stalls;
+	unsigned long resumes[RATCHET_NUM_WAIT_REASONS];
+	unsigned long lag[RATCHET_NUM_HIST_BUCKETS];
+	unsigned long iteration_time[RATCHET_NUM_HIST_BUCKETS];
+};
+/* }}} */
+
+#if HAVE_LIBURING
+/* {{{ struct ratchet_uring */
+/* The io_uring of a kernel created with it. Submissions are queued as
+ * threads wait and submitted together once per loop_once(), completions
+ * are signaled through the eventfd. */
+struct ratchet_uring
+{
+	struct io_uring ring;
+	int fd;
+	int pending;
+	int outstanding;
+	struct event *ev;
+	lua_State *L;
+};
+/* }}} */
+#endif
+
+/* {{{ struct ratchet */
+struct ratchet
+{
+	struct event_base *base;
+	struct timerwheel timers;
+	struct refqueue ready[RATCHET_NUM_PRIORITIES];
+	int run_budget;
+	int method_dispatch;
+	int live_threads;
+	int pool_cap;
+	int pool_size;
+	struct ratchet_stats stats;
+	double watchdog;
+	double resume_start;
+	int stalled;
+	struct ratchet_watch *watches;
+#if HAVE_LIBURING
+	struct ratchet_uring *uring;
+#endif
+	int break_flag;
+};
+/* }}} */
+
+/* {{{ struct thread_state */
+/* Per-thread data kept alive in the "threads" persistance table. The
+ * struct event used by wait_for_read(), wait_for_write() and
+ * wait_for_timeout() lives directly after this struct in the same userdata,
+ * and is re-armed on every wait instead of allocating a new one. Wait
+ * timeouts and alarms are timer wheel entries embedded the same way. */
+struct thread_state
+{
+	lua_State *L1;
+	int queued;
+	int join_count;
+	int wait_any;
+	int priority;
+	int waiting;
+	double ready_time;
+	struct ratchet_watch *watch;
+	struct thread_state *watch_next;
+	struct thread_state **watch_pprev;
+	struct ratchet_uring_op *uring;
+	struct timer_entry timer;
+	struct timer_entry alarm;
+};
+/* }}} */
+
+#if HAVE_SIGNALFD
+/* {{{ struct signal_dispatch */
+/* One signalfd per ratchet object, created by the first sigwait() or
+ * ratchet.exec wait(). A signal is blocked and added to its mask while
+ * anything waits on it, and all pending signals are read at once when it
+ * becomes readable. Child processes are watched by pid, their callbacks are
+ * kept in the "children" table of the uservalue. */
+struct signal_dispatch
+{
+	int fd;
+	int waiting;
+	int refs[NSIG];
+	sigset_t mask;
+	sigset_t blocked;
+	struct event *ev;
+	lua_State *L;
+};
+/* }}} */
+#endif
 
 const char *ratchet_version (void);
 
+/* Its address marks metatables given to ratchet_io_register(). */
+static char ratchet_io_key;
+static char ratchet_waitq_removed;
+
+/* Registry keys for the ratchet object whose thread is being watched, and the
+ * traceback taken when that thread stalled. */
+static char watchdog_key;
+static char watchdog_trace_key;
+
+static void event_triggered (int fd, short event, void *arg);
+static int ratchet_loop_once (lua_State *L);
+static int ratchet_start_threads_ready (lua_State *L);
+static int ratchet_alarm_thread (lua_State *L);
+static int ratchet_run_thread (lua_State *L);
+static int ratchet_yield_thread (lua_State *L);
+static int ratchet_wait_for_write (lua_State *L);
+static int ratchet_wait_for_read (lua_State *L);
+static int ratchet_wait_for_signal (lua_State *L);
+static int ratchet_wait_for_timeout (lua_State *L);
+static int ratchet_wait_for_multi (lua_State *L);
+
+/* {{{ push_helper() */
+/* Pushes the helper method used to drive the kernel at index 1. By default
+ * the C function is pushed directly, skipping the metatable lookup, unless
+ * set_method_dispatch() asked for overridden helper methods to be honored. */
+static void push_helper (lua_State *L, const char *name, lua_CFunction func)
+{
+	struct ratchet *r = (struct ratchet *) lua_touserdata (L, 1);
+	if (r->method_dispatch)
+		lua_getfield (L, 1, name);
+	else
+		lua_pushcfunction (L, func);
+}
+/* }}} */
+
 /* {{{ setup_persistance_tables() */
 static int setup_persistance_tables (lua_State *L)
 {
@@ -60,21 +249,13 @@ static int setup_persistance_tables (lua_State *L)
 	lua_setmetatable (L, -2);
 	lua_setfield (L, -2, "ready");
 
-	/* Set up a weak-key table to track what threads a thread is waiting on. */
-	lua_newtable (L);
-	lua_newtable (L);
-	lua_pushliteral (L, "k");
-	lua_setfield (L, -2, "__mode");
-	lua_setmetatable (L, -2);
-	lua_setfield (L, -2, "waiting_on");
-
-	/* Set up a weak-key table to hold alarm events for threads. */
+	/* Set up a weak-key table to track what threads are waiting on a thread. */
 	lua_newtable (L);
 	lua_newtable (L);
 	lua_pushliteral (L, "k");
 	lua_setfield (L, -2, "__mode");
 	lua_setmetatable (L, -2);
-	lua_setfield (L, -2, "alarm_events");
+	lua_setfield (L, -2, "joiners");
 
 	/* Set up a weak-key table to hold alarm callbacks for threads. */
 	lua_newtable (L);
@@ -92,6 +273,10 @@ static int setup_persistance_tables (lua_State *L)
 	lua_setmetatable (L, -2);
 	lua_setfield (L, -2, "thread_space");
 
+	/* Finished threads kept for reuse by attach(). */
+	lua_newtable (L);
+	lua_setfield (L, -2, "thread_pool");
+
 	return 1;
 }
 /* }}} */
@@ -99,28 +284,260 @@ static int setup_persistance_tables (lua_State *L)
 /* {{{ set_thread_persist() */
 static void set_thread_persist (lua_State *L, int index)
 {
+	struct ratchet *r = get_ratchet (L, 1);
+	lua_State *L1 = lua_tothread (L, index);
+
 	lua_getuservalue (L, 1);
 	lua_getfield (L, -1, "threads");
 
 	lua_pushvalue (L, index);
-	lua_pushboolean (L, 1);
+	struct thread_state *state = (struct thread_state *) lua_newuserdata (L, sizeof (struct thread_state) + event_get_struct_event_size ());
+	luaL_getmetatable (L, "ratchet_thread_internal_meta");
+	lua_setmetatable (L, -2);
+	state->L1 = L1;
+	state->queued = 0;
+	state->join_count = 0;
+	state->priority = RATCHET_PRIORITY_NORMAL;
+	state->waiting = 0;
+	state->ready_time = 0.0;
+	state->watch = NULL;
+	state->watch_next = NULL;
+	state->watch_pprev = NULL;
+	state->uring = NULL;
+	timer_entry_init (&state->timer);
+	timer_entry_init (&state->alarm);
+	event_assign (thread_event (state), r->base, -1, 0, event_triggered, L1);
 	lua_settable (L, -3);
+	r->live_threads++;
 
 	lua_pop (L, 2);
 }
 /* }}} */
 
+/* {{{ push_thread_state() */
+static struct thread_state *push_thread_state (lua_State *L, int index)
+{
+	index = lua_absindex (L, index);
+	lua_getuservalue (L, 1);
+	lua_getfield (L, -1, "threads");
+	lua_pushvalue (L, index);
+	lua_rawget (L, -2);
+	lua_replace (L, -3);
+	lua_pop (L, 1);
+
+	return (struct thread_state *) lua_touserdata (L, -1);
+}
+/* }}} */
+
 /* {{{ set_thread_ready() */
 static void set_thread_ready (lua_State *L, int index)
 {
+	struct ratchet *r = get_ratchet (L, 1);
+	index = lua_absindex (L, index);
+
+	/* Threads no longer persisted have been killed or have finished. */
+	struct thread_state *state = push_thread_state (L, index);
+	lua_pop (L, 1);
+	if (!state || state->queued)
+		return;
+
+	state->queued = 1;
+	state->ready_time = monotonic_time ();
+	refqueue_push (L, &r->ready[state->priority], index);
+}
+/* }}} */
+
+/* {{{ pop_ready_thread() */
+static int pop_ready_thread (lua_State *L, struct ratchet *r)
+{
+	int i;
+	for (i=0; i<RATCHET_NUM_PRIORITIES; i++)
+		if (refqueue_pop (L, &r->ready[i]))
+			return 1;
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ get_thread_priority() */
+static int get_thread_priority (lua_State *L, int index)
+{
+	struct thread_state *state = push_thread_state (L, index);
+	lua_pop (L, 1);
+
+	return (state ? state->priority : RATCHET_PRIORITY_NORMAL);
+}
+/* }}} */
+
+/* {{{ check_priority() */
+static int check_priority (lua_State *L, int index)
+{
+	static const char *lst[] = {"high", "normal", "low", NULL};
+	return luaL_checkoption (L, index, "normal", lst);
+}
+/* }}} */
+
+/* {{{ push_new_thread() */
+/* Pushes a thread for attach(), taken from the pool when one is available. */
+static lua_State *push_new_thread (lua_State *L)
+{
+	struct ratchet *r = get_ratchet (L, 1);
+	if (r->pool_size <= 0)
+	{
+		if (r->pool_cap > 0)
+			r->stats.pool_misses++;
+		return lua_newthread (L);
+	}
+
 	lua_getuservalue (L, 1);
-	lua_getfield (L, -1, "ready");
+	lua_getfield (L, -1, "thread_pool");
+	lua_rawgeti (L, -1, r->pool_size);
+	lua_pushnil (L);
+	lua_rawseti (L, -3, r->pool_size--);
+	lua_replace (L, -3);
+	lua_pop (L, 1);
+
+	r->stats.pool_hits++;
+	return lua_tothread (L, -1);
+}
+/* }}} */
+
+/* {{{ recycle_thread() */
+/* A thread that returned normally may be resumed again with a new function,
+ * so it is kept for attach() up to the pool cap. Kernel data keyed on the
+ * thread is cleared first. */
+static void recycle_thread (lua_State *L, int index)
+{
+	struct ratchet *r = get_ratchet (L, 1);
+	lua_State *L1 = lua_tothread (L, index);
+	if (r->pool_size >= r->pool_cap || lua_status (L1) != LUA_OK)
+		return;
+
+	index = lua_absindex (L, index);
+	lua_settop (L1, 0);
 
+	lua_getuservalue (L, 1);
+	lua_getfield (L, -1, "alarm_callbacks");
 	lua_pushvalue (L, index);
-	lua_pushboolean (L, 1);
-	lua_settable (L, -3);
+	lua_pushnil (L);
+	lua_rawset (L, -3);
+	lua_getfield (L, -2, "thread_space");
+	lua_pushvalue (L, index);
+	lua_pushnil (L);
+	lua_rawset (L, -3);
+	lua_getfield (L, -3, "thread_pool");
+	lua_pushvalue (L, index);
+	lua_rawseti (L, -2, ++r->pool_size);
+	lua_pop (L, 4);
+}
+/* }}} */
 
-	lua_pop (L, 2);
+/* {{{ histogram_bucket() */
+/* Buckets are split at 1ms, 10ms, 100ms and 1s. */
+static int histogram_bucket (double secs)
+{
+	int i;
+	double bound = 0.001;
+	for (i=0; i<RATCHET_NUM_HIST_BUCKETS-1; i++, bound *= 10.0)
+		if (secs < bound)
+			break;
+
+	return i;
+}
+/* }}} */
+
+/* {{{ get_wait_reason() */
+static int get_wait_reason (lua_State *L1)
+{
+	intptr_t type = (intptr_t) lua_touserdata (L1, 1);
+	if (type <= 0 || type >= RATCHET_NUM_WAIT_REASONS)
+		type = (intptr_t) RATCHET_YIELD_PAUSE;
+
+	return (int) type;
+}
+/* }}} */
+
+/* {{{ end_thread_watch() */
+static void end_thread_watch (struct thread_state *state)
+{
+	if (state->watch_pprev)
+	{
+		*state->watch_pprev = state->watch_next;
+		if (state->watch_next)
+			state->watch_next->watch_pprev = state->watch_pprev;
+	}
+	state->watch_next = NULL;
+	state->watch_pprev = NULL;
+	state->watch = NULL;
+}
+/* }}} */
+
+#if HAVE_LIBURING
+/* {{{ get_uring_sqe() */
+static struct io_uring_sqe *get_uring_sqe (struct ratchet_uring *u)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe (&u->ring);
+	if (!sqe)
+	{
+		/* The queue is full, submit early to make room. */
+		io_uring_submit (&u->ring);
+		u->pending = 0;
+		sqe = io_uring_get_sqe (&u->ring);
+	}
+
+	return sqe;
+}
+/* }}} */
+#endif
+
+#if HAVE_LIBURING
+/* {{{ cancel_uring_op() */
+static void cancel_uring_op (struct ratchet_uring_op *op)
+{
+	/* Cancel now rather than with the next batch, so that data arriving
+	 * afterwards is left for the next receive. */
+	struct ratchet_uring *u = (struct ratchet_uring *) op->ring;
+	struct io_uring_sqe *sqe = get_uring_sqe (u);
+	if (sqe)
+	{
+		io_uring_prep_cancel (sqe, op, 0);
+		io_uring_sqe_set_data (sqe, NULL);
+		io_uring_submit (&u->ring);
+		u->pending = 0;
+	}
+}
+/* }}} */
+
+/* {{{ uring_timer_expired() */
+/* The thread keeps waiting until the cancelled operation completes, so that
+ * it still gets whatever the operation did in the meantime. */
+static void uring_timer_expired (void *arg)
+{
+	struct ratchet_uring_op *op = (struct ratchet_uring_op *) arg;
+	if (!op->L1 || op->timed_out)
+		return;
+	op->timed_out = 1;
+	cancel_uring_op (op);
+}
+/* }}} */
+#endif
+
+/* {{{ abandon_uring_op() */
+/* The thread stopped waiting on its io_uring operation, which is cancelled.
+ * The kernel keeps it until its completion arrives. */
+static void abandon_uring_op (struct thread_state *state)
+{
+	struct ratchet_uring_op *op = state->uring;
+	if (!op)
+		return;
+	state->uring = NULL;
+	op->L1 = NULL;
+
+#if HAVE_LIBURING
+	if (!op->timed_out)
+		cancel_uring_op (op);
+	op->timed_out = 0;
+#endif
 }
 /* }}} */
 
@@ -134,37 +551,337 @@ static void end_thread_persist (lua_State *L, int index)
 
 	lua_getfield (L, -1, "threads");
 	lua_pushvalue (L, index);
+	lua_rawget (L, -2);
+	struct thread_state *state = (struct thread_state *) lua_touserdata (L, -1);
+	if (state)
+	{
+		event_del (thread_event (state));
+		timerwheel_del (&state->timer);
+		timerwheel_del (&state->alarm);
+		end_thread_watch (state);
+		abandon_uring_op (state);
+		get_ratchet (L, 1)->live_threads--;
+	}
+	lua_pop (L, 1);
+	lua_pushvalue (L, index);
 	lua_pushnil (L);
 	lua_settable (L, -3);
 	lua_pop (L, 1);
 
-	lua_getfield (L, -1, "alarm_events");
+	/* Count down each thread in wait_all() on this one, readying it at zero. */
+	lua_getfield (L, -1, "joiners");
 	lua_pushvalue (L, index);
 	lua_rawget (L, -2);
-	if (!lua_isnil (L, -1))
+	if (lua_istable (L, -1))
 	{
-		struct event *ev = (struct event *) lua_touserdata (L, -1);
-		event_del (ev);
-	}
-	lua_pop (L, 2);
+		int joiners = lua_gettop (L);
+		for (lua_pushnil (L); lua_next (L, joiners) != 0; lua_pop (L, 1))
+		{
+			struct thread_state *parent = push_thread_state (L, -2);
+			lua_pop (L, 1);
+			if (parent && parent->wait_any)
+			{
+				/* The parent is in wait_any(), this thread is its result. */
+				parent->wait_any = 0;
+				lua_pushvalue (L, -2);
+				lua_pushvalue (L, index);
+				ratchet_wake_thread (L, -2, 1);
+				lua_pop (L, 1);
+			}
+			else if (parent && parent->join_count > 0 && 0 == --parent->join_count)
+				set_thread_ready (L, lua_gettop (L) - 1);
+		}
 
-	lua_getfield (L, -1, "waiting_on");
-	for (lua_pushnil (L); lua_next (L, -2) != 0; lua_pop (L, 1))
-	{
 		lua_pushvalue (L, index);
 		lua_pushnil (L);
-		lua_rawset (L, -3);
+		lua_rawset (L, joiners-1);
 	}
-	lua_pop (L, 2);
+	lua_pop (L, 3);
+}
+/* }}} */
+
+#if HAVE_SIGNALFD
+/* {{{ signal_ref() */
+static void signal_ref (lua_State *L, struct signal_dispatch *d, int sig)
+{
+	if (sig <= 0 || sig >= NSIG)
+		luaL_error (L, "Invalid signal.");
+
+	if (0 == d->refs[sig])
+	{
+		sigset_t one, old;
+		sigemptyset (&one);
+		sigaddset (&one, sig);
+		if (0 != (errno = pthread_sigmask (SIG_BLOCK, &one, &old)))
+			ratchet_error_errno (L, "ratchet.thread.sigwait()", "pthread_sigmask");
+		if (!sigismember (&old, sig))
+			sigaddset (&d->blocked, sig);
+
+		sigaddset (&d->mask, sig);
+		if (-1 == signalfd (d->fd, &d->mask, 0))
+			ratchet_error_errno (L, "ratchet.thread.sigwait()", "signalfd");
+	}
+
+	d->refs[sig]++;
+	if (1 == ++d->waiting)
+		event_add (d->ev, NULL);
+}
+/* }}} */
+
+/* {{{ signal_unref() */
+static void signal_unref (struct signal_dispatch *d, int sig)
+{
+	if (sig <= 0 || sig >= NSIG || d->refs[sig] <= 0)
+		return;
+
+	if (0 == --d->waiting)
+		event_del (d->ev);
+	if (--d->refs[sig] > 0)
+		return;
+
+	/* A signal that arrives with nobody waiting gets its usual handling. */
+	sigdelset (&d->mask, sig);
+	signalfd (d->fd, &d->mask, 0);
+	if (sigismember (&d->blocked, sig))
+	{
+		sigset_t one;
+		sigemptyset (&one);
+		sigaddset (&one, sig);
+		sigdelset (&d->blocked, sig);
+		pthread_sigmask (SIG_UNBLOCK, &one, NULL);
+	}
+}
+/* }}} */
+
+/* {{{ finish_child() */
+/* Reaps the watched child pid if it has exited, calling its callback with the
+ * ratchet object at index 1 and the wait status. */
+static int finish_child (lua_State *L, struct signal_dispatch *d, int children, pid_t pid)
+{
+	int status = 0;
+	pid_t ret = waitpid (pid, &status, WNOHANG);
+	if (0 == ret || (-1 == ret && ECHILD != errno))
+		return 0;
+
+	lua_pushinteger (L, (lua_Integer) pid);
+	lua_rawget (L, children);
+	lua_pushinteger (L, (lua_Integer) pid);
+	lua_pushnil (L);
+	lua_rawset (L, children);
+	signal_unref (d, SIGCHLD);
+
+	lua_pushvalue (L, 1);
+	if (ret > 0)
+	{
+		lua_pushinteger (L, (lua_Integer) status);
+		lua_call (L, 2, 0);
+	}
+	else
+		lua_call (L, 1, 0);
+
+	return 1;
+}
+/* }}} */
+
+/* {{{ reap_children() */
+static void reap_children (lua_State *L, struct signal_dispatch *d, int children)
+{
+	/* SIGCHLD does not queue, one signal may stand for several children. Ask
+	 * which child exited without reaping it, and if it is watched reap it. */
+	siginfo_t info;
+	for (;;)
+	{
+		memset (&info, 0, sizeof (info));
+		if (-1 == waitid (P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) || 0 == info.si_pid)
+			return;
+
+		lua_pushinteger (L, (lua_Integer) info.si_pid);
+		lua_rawget (L, children);
+		int watched = !lua_isnil (L, -1);
+		lua_pop (L, 1);
+		if (!watched || !finish_child (L, d, children, info.si_pid))
+			break;
+	}
+
+	/* An exited child nobody is watching hides the others, check each. */
+	lua_pushnil (L);
+	while (lua_next (L, children) != 0)
+	{
+		lua_pop (L, 1);
+		finish_child (L, d, children, (pid_t) lua_tointeger (L, -1));
+	}
+}
+/* }}} */
+
+/* {{{ wake_signal_waiters() */
+static void wake_signal_waiters (lua_State *L, int waiters, int sig)
+{
+	lua_rawgeti (L, waiters, sig);
+	if (!lua_istable (L, -1))
+	{
+		lua_pop (L, 1);
+		return;
+	}
+
+	/* Waking a thread removes it from the set, see end_all_waiting_thread_events(). */
+	int set = lua_gettop (L);
+	lua_pushnil (L);
+	while (lua_next (L, set) != 0)
+	{
+		lua_pop (L, 1);
+		lua_pushvalue (L, -1);
+		lua_pushboolean (L, 1);
+		ratchet_wake_thread (L, -2, 1);
+		lua_pop (L, 1);
+	}
+	lua_pop (L, 1);
+}
+/* }}} */
+
+/* {{{ dispatch_signals() */
+static int dispatch_signals (lua_State *L)
+{
+	struct signal_dispatch *d = (struct signal_dispatch *) luaL_checkudata (L, 2, "ratchet_signal_internal_meta");
+	struct signalfd_siginfo info[RATCHET_SIGNAL_BATCH];
+	sigset_t seen;
+	ssize_t got;
+	int i;
+
+	lua_settop (L, 2);
+	lua_getuservalue (L, 2);
+	lua_getfield (L, 3, "waiters");
+	lua_getfield (L, 3, "children");
+
+	/* Drain everything pending, each signal is handled once. */
+	sigemptyset (&seen);
+	for (;;)
+	{
+		got = read (d->fd, info, sizeof (info));
+		if (-1 == got && EINTR == errno)
+			continue;
+		if (got <= 0)
+			break;
+		for (i=0; i<got/(ssize_t) sizeof (struct signalfd_siginfo); i++)
+			sigaddset (&seen, (int) info[i].ssi_signo);
+	}
+
+	for (i=1; i<NSIG; i++)
+	{
+		if (1 != sigismember (&seen, i))
+			continue;
+		if (SIGCHLD == i)
+			reap_children (L, d, 5);
+		wake_signal_waiters (L, 4, i);
+	}
+
+	return 0;
 }
 /* }}} */
 
+/* {{{ signal_dispatch_triggered() */
+static void signal_dispatch_triggered (int fd, short event, void *arg)
+{
+	struct signal_dispatch *d = (struct signal_dispatch *) arg;
+
+	/* d->L holds the ratchet object at index 1, whose "signals" uservalue
+	 * field is the dispatcher itself. */
+	lua_pushcfunction (d->L, dispatch_signals);
+	lua_pushvalue (d->L, 1);
+	lua_getuservalue (d->L, 1);
+	lua_getfield (d->L, -1, "signals");
+	lua_remove (d->L, -2);
+	if (LUA_OK != lua_pcall (d->L, 2, 0, 0))
+		ratchet_report_error (d->L, "ratchet.thread.sigwait()");
+}
+/* }}} */
+
+/* {{{ ratchet_signal_gc() */
+static int ratchet_signal_gc (lua_State *L)
+{
+	struct signal_dispatch *d = (struct signal_dispatch *) luaL_checkudata (L, 1, "ratchet_signal_internal_meta");
+	if (d->ev)
+		event_free (d->ev);
+	d->ev = NULL;
+	if (d->fd >= 0)
+		close (d->fd);
+	d->fd = -1;
+	pthread_sigmask (SIG_UNBLOCK, &d->blocked, NULL);
+	sigemptyset (&d->blocked);
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ push_signal_dispatch() */
+/* Pushes the signal dispatcher of the ratchet object at index 1, creating it
+ * on first use. */
+static struct signal_dispatch *push_signal_dispatch (lua_State *L)
+{
+	lua_getuservalue (L, 1);
+	lua_getfield (L, -1, "signals");
+	struct signal_dispatch *d = (struct signal_dispatch *) lua_touserdata (L, -1);
+	if (d)
+	{
+		lua_remove (L, -2);
+		return d;
+	}
+	lua_pop (L, 1);
+
+	d = (struct signal_dispatch *) lua_newuserdata (L, sizeof (struct signal_dispatch));
+	memset (d, 0, sizeof (struct signal_dispatch));
+	sigemptyset (&d->mask);
+	sigemptyset (&d->blocked);
+	d->fd = -1;
+	luaL_getmetatable (L, "ratchet_signal_internal_meta");
+	lua_setmetatable (L, -2);
+
+	d->fd = signalfd (-1, &d->mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (d->fd < 0)
+		ratchet_error_errno (L, "ratchet.thread.sigwait()", "signalfd");
+	d->ev = event_new (get_event_base (L, 1), d->fd, EV_READ | EV_PERSIST, signal_dispatch_triggered, d);
+
+	/* A helper thread, holding the ratchet object, runs the dispatch. */
+	lua_createtable (L, 0, 3);
+	d->L = lua_newthread (L);
+	lua_pushvalue (L, 1);
+	lua_xmove (L, d->L, 1);
+	lua_setfield (L, -2, "thread");
+	lua_newtable (L);
+	lua_setfield (L, -2, "waiters");
+	lua_newtable (L);
+	lua_setfield (L, -2, "children");
+	lua_setuservalue (L, -2);
+
+	lua_pushvalue (L, -1);
+	lua_setfield (L, -3, "signals");
+	lua_remove (L, -2);
+
+	return d;
+}
+/* }}} */
+#endif
+
 /* {{{ end_all_waiting_thread_events() */
 static void end_all_waiting_thread_events (lua_State *L)
 {
+	struct thread_state *state = (struct thread_state *) luaL_testudata (L, 2, "ratchet_thread_internal_meta");
+	if (state)
+	{
+		event_del (thread_event (state));
+		timerwheel_del (&state->timer);
+		end_thread_watch (state);
+		abandon_uring_op (state);
+		return;
+	}
+
 	if (!lua_istable (L, 2))
 		return;
 
+	lua_getfield (L, 2, "timer");
+	if (lua_islightuserdata (L, -1))
+		timerwheel_del ((struct timer_entry *) lua_touserdata (L, -1));
+	lua_pop (L, 1);
+
 	lua_getfield (L, 2, "event");
 	if (lua_isuserdata (L, -1))
 	{
@@ -173,6 +890,25 @@ static void end_all_waiting_thread_events (lua_State *L)
 	}
 	lua_pop (L, 1);
 
+#if HAVE_SIGNALFD
+	lua_getfield (L, 2, "signal_dispatch");
+	if (lua_isuserdata (L, -1))
+	{
+		struct signal_dispatch *d = (struct signal_dispatch *) lua_touserdata (L, -1);
+		lua_getfield (L, 2, "signal_waiters");
+		lua_pushthread (L);
+		lua_pushnil (L);
+		lua_rawset (L, -3);
+		lua_getfield (L, 2, "signal");
+		signal_unref (d, (int) lua_tointeger (L, -1));
+		lua_pop (L, 2);
+
+		lua_pushnil (L);
+		lua_setfield (L, 2, "signal_dispatch");
+	}
+	lua_pop (L, 1);
+#endif
+
 	lua_getfield (L, 2, "event_list");
 	if (lua_istable (L, -1))
 	{
@@ -196,25 +932,13 @@ static void end_all_waiting_thread_events (lua_State *L)
 }
 /* }}} */
 
-/* {{{ get_fd_from_object() */
-static int get_fd_from_object (lua_State *L, int index)
-{
-	lua_pushvalue (L, index);
-	lua_getfield (L, -1, "get_fd");
-	if (!lua_isfunction (L, -1))
-		luaL_argerror (L, index, "object has no get_fd() method");
-	lua_insert (L, -2);
-	lua_call (L, 1, 1);
-
-	int fd = lua_tointeger (L, -1);
-	lua_pop (L, 1);
-	return fd;
-}
-/* }}} */
-
 /* {{{ get_timeout_from_object() */
 static double get_timeout_from_object (lua_State *L, int index)
 {
+	struct ratchet_io *io = ratchet_io_test (L, index);
+	if (io)
+		return io->timeout;
+
 	lua_pushvalue (L, index);
 	lua_getfield (L, -1, "get_timeout");
 	if (!lua_isfunction (L, -1))
@@ -239,8 +963,11 @@ static void event_triggered (int fd, short event, void *arg)
 		luaL_error (L1, "ratchet internal error.");
 	lua_State *L = lua_tothread (L1, 1);
 
+	/* Whichever of the event or the timer wheel entry fired, end both. */
+	end_all_waiting_thread_events (L1);
+
 	/* Call the run_thread() helper method. */
-	lua_getfield (L, 1, "run_thread");
+	push_helper (L, "run_thread", ratchet_run_thread);
 	lua_pushvalue (L, 1);
 	lua_settop (L1, 0);
 	lua_pushthread (L1);
@@ -261,7 +988,7 @@ static void signal_triggered (int sig, short event, void *arg)
 	end_all_waiting_thread_events (L1);
 
 	/* Call the run_thread() helper method. */
-	lua_getfield (L, 1, "run_thread");
+	push_helper (L, "run_thread", ratchet_run_thread);
 	lua_pushvalue (L, 1);
 	lua_settop (L1, 0);
 	lua_pushthread (L1);
@@ -280,7 +1007,7 @@ static void timeout_triggered (int fd, short event, void *arg)
 	lua_State *L = lua_tothread (L1, 1);
 
 	/* Call the run_thread() helper method. */
-	lua_getfield (L, 1, "run_thread");
+	push_helper (L, "run_thread", ratchet_run_thread);
 	lua_pushvalue (L, 1);
 	lua_settop (L1, 0);
 	lua_pushthread (L1);
@@ -298,7 +1025,7 @@ static void alarm_triggered (int fd, short event, void *arg)
 	lua_State *L = lua_tothread (L1, 1);
 
 	/* Call the run_thread() helper method. */
-	lua_getfield (L, 1, "alarm_thread");
+	push_helper (L, "alarm_thread", ratchet_alarm_thread);
 	lua_pushvalue (L, 1);
 	lua_pushthread (L1);
 	lua_xmove (L1, L, 1);
@@ -323,18 +1050,264 @@ static void multi_event_triggered (int fd, short event, void *arg)
 	}
 	else
 	{
-		/* Figure out which object was triggered based on fd. */
-		lua_rawgeti (L1, 3, fd);
-		lua_replace (L1, 1);
-		lua_settop (L1, 1);
+		/* Figure out which object was triggered based on fd. */
+		lua_rawgeti (L1, 3, fd);
+		lua_replace (L1, 1);
+		lua_settop (L1, 1);
+	}
+
+	/* Call the run_thread() helper method. */
+	push_helper (L, "run_thread", ratchet_run_thread);
+	lua_pushvalue (L, 1);
+	lua_pushthread (L1);
+	lua_xmove (L1, L, 1);
+	lua_call (L, 2, 0);
+}
+/* }}} */
+
+/* {{{ wake_watch_waiters() */
+/* Every thread blocked in the direction retries, as an edge only arrives
+ * once however many of them there are. Those that find nothing to do block
+ * again. */
+static void wake_watch_waiters (struct ratchet_watch *watch, int dir)
+{
+	struct thread_state *state;
+	while ((state = watch->waiting[dir]))
+	{
+		lua_State *L1 = state->L1;
+		end_thread_watch (state);
+
+		/* The thread is only readied, the other direction's waiters may
+		 * still need this watch after it runs. */
+		lua_State *L = lua_tothread (L1, 1);
+		lua_pushthread (L1);
+		lua_xmove (L1, L, 1);
+		lua_pushboolean (L, 1);
+		ratchet_wake_thread (L, -2, 1);
+		lua_pop (L, 1);
+	}
+}
+/* }}} */
+
+/* {{{ watch_triggered() */
+static void watch_triggered (int fd, short event, void *arg)
+{
+	struct ratchet_watch *watch = (struct ratchet_watch *) arg;
+
+	if (event & EV_READ)
+	{
+		watch->ready |= RATCHET_WATCH_READ;
+		wake_watch_waiters (watch, 0);
+	}
+	if (event & EV_WRITE)
+	{
+		watch->ready |= RATCHET_WATCH_WRITE;
+		wake_watch_waiters (watch, 1);
+	}
+}
+/* }}} */
+
+/* {{{ unlink_watch() */
+/* Unregisters the watch without waking its threads, for when they are being
+ * collected along with it. */
+static void unlink_watch (struct ratchet_watch *watch)
+{
+	if (watch->ev)
+		event_free (watch->ev);
+	watch->ev = NULL;
+
+	int dir;
+	for (dir=0; dir<2; dir++)
+	{
+		while (watch->waiting[dir])
+			end_thread_watch (watch->waiting[dir]);
+	}
+
+	if (watch->pprev)
+	{
+		*watch->pprev = watch->next;
+		if (watch->next)
+			watch->next->pprev = watch->pprev;
+	}
+	watch->next = NULL;
+	watch->pprev = NULL;
+
+	/* Until registered again, readiness is unknown. */
+	watch->ready = RATCHET_WATCH_READ | RATCHET_WATCH_WRITE;
+}
+/* }}} */
+
+#if HAVE_LIBURING
+/* {{{ dispatch_uring() */
+static int dispatch_uring (lua_State *L)
+{
+	struct ratchet_uring *u = (struct ratchet_uring *) lua_touserdata (L, 2);
+	struct io_uring_cqe *cqe;
+
+	lua_settop (L, 2);
+	lua_getuservalue (L, 1);
+	lua_getfield (L, 3, "uring_ops");
+
+	while (0 == io_uring_peek_cqe (&u->ring, &cqe))
+	{
+		struct ratchet_uring_op *op = (struct ratchet_uring_op *) io_uring_cqe_get_data (cqe);
+		int res = cqe->res;
+		io_uring_cqe_seen (&u->ring, cqe);
+		if (!op)
+			continue;
+
+		op->busy = 0;
+		if (0 == --u->outstanding)
+			event_del (u->ev);
+
+		lua_State *L1 = op->L1;
+		int timed_out = op->timed_out;
+		op->L1 = NULL;
+		op->timed_out = 0;
+		if (L1)
+		{
+			/* The thread resumes with the result of the operation, which
+			 * only counts as a timeout if the cancel stopped it. A thread
+			 * that took over an abandoned operation tries again instead. */
+			lua_pushthread (L1);
+			lua_xmove (L1, L, 1);
+			struct thread_state *state = push_thread_state (L, -1);
+			if (state)
+				state->uring = NULL;
+			lua_pop (L, 1);
+			if (-ECANCELED == res && timed_out)
+				lua_pushboolean (L, 0);
+			else if (-ECANCELED == res)
+				lua_pushinteger (L, -EAGAIN);
+			else
+				lua_pushinteger (L, (lua_Integer) res);
+			ratchet_wake_thread (L, -2, 1);
+			lua_pop (L, 1);
+		}
+		else if (res >= 0 && (RATCHET_URING_RECV == op->type || RATCHET_URING_ACCEPT == op->type))
+		{
+			/* Nobody is waiting any more, keep what the operation took
+			 * off the socket for the next receive or accept. */
+			op->completed = 1;
+			op->result = res;
+			op->start = 0;
+		}
+
+		lua_pushnil (L);
+		lua_rawsetp (L, 4, op);
+	}
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ uring_triggered() */
+static void uring_triggered (int fd, short event, void *arg)
+{
+	struct ratchet_uring *u = (struct ratchet_uring *) arg;
+
+	uint64_t count;
+	while (-1 == read (fd, &count, sizeof (count)) && errno == EINTR);
+
+	/* u->L holds the ratchet object at index 1. */
+	lua_pushcfunction (u->L, dispatch_uring);
+	lua_pushvalue (u->L, 1);
+	lua_pushlightuserdata (u->L, u);
+	if (LUA_OK != lua_pcall (u->L, 2, 0, 0))
+		ratchet_report_error (u->L, "ratchet.loop()");
+}
+/* }}} */
+
+/* {{{ setup_uring() */
+/* Gives the ratchet object at index 1 an io_uring, leaving it without one
+ * if the system does not support it. */
+static void setup_uring (lua_State *L, struct ratchet *r)
+{
+	struct ratchet_uring *u = (struct ratchet_uring *) malloc (sizeof (struct ratchet_uring));
+	if (!u)
+		return;
+	memset (u, 0, sizeof (struct ratchet_uring));
+
+	if (0 != io_uring_queue_init (RATCHET_URING_ENTRIES, &u->ring, 0))
+	{
+		free (u);
+		return;
+	}
+	u->fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (u->fd < 0 || 0 != io_uring_register_eventfd (&u->ring, u->fd))
+	{
+		if (u->fd >= 0)
+			close (u->fd);
+		io_uring_queue_exit (&u->ring);
+		free (u);
+		return;
+	}
+	u->ev = event_new (r->base, u->fd, EV_READ | EV_PERSIST, uring_triggered, u);
+
+	/* A helper thread, holding the ratchet object, runs completions. The
+	 * operations in flight are kept from collection until they complete. */
+	lua_getuservalue (L, 1);
+	u->L = lua_newthread (L);
+	lua_pushvalue (L, 1);
+	lua_xmove (L, u->L, 1);
+	lua_setfield (L, -2, "uring_thread");
+	lua_newtable (L);
+	lua_setfield (L, -2, "uring_ops");
+	lua_pop (L, 1);
+
+	r->uring = u;
+}
+/* }}} */
+
+/* {{{ free_uring() */
+static void free_uring (struct ratchet *r)
+{
+	struct ratchet_uring *u = r->uring;
+	if (!u)
+		return;
+
+	if (u->ev)
+		event_free (u->ev);
+	io_uring_queue_exit (&u->ring);
+	close (u->fd);
+	free (u);
+	r->uring = NULL;
+}
+/* }}} */
+#endif
+
+/* {{{ flush_uring() */
+/* Submits the io_uring operations queued since the last call at once. */
+static void flush_uring (struct ratchet *r)
+{
+#if HAVE_LIBURING
+	if (r->uring && r->uring->pending)
+	{
+		io_uring_submit (&r->uring->ring);
+		r->uring->pending = 0;
 	}
+#endif
+}
+/* }}} */
 
-	/* Call the run_thread() helper method. */
-	lua_getfield (L, 1, "run_thread");
-	lua_pushvalue (L, 1);
-	lua_pushthread (L1);
-	lua_xmove (L1, L, 1);
-	lua_call (L, 2, 0);
+/* {{{ thread_timer_expired() */
+static void thread_timer_expired (void *arg)
+{
+	event_triggered (-1, EV_TIMEOUT, arg);
+}
+/* }}} */
+
+/* {{{ multi_timer_expired() */
+static void multi_timer_expired (void *arg)
+{
+	multi_event_triggered (-1, EV_TIMEOUT, arg);
+}
+/* }}} */
+
+/* {{{ alarm_expired() */
+static void alarm_expired (void *arg)
+{
+	alarm_triggered (-1, EV_TIMEOUT, arg);
 }
 /* }}} */
 
@@ -363,12 +1336,23 @@ static void handle_thread_error (lua_State *L, int thread_i)
 /* {{{ ratchet_new() */
 static int ratchet_new (lua_State *L)
 {
-	lua_settop (L, 2);
+	lua_settop (L, 3);
 
-	struct event_base **new = (struct event_base **) lua_newuserdata (L, sizeof (struct event_base *));
-	*new = event_base_new ();
-	if (!*new)
+	struct ratchet *new = (struct ratchet *) lua_newuserdata (L, sizeof (struct ratchet));
+	memset (new, 0, sizeof (struct ratchet));
+	int i;
+	for (i=0; i<RATCHET_NUM_PRIORITIES; i++)
+		refqueue_init (&new->ready[i]);
+	new->run_budget = RATCHET_RUN_BUDGET;
+	new->pool_cap = RATCHET_THREAD_POOL_SIZE;
+	new->stats.reset_time = monotonic_time ();
+	new->base = event_base_new ();
+	if (!new->base)
 		return luaL_error (L, "Failed to create event_base structure.");
+	if (0 != event_base_priority_init (new->base, RATCHET_NUM_PRIORITIES))
+		return luaL_error (L, "Failed to initialize event_base priorities.");
+	if (0 != timerwheel_init (&new->timers, new->base, RATCHET_TIMER_GRANULARITY))
+		return luaL_error (L, "Failed to initialize timer wheel.");
 
 	luaL_getmetatable (L, "ratchet_meta");
 	lua_setmetatable (L, -2);
@@ -379,6 +1363,17 @@ static int ratchet_new (lua_State *L)
 
 	lua_insert (L, 1);
 
+#if HAVE_LIBURING
+	/* Sockets are completed by io_uring if asked for and available. */
+	if (lua_istable (L, 4))
+	{
+		lua_getfield (L, 4, "io_uring");
+		if (lua_toboolean (L, -1))
+			setup_uring (L, new);
+		lua_pop (L, 1);
+	}
+#endif
+
 	/* Attach the first argument as an entry thread. */
 	lua_State *L1 = lua_newthread (L);
 	lua_pushvalue (L, 2);
@@ -405,8 +1400,19 @@ static int ratchet_stackdump (lua_State *L)
 /* {{{ ratchet_gc() */
 static int ratchet_gc (lua_State *L)
 {
-	struct event_base *e_b = get_event_base (L, 1);
-	event_base_free (e_b);
+	struct ratchet *r = get_ratchet (L, 1);
+	int i;
+	for (i=0; i<RATCHET_NUM_PRIORITIES; i++)
+		refqueue_free (L, &r->ready[i]);
+	while (r->watches)
+		unlink_watch (r->watches);
+#if HAVE_LIBURING
+	free_uring (r);
+#endif
+	timerwheel_free (&r->timers);
+	if (r->base)
+		event_base_free (r->base);
+	r->base = NULL;
 
 	return 0;
 }
@@ -431,64 +1437,75 @@ static int ratchet_get_method (lua_State *L)
 }
 /* }}} */
 
+/* {{{ ratchet_get_io_backend() */
+static int ratchet_get_io_backend (lua_State *L)
+{
+#if HAVE_LIBURING
+	if (get_ratchet (L, 1)->uring)
+	{
+		lua_pushliteral (L, "io_uring");
+		return 1;
+	}
+#else
+	(void) get_ratchet (L, 1);
+#endif
+	lua_pushliteral (L, "libevent");
+	return 1;
+}
+/* }}} */
+
 /* {{{ ratchet_get_num_threads() */
 static int ratchet_get_num_threads (lua_State *L)
 {
-	(void) get_event_base (L, 1);
-	int i;
-
-	lua_settop (L, 1);
-	lua_getuservalue (L, 1);
-	lua_getfield (L, -1, "threads");
-	lua_pushnil (L);
-	for (i=1; lua_next (L, 3) != 0; i++)
-		lua_pop (L, 1);
-
-	lua_pushinteger (L, i-1);
+	struct ratchet *r = get_ratchet (L, 1);
+	lua_pushinteger (L, r->live_threads);
 	return 1;
 }
 /* }}} */
 
+/* {{{ count_iteration() */
+/* Iteration time only counts time spent running threads, not time blocked
+ * waiting for events. */
+static void count_iteration (struct ratchet *r, double busy_before)
+{
+	r->stats.iterations++;
+	r->stats.iteration_time[histogram_bucket (r->stats.busy_time - busy_before)]++;
+}
+/* }}} */
+
 /* {{{ ratchet_loop_once() */
 static int ratchet_loop_once (lua_State *L)
 {
-	struct event_base *e_b = get_event_base (L, 1);
+	struct ratchet *r = get_ratchet (L, 1);
+	struct event_base *e_b = r->base;
 	int flags = (lua_toboolean (L, 2) ? EVLOOP_NONBLOCK : EVLOOP_ONCE);
+	double busy = r->stats.busy_time;
 
 	lua_settop (L, 1);
 
 	/* Execute self:start_threads_ready(). */
-	lua_getfield (L, 1, "start_threads_ready");
+	push_helper (L, "start_threads_ready", ratchet_start_threads_ready);
 	lua_pushvalue (L, 1);
 	lua_call (L, 1, 1);
+	flush_uring (r);
 	if (lua_toboolean (L, -1))
 	{
-		lua_pushboolean (L, 1);
-		return 1;
-	}
-	lua_settop (L, 1);
+		/* Service any pending IO before the next batch of ready threads. */
+		if (event_base_loop (e_b, EVLOOP_NONBLOCK) < 0)
+			return luaL_error (L, "libevent internal error.");
 
-	/* Execute self:start_threads_waiting(). */
-	lua_getfield (L, 1, "start_threads_done_waiting");
-	lua_pushvalue (L, 1);
-	lua_call (L, 1, 1);
-	if (lua_toboolean (L, -1))
-	{
+		count_iteration (r, busy);
 		lua_pushboolean (L, 1);
 		return 1;
 	}
 	lua_settop (L, 1);
 
 	/* Return false if we're out of threads. */
-	lua_getuservalue (L, 1);
-	lua_getfield (L, -1, "threads");
-	lua_pushnil (L);
-	if (lua_next (L, -2) == 0)
+	if (r->live_threads <= 0)
 	{
 		lua_pushboolean (L, 0);
 		return 1;
 	}
-	lua_settop (L, 1);
 
 	/* Handle one iteration of event processing. */
 	int ret = event_base_loop (e_b, flags);
@@ -497,6 +1514,7 @@ static int ratchet_loop_once (lua_State *L)
 	else if (ret > 0)
 		return ratchet_error_str (L, "ratchet.loop_once()", "DEADLOCK", "Non-IO deadlock detected.");
 
+	count_iteration (r, busy);
 	lua_pushboolean (L, 1);
 	return 1;
 }
@@ -505,23 +1523,17 @@ static int ratchet_loop_once (lua_State *L)
 /* {{{ ratchet_loop() */
 static int ratchet_loop (lua_State *L)
 {
-	(void) get_event_base (L, 1);
+	struct ratchet *r = get_ratchet (L, 1);
 
 	while (1)
 	{
-		lua_getuservalue (L, 1);
-		lua_getfield (L, -1, "break_flag");
-		if (lua_toboolean (L, -1))
+		if (r->break_flag)
 		{
-			lua_pop (L, 1);
-			lua_pushnil (L);
-			lua_setfield (L, -2, "break_flag");
-			lua_pop (L, 1);
+			r->break_flag = 0;
 			break;
 		}
-		lua_pop (L, 2);
 
-		lua_getfield (L, 1, "loop_once");
+		push_helper (L, "loop_once", ratchet_loop_once);
 		lua_pushvalue (L, 1);
 		lua_call (L, 1, 1);
 		if (!lua_toboolean (L, -1))
@@ -536,11 +1548,215 @@ static int ratchet_loop (lua_State *L)
 /* {{{ ratchet_break() */
 static int ratchet_break (lua_State *L)
 {
-	(void) get_event_base (L, 1);
+	struct ratchet *r = get_ratchet (L, 1);
+	r->break_flag = 1;
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ ratchet_stats() */
+static int ratchet_stats (lua_State *L)
+{
+	static const char *reasons[RATCHET_NUM_WAIT_REASONS] = {
+		"START", NULL, "WRITE", "READ", "TIMEOUT", "WAITALL", "MULTIRW", "PAUSE", "SIGNAL"
+	};
+	struct ratchet *r = get_ratchet (L, 1);
+	int reset = lua_toboolean (L, 2);
+	double now = monotonic_time ();
+	double elapsed = now - r->stats.reset_time;
+	unsigned long total = 0;
+	size_t ready = 0;
+	int i;
+
+	lua_settop (L, 1);
+	lua_createtable (L, 0, 12);
+
+	for (i=0; i<RATCHET_NUM_PRIORITIES; i++)
+		ready += r->ready[i].size;
+
+	lua_pushinteger (L, r->live_threads);
+	lua_setfield (L, 2, "threads");
+	lua_pushinteger (L, (lua_Integer) ready);
+	lua_setfield (L, 2, "ready");
+	lua_pushnumber (L, (lua_Number) elapsed);
+	lua_setfield (L, 2, "elapsed");
+	lua_pushnumber (L, (lua_Number) r->stats.iterations);
+	lua_setfield (L, 2, "iterations");
+	lua_pushnumber (L, (lua_Number) r->stats.busy_time);
+	lua_setfield (L, 2, "busy_time");
+	lua_pushnumber (L, (lua_Number) r->stats.max_resume);
+	lua_setfield (L, 2, "max_resume");
+	lua_pushinteger (L, r->pool_size);
+	lua_setfield (L, 2, "pool_size");
+	lua_pushnumber (L, (lua_Number) r->stats.pool_hits);
+	lua_setfield (L, 2, "pool_hits");
+	lua_pushnumber (L, (lua_Number) r->stats.pool_misses);
+	lua_setfield (L, 2, "pool_misses");
+	lua_pushnumber (L, (lua_Number) r->stats.stalls);
+	lua_setfield (L, 2, "stalls");
 
 	lua_getuservalue (L, 1);
-	lua_pushboolean (L, 1);
-	lua_setfield (L, -2, "break_flag");
+	lua_getfield (L, 3, "max_resume_thread");
+	lua_setfield (L, 2, "max_resume_thread");
+
+	/* Resume counts and rates, keyed by what the threads were waiting on. */
+	lua_createtable (L, 0, RATCHET_NUM_WAIT_REASONS);
+	lua_createtable (L, 0, RATCHET_NUM_WAIT_REASONS);
+	for (i=0; i<RATCHET_NUM_WAIT_REASONS; i++)
+	{
+		if (!reasons[i])
+			continue;
+		total += r->stats.resumes[i];
+		lua_pushnumber (L, (lua_Number) r->stats.resumes[i]);
+		lua_setfield (L, 4, reasons[i]);
+		lua_pushnumber (L, (lua_Number) (elapsed > 0.0 ? r->stats.resumes[i] / elapsed : 0.0));
+		lua_setfield (L, 5, reasons[i]);
+	}
+	lua_setfield (L, 2, "resumes_per_sec");
+	lua_setfield (L, 2, "resumes");
+	lua_pushnumber (L, (lua_Number) total);
+	lua_setfield (L, 2, "context_switches");
+
+	/* Histograms of loop lag and of time spent running threads per loop. */
+	lua_createtable (L, RATCHET_NUM_HIST_BUCKETS, 0);
+	lua_createtable (L, RATCHET_NUM_HIST_BUCKETS, 0);
+	for (i=0; i<RATCHET_NUM_HIST_BUCKETS; i++)
+	{
+		lua_pushnumber (L, (lua_Number) r->stats.lag[i]);
+		lua_rawseti (L, 4, i+1);
+		lua_pushnumber (L, (lua_Number) r->stats.iteration_time[i]);
+		lua_rawseti (L, 5, i+1);
+	}
+	lua_setfield (L, 2, "iteration_time");
+	lua_setfield (L, 2, "lag");
+
+	if (reset)
+	{
+		memset (&r->stats, 0, sizeof (struct ratchet_stats));
+		r->stats.reset_time = now;
+		lua_pushnil (L);
+		lua_setfield (L, 3, "max_resume_thread");
+	}
+
+	lua_settop (L, 2);
+	return 1;
+}
+/* }}} */
+
+/* {{{ ratchet_get_run_budget() */
+static int ratchet_get_run_budget (lua_State *L)
+{
+	struct ratchet *r = get_ratchet (L, 1);
+	lua_pushinteger (L, r->run_budget);
+	return 1;
+}
+/* }}} */
+
+/* {{{ ratchet_set_run_budget() */
+static int ratchet_set_run_budget (lua_State *L)
+{
+	struct ratchet *r = get_ratchet (L, 1);
+	r->run_budget = luaL_checkint (L, 2);
+	return 0;
+}
+/* }}} */
+
+/* {{{ ratchet_get_watchdog() */
+static int ratchet_get_watchdog (lua_State *L)
+{
+	struct ratchet *r = get_ratchet (L, 1);
+	lua_pushnumber (L, (lua_Number) r->watchdog);
+	lua_getuservalue (L, 1);
+	lua_getfield (L, -1, "watchdog_callback");
+	lua_replace (L, -2);
+	return 2;
+}
+/* }}} */
+
+/* {{{ ratchet_set_watchdog() */
+static int ratchet_set_watchdog (lua_State *L)
+{
+	struct ratchet *r = get_ratchet (L, 1);
+	double threshold = (double) luaL_optnumber (L, 2, 0.0);
+	luaL_argcheck (L, threshold >= 0.0, 2, "threshold must not be negative");
+	if (!lua_isnoneornil (L, 3))
+		luaL_checktype (L, 3, LUA_TFUNCTION);
+	lua_settop (L, 3);
+
+	r->watchdog = threshold;
+	lua_getuservalue (L, 1);
+	lua_pushvalue (L, 3);
+	lua_setfield (L, -2, "watchdog_callback");
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ ratchet_get_thread_pool_size() */
+static int ratchet_get_thread_pool_size (lua_State *L)
+{
+	struct ratchet *r = get_ratchet (L, 1);
+	lua_pushinteger (L, r->pool_cap);
+	return 1;
+}
+/* }}} */
+
+/* {{{ ratchet_set_thread_pool_size() */
+static int ratchet_set_thread_pool_size (lua_State *L)
+{
+	struct ratchet *r = get_ratchet (L, 1);
+	int cap = luaL_checkint (L, 2);
+	r->pool_cap = (cap > 0 ? cap : 0);
+
+	/* Drop pooled threads beyond the new cap. */
+	lua_getuservalue (L, 1);
+	lua_getfield (L, -1, "thread_pool");
+	while (r->pool_size > r->pool_cap)
+	{
+		lua_pushnil (L);
+		lua_rawseti (L, -2, r->pool_size--);
+	}
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ ratchet_get_timer_granularity() */
+static int ratchet_get_timer_granularity (lua_State *L)
+{
+	struct ratchet *r = get_ratchet (L, 1);
+	lua_pushnumber (L, (lua_Number) r->timers.granularity / 1000.0);
+	return 1;
+}
+/* }}} */
+
+/* {{{ ratchet_set_timer_granularity() */
+static int ratchet_set_timer_granularity (lua_State *L)
+{
+	struct ratchet *r = get_ratchet (L, 1);
+	double secs = (double) luaL_checknumber (L, 2);
+	unsigned int ms = (unsigned int) (secs * 1000.0);
+	if (ms < 1)
+		return luaL_argerror (L, 2, "granularity must be at least one millisecond");
+
+	/* Pending timers were placed in ticks of the old granularity. */
+	if (r->timers.count > 0)
+		return ratchet_error_str (L, "ratchet.set_timer_granularity()", "EBUSY", "Timers are pending.");
+
+	timerwheel_free (&r->timers);
+	if (0 != timerwheel_init (&r->timers, r->base, ms))
+		return luaL_error (L, "Failed to initialize timer wheel.");
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ ratchet_set_method_dispatch() */
+static int ratchet_set_method_dispatch (lua_State *L)
+{
+	struct ratchet *r = get_ratchet (L, 1);
+	r->method_dispatch = lua_toboolean (L, 2);
 
 	return 0;
 }
@@ -587,9 +1803,32 @@ static int ratchet_start_threads_ready (lua_State *L)
 {
 	int some_ready = 0;
 
-	(void) get_event_base (L, 1);
+	struct ratchet *r = get_ratchet (L, 1);
+	int ran = 0;
 	lua_settop (L, 1);
-	
+
+	/* Start threads by priority, in the order they were made ready, and at
+	 * most run_budget of them so that threads readied meanwhile cannot starve
+	 * IO events. */
+	while ((r->run_budget <= 0 || ran < r->run_budget) && pop_ready_thread (L, r))
+	{
+		struct thread_state *state = push_thread_state (L, 2);
+		if (state)
+		{
+			state->queued = 0;
+			some_ready = 1;
+			ran++;
+
+			/* Call self:run_thread(t). */
+			push_helper (L, "run_thread", ratchet_run_thread);
+			lua_pushvalue (L, 1);
+			lua_pushvalue (L, 2);
+			lua_call (L, 2, 0);
+		}
+		lua_settop (L, 1);
+	}
+
+	/* Threads placed directly in the old "ready" table are still started. */
 	lua_getuservalue (L, 1);
 	lua_getfield (L, 2, "ready");
 	lua_pushnil (L);
@@ -605,7 +1844,7 @@ static int ratchet_start_threads_ready (lua_State *L)
 		lua_settable (L, 3);
 
 		/* Call self:run_thread(t). */
-		lua_getfield (L, 1, "run_thread");
+		push_helper (L, "run_thread", ratchet_run_thread);
 		lua_pushvalue (L, 1);
 		lua_pushvalue (L, 4);	/* The "key" is the thread to start. */
 		lua_call (L, 2, 0);
@@ -619,46 +1858,6 @@ static int ratchet_start_threads_ready (lua_State *L)
 }
 /* }}} */
 
-/* {{{ ratchet_start_threads_done_waiting() */
-static int ratchet_start_threads_done_waiting (lua_State *L)
-{
-	int some_ready = 0;
-
-	(void) get_event_base (L, 1);
-	lua_settop (L, 1);
-
-	lua_getuservalue (L, 1);
-	lua_getfield (L, 2, "waiting_on");
-	for (lua_pushnil (L); lua_next (L, 3); lua_pop (L, 1))
-	{
-		/* Check for empty value table. */
-		lua_pushnil (L);
-		if (lua_next (L, 5) == 0)
-		{
-			some_ready = 1;
-
-			/* Remove entry from waiting_on. */
-			lua_pushvalue (L, 3);
-			lua_pushvalue (L, 4);
-			lua_pushnil (L);
-			lua_settable (L, -3);
-			lua_pop (L, 1);
-
-			/* Call self:run_thread(t). */
-			lua_getfield (L, 1, "run_thread");
-			lua_pushvalue (L, 1);
-			lua_pushvalue (L, 4);	/* The "key" is the thread to start. */
-			lua_call (L, 2, 0);
-		}
-		else
-			lua_pop (L, 2);
-	}
-
-	lua_pushboolean (L, some_ready);
-	return 1;
-}
-/* }}} */
-
 /* {{{ ratchet_alarm_thread() */
 static int ratchet_alarm_thread (lua_State *L)
 {
@@ -708,13 +1907,130 @@ static int ratchet_alarm_thread (lua_State *L)
 }
 /* }}} */
 
+/* {{{ count_run_time() */
+static void count_run_time (lua_State *L, struct ratchet *r, double start)
+{
+	double elapsed = monotonic_time () - start;
+	r->stats.busy_time += elapsed;
+	if (elapsed > r->stats.max_resume)
+	{
+		/* Remember which thread hogged the loop the longest. */
+		r->stats.max_resume = elapsed;
+		lua_getuservalue (L, 1);
+		lua_pushvalue (L, 2);
+		lua_setfield (L, -2, "max_resume_thread");
+		lua_pop (L, 1);
+	}
+}
+/* }}} */
+
+/* {{{ watchdog_hook() */
+/* Count hook set on threads while the watchdog is enabled. The first time a
+ * resume runs past the threshold, the thread's traceback is saved. */
+static void watchdog_hook (lua_State *L1, lua_Debug *ar)
+{
+	lua_rawgetp (L1, LUA_REGISTRYINDEX, &watchdog_key);
+	struct ratchet *r = (struct ratchet *) lua_touserdata (L1, -1);
+	lua_pop (L1, 1);
+
+	if (!r || r->stalled || monotonic_time () - r->resume_start < r->watchdog)
+		return;
+
+	r->stalled = 1;
+	luaL_traceback (L1, L1, NULL, 0);
+	lua_rawsetp (L1, LUA_REGISTRYINDEX, &watchdog_trace_key);
+}
+/* }}} */
+
+/* {{{ start_watchdog() */
+/* Returns the previously watched ratchet object, which may be another
+ * kernel running this one from inside a thread. */
+static void *start_watchdog (lua_State *L, struct ratchet *r, lua_State *L1, double start)
+{
+	lua_rawgetp (L, LUA_REGISTRYINDEX, &watchdog_key);
+	void *prev = lua_touserdata (L, -1);
+	lua_pop (L, 1);
+	lua_pushlightuserdata (L, r);
+	lua_rawsetp (L, LUA_REGISTRYINDEX, &watchdog_key);
+
+	r->resume_start = start;
+	r->stalled = 0;
+	lua_sethook (L1, watchdog_hook, LUA_MASKCOUNT, RATCHET_WATCHDOG_HOOK_COUNT);
+
+	return prev;
+}
+/* }}} */
+
+/* {{{ end_watchdog() */
+/* Counts a stall if the thread at index 2 ran past the threshold, and calls
+ * the watchdog callback with the thread, the seconds it ran and where it was
+ * running. Threads stuck in a C function are never seen by the hook, so the
+ * traceback is taken from where they stopped instead. */
+static void end_watchdog (lua_State *L, struct ratchet *r, lua_State *L1, void *prev, double start)
+{
+	double elapsed = monotonic_time () - start;
+
+	lua_sethook (L1, NULL, 0, 0);
+	if (prev)
+		lua_pushlightuserdata (L, prev);
+	else
+		lua_pushnil (L);
+	lua_rawsetp (L, LUA_REGISTRYINDEX, &watchdog_key);
+
+	if (!r->stalled && elapsed < r->watchdog)
+		return;
+	r->stats.stalls++;
+
+	lua_getuservalue (L, 1);
+	lua_getfield (L, -1, "watchdog_callback");
+	if (lua_isnil (L, -1))
+		lua_pop (L, 2);
+	else
+	{
+		lua_replace (L, -2);
+		lua_pushvalue (L, 2);
+		lua_pushnumber (L, (lua_Number) elapsed);
+		if (r->stalled)
+			lua_rawgetp (L, LUA_REGISTRYINDEX, &watchdog_trace_key);
+		else
+			luaL_traceback (L, L1, NULL, 0);
+		lua_call (L, 3, 0);
+	}
+
+	lua_pushnil (L);
+	lua_rawsetp (L, LUA_REGISTRYINDEX, &watchdog_trace_key);
+}
+/* }}} */
+
 /* {{{ ratchet_run_thread() */
 static int ratchet_run_thread (lua_State *L)
 {
-	(void) get_event_base (L, 1);
+	struct ratchet *r = get_ratchet (L, 1);
 	get_thread (L, 2, L1);
+	lua_settop (L, 2);
+
+	/* The state stays on the stack, in case the thread ends itself. */
+	struct thread_state *state = push_thread_state (L, 2);
+	double start = monotonic_time ();
+	int nargs, ret, watched = 0;
+	void *prev_watched = NULL;
+
+	if (state)
+	{
+		r->stats.resumes[state->waiting]++;
+		if (state->ready_time > 0.0)
+		{
+			r->stats.lag[histogram_bucket (start - state->ready_time)]++;
+			state->ready_time = 0.0;
+		}
+	}
 
-	int nargs, ret;
+	/* A hook the thread set for itself is left alone. */
+	if (r->watchdog > 0.0 && !lua_gethook (L1))
+	{
+		prev_watched = start_watchdog (L, r, L1, start);
+		watched = 1;
+	}
 
 restart_thread:
 	nargs = lua_gettop (L1);
@@ -722,8 +2038,18 @@ restart_thread:
 		nargs--;
 	ret = lua_resume (L1, L, nargs);
 
+	if (ret != LUA_YIELD || !lua_islightuserdata (L1, 1) || RATCHET_YIELD_GET != lua_touserdata (L1, 1))
+	{
+		count_run_time (L, r, start);
+		if (watched)
+			end_watchdog (L, r, L1, prev_watched, start);
+	}
+
 	if (ret == LUA_OK)
+	{
 		end_thread_persist (L, 2);	/* Remove the entry from the persistance tables. */
+		recycle_thread (L, 2);
+	}
 
 	else if (ret == LUA_YIELD)
 	{
@@ -738,8 +2064,11 @@ restart_thread:
 			goto restart_thread;
 		}
 
+		if (state)
+			state->waiting = get_wait_reason (L1);
+
 		/* Call self:yield_thread(). */
-		lua_getfield (L, 1, "yield_thread");
+		push_helper (L, "yield_thread", ratchet_yield_thread);
 		lua_pushvalue (L, 1);
 		lua_pushvalue (L, 2);
 		lua_call (L, 2, 0);
@@ -774,19 +2103,19 @@ static int ratchet_yield_thread (lua_State *L)
 	void *yield_type = lua_touserdata (L1, 1);
 
 	if (RATCHET_YIELD_WRITE == yield_type)
-		lua_getfield (L, 1, "wait_for_write");
+		push_helper (L, "wait_for_write", ratchet_wait_for_write);
 
 	else if (RATCHET_YIELD_READ == yield_type)
-		lua_getfield (L, 1, "wait_for_read");
+		push_helper (L, "wait_for_read", ratchet_wait_for_read);
 
 	else if (RATCHET_YIELD_SIGNAL == yield_type)
-		lua_getfield (L, 1, "wait_for_signal");
+		push_helper (L, "wait_for_signal", ratchet_wait_for_signal);
 
 	else if (RATCHET_YIELD_TIMEOUT == yield_type)
-		lua_getfield (L, 1, "wait_for_timeout");
+		push_helper (L, "wait_for_timeout", ratchet_wait_for_timeout);
 
 	else if (RATCHET_YIELD_MULTIRW == yield_type)
-		lua_getfield (L, 1, "wait_for_multi");
+		push_helper (L, "wait_for_multi", ratchet_wait_for_multi);
 
 	else
 	{
@@ -814,35 +2143,207 @@ static int ratchet_yield_thread (lua_State *L)
 }
 /* }}} */
 
+/* {{{ wait_for_watch() */
+static int wait_for_watch (lua_State *L, short what)
+{
+	struct ratchet *r = get_ratchet (L, 1);
+	get_thread (L, 2, L1);
+	struct ratchet_watch *watch = (struct ratchet_watch *) lua_touserdata (L, 3);
+	double timeout = (double) luaL_optnumber (L, 4, -1.0);
+	int dir = (what == EV_READ ? 0 : 1);
+	int flag = (what == EV_READ ? RATCHET_WATCH_READ : RATCHET_WATCH_WRITE);
+
+	if (watch->fd < 0)
+		return ratchet_error_str (L, NULL, "EBADF", "Invalid file descriptor: %d", watch->fd);
+
+	/* Register the file descriptor once, the first time it is waited on. */
+	if (!watch->ev || event_get_base (watch->ev) != r->base)
+	{
+		ratchet_watch_detach (watch);
+		watch->ev = event_new (r->base, watch->fd, EV_READ | EV_WRITE | EV_PERSIST | EV_ET, watch_triggered, watch);
+		if (!watch->ev || event_add (watch->ev, NULL) < 0)
+			return luaL_error (L, "Failed to register file descriptor: %d", watch->fd);
+
+		watch->ready = 0;
+		watch->next = r->watches;
+		watch->pprev = &r->watches;
+		if (r->watches)
+			r->watches->pprev = &watch->next;
+		r->watches = watch;
+	}
+
+	/* The thread's own state doubles as the cleanup object. */
+	struct thread_state *state = push_thread_state (L, 2);
+	struct event *ev = thread_event (state);
+	event_del (ev);
+	end_thread_watch (state);
+	struct thread_state **tail = &watch->waiting[dir];
+	while (*tail)
+		tail = &(*tail)->watch_next;
+	state->watch = watch;
+	state->watch_pprev = tail;
+	*tail = state;
+
+	/* An edge seen since the object last blocked wakes without the fd. */
+	if (watch->ready & flag)
+	{
+		event_assign (ev, r->base, -1, 0, event_triggered, L1);
+		event_active (ev, what, 1);
+	}
+
+	if (timeout >= 0.0)
+		timerwheel_add (&r->timers, &state->timer, timeout, thread_timer_expired, L1);
+	else
+		timerwheel_del (&state->timer);
+
+	lua_xmove (L, L1, 1);
+
+	return 0;
+}
+/* }}} */
+
+#if HAVE_LIBURING
+/* {{{ adopt_uring_op() */
+/* The operation was abandoned by a thread that stopped waiting on it but has
+ * not completed yet. Submitting another would race it for the same data, so
+ * the thread waits for its completion instead. */
+static int adopt_uring_op (lua_State *L, struct ratchet_uring_op *op, double timeout)
+{
+	struct ratchet *r = get_ratchet (L, 1);
+	get_thread (L, 2, L1);
+
+	op->L1 = L1;
+	op->timed_out = 0;
+
+	struct thread_state *state = push_thread_state (L, 2);
+	event_del (thread_event (state));
+	state->uring = op;
+
+	if (timeout >= 0.0)
+		timerwheel_add (&r->timers, &state->timer, timeout, uring_timer_expired, op);
+	else
+		timerwheel_del (&state->timer);
+
+	lua_xmove (L, L1, 1);
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ wait_for_uring() */
+static int wait_for_uring (lua_State *L, struct ratchet_uring_op *op)
+{
+	struct ratchet *r = get_ratchet (L, 1);
+	struct ratchet_uring *u = r->uring;
+	get_thread (L, 2, L1);
+	double timeout = get_timeout_from_object (L, 3);
+
+	if (op->busy && op->L1)
+		return luaL_error (L, "io_uring operation already in progress.");
+	if (op->fd < 0)
+		return ratchet_error_str (L, NULL, "EBADF", "Invalid file descriptor: %d", op->fd);
+	if (op->busy)
+		return adopt_uring_op (L, op, timeout);
+
+	/* Receives land in a buffer kept with the operation. */
+	if (RATCHET_URING_RECV == op->type)
+	{
+		lua_getuservalue (L, 4);
+		lua_getfield (L, -1, "buffer");
+		if (lua_rawlen (L, -1) < op->len)
+		{
+			lua_pop (L, 1);
+			lua_newuserdata (L, op->len);
+			lua_pushvalue (L, -1);
+			lua_setfield (L, -3, "buffer");
+		}
+		op->buf = lua_touserdata (L, -1);
+		lua_pop (L, 2);
+	}
+
+	struct io_uring_sqe *sqe = get_uring_sqe (u);
+	if (!sqe)
+		return luaL_error (L, "Failed to queue io_uring operation.");
+	if (RATCHET_URING_RECV == op->type)
+		io_uring_prep_recv (sqe, op->fd, op->buf, op->len, 0);
+	else if (RATCHET_URING_SEND == op->type)
+		io_uring_prep_send (sqe, op->fd, op->buf, op->len, MSG_NOSIGNAL);
+	else if (RATCHET_URING_ACCEPT == op->type)
+	{
+		op->addrlen = sizeof (op->addr);
+		io_uring_prep_accept (sqe, op->fd, (struct sockaddr *) &op->addr, &op->addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	}
+	else
+		io_uring_prep_poll_add (sqe, op->fd, op->events);
+	io_uring_sqe_set_data (sqe, op);
+	u->pending++;
+	if (1 == ++u->outstanding)
+		event_add (u->ev, NULL);
+
+	op->busy = 1;
+	op->L1 = L1;
+	op->ring = u;
+	lua_getuservalue (L, 1);
+	lua_getfield (L, -1, "uring_ops");
+	lua_pushvalue (L, 4);
+	lua_rawsetp (L, -2, op);
+	lua_pop (L, 2);
+
+	/* The thread's own state doubles as the cleanup object. */
+	struct thread_state *state = push_thread_state (L, 2);
+	event_del (thread_event (state));
+	state->uring = op;
+
+	if (timeout >= 0.0)
+		timerwheel_add (&r->timers, &state->timer, timeout, uring_timer_expired, op);
+	else
+		timerwheel_del (&state->timer);
+
+	lua_xmove (L, L1, 1);
+
+	return 0;
+}
+/* }}} */
+#endif
+
 /* {{{ ratchet_wait_for_write() */
 static int ratchet_wait_for_write (lua_State *L)
 {
+	/* Persistent registrations are given as a light userdata, see ratchet.h. */
+	if (lua_islightuserdata (L, 3))
+		return wait_for_watch (L, EV_WRITE);
+
+#if HAVE_LIBURING
+	/* A kernel with io_uring completes an operation given after the object. */
+	struct ratchet_uring_op *op = (struct ratchet_uring_op *) luaL_testudata (L, 4, "ratchet_uring_op_meta");
+	if (op && get_ratchet (L, 1)->uring)
+		return wait_for_uring (L, op);
+#endif
+
 	/* Gather args into usable data. */
-	struct event_base *e_b = get_event_base (L, 1);
+	struct ratchet *r = get_ratchet (L, 1);
 	get_thread (L, 2, L1);
-	int fd = get_fd_from_object (L, 3);
+	int fd = ratchet_get_fd (L, 3);
 	double timeout = get_timeout_from_object (L, 3);
 
-	/* Cleanup table for kill()ing the thread. */
-	lua_createtable (L1, 0, 1);
-
 	if (fd < 0)
 		return ratchet_error_str (L, NULL, "EBADF", "Invalid file descriptor: %d", fd);
 
-	/* Build timeout data. */
-	struct timeval tv;
-	int use_tv = gettimeval (timeout, &tv);
-
-	/* Build event. */
-	struct event *ev = (struct event *) lua_newuserdata (L1, event_get_struct_event_size ());
-	luaL_getmetatable (L1, "ratchet_event_internal_meta");
-	lua_setmetatable (L1, -2);
+	/* Re-arm the thread's own event, it doubles as the cleanup object. */
+	struct thread_state *state = push_thread_state (L, 2);
+	struct event *ev = thread_event (state);
+	event_del (ev);
+	event_assign (ev, r->base, fd, EV_WRITE, event_triggered, L1);
+	event_priority_set (ev, state->priority);
+	event_add (ev, NULL);
 
-	/* Queue up the event. */
-	event_assign (ev, e_b, fd, EV_WRITE, event_triggered, L1);
-	event_add (ev, (use_tv ? &tv : NULL));
+	/* The timeout goes on the timer wheel rather than the libevent heap. */
+	if (timeout >= 0.0)
+		timerwheel_add (&r->timers, &state->timer, timeout, thread_timer_expired, L1);
+	else
+		timerwheel_del (&state->timer);
 
-	lua_setfield (L1, -2, "event");
+	lua_xmove (L, L1, 1);
 
 	return 0;
 }
@@ -851,32 +2352,41 @@ static int ratchet_wait_for_write (lua_State *L)
 /* {{{ ratchet_wait_for_read() */
 static int ratchet_wait_for_read (lua_State *L)
 {
+	/* Persistent registrations are given as a light userdata, see ratchet.h. */
+	if (lua_islightuserdata (L, 3))
+		return wait_for_watch (L, EV_READ);
+
+#if HAVE_LIBURING
+	/* A kernel with io_uring completes an operation given after the object. */
+	struct ratchet_uring_op *op = (struct ratchet_uring_op *) luaL_testudata (L, 4, "ratchet_uring_op_meta");
+	if (op && get_ratchet (L, 1)->uring)
+		return wait_for_uring (L, op);
+#endif
+
 	/* Gather args into usable data. */
-	struct event_base *e_b = get_event_base (L, 1);
+	struct ratchet *r = get_ratchet (L, 1);
 	get_thread (L, 2, L1);
-	int fd = get_fd_from_object (L, 3);
+	int fd = ratchet_get_fd (L, 3);
 	double timeout = get_timeout_from_object (L, 3);
 
-	/* Cleanup table for kill()ing the thread. */
-	lua_createtable (L1, 0, 1);
-
 	if (fd < 0)
 		return ratchet_error_str (L, NULL, "EBADF", "Invalid file descriptor: %d", fd);
 
-	/* Build timeout data. */
-	struct timeval tv;
-	int use_tv = gettimeval (timeout, &tv);
-
-	/* Build event. */
-	struct event *ev = (struct event *) lua_newuserdata (L1, event_get_struct_event_size ());
-	luaL_getmetatable (L1, "ratchet_event_internal_meta");
-	lua_setmetatable (L1, -2);
+	/* Re-arm the thread's own event, it doubles as the cleanup object. */
+	struct thread_state *state = push_thread_state (L, 2);
+	struct event *ev = thread_event (state);
+	event_del (ev);
+	event_assign (ev, r->base, fd, EV_READ, event_triggered, L1);
+	event_priority_set (ev, state->priority);
+	event_add (ev, NULL);
 
-	/* Queue up the event. */
-	event_assign (ev, e_b, fd, EV_READ, event_triggered, L1);
-	event_add (ev, (use_tv ? &tv : NULL));
+	/* The timeout goes on the timer wheel rather than the libevent heap. */
+	if (timeout >= 0.0)
+		timerwheel_add (&r->timers, &state->timer, timeout, thread_timer_expired, L1);
+	else
+		timerwheel_del (&state->timer);
 
-	lua_setfield (L1, -2, "event");
+	lua_xmove (L, L1, 1);
 
 	return 0;
 }
@@ -891,11 +2401,38 @@ static int ratchet_wait_for_signal (lua_State *L)
 	int sig = (int) lua_tointeger (L, 3);
 	struct timeval tv;
 	int use_tv = gettimeval_opt (L, 4, &tv);
+	int priority = get_thread_priority (L, 2);
 
 	/* Cleanup table for kill()ing the thread. */
-	lua_createtable (L1, 0, 1);
+	lua_createtable (L1, 0, 4);
 	lua_newtable (L1);
 
+#if HAVE_SIGNALFD
+	/* Join the set of threads woken by the dispatcher for this signal. */
+	struct signal_dispatch *d = push_signal_dispatch (L);
+	signal_ref (L, d, sig);
+	lua_getuservalue (L, -1);
+	lua_getfield (L, -1, "waiters");
+	lua_rawgeti (L, -1, sig);
+	if (!lua_istable (L, -1))
+	{
+		lua_pop (L, 1);
+		lua_newtable (L);
+		lua_pushvalue (L, -1);
+		lua_rawseti (L, -3, sig);
+	}
+	lua_pushvalue (L, 2);
+	lua_pushboolean (L, 1);
+	lua_rawset (L, -3);
+
+	lua_xmove (L, L1, 1);
+	lua_setfield (L1, -3, "signal_waiters");
+	lua_pop (L, 2);
+	lua_xmove (L, L1, 1);
+	lua_setfield (L1, -3, "signal_dispatch");
+	lua_pushinteger (L1, sig);
+	lua_setfield (L1, -3, "signal");
+#else
 	/* Build signal event. */
 	struct event *ev = (struct event *) lua_newuserdata (L1, event_get_struct_event_size ());
 	luaL_getmetatable (L1, "ratchet_event_internal_meta");
@@ -904,7 +2441,9 @@ static int ratchet_wait_for_signal (lua_State *L)
 
 	/* Queue up the signal event. */
 	event_assign (ev, e_b, sig, EV_SIGNAL, signal_triggered, L1);
+	event_priority_set (ev, priority);
 	event_add (ev, NULL);
+#endif
 
 	if (use_tv)
 	{
@@ -912,10 +2451,11 @@ static int ratchet_wait_for_signal (lua_State *L)
 		struct event *timeout = (struct event *) lua_newuserdata (L1, event_get_struct_event_size ());
 		luaL_getmetatable (L1, "ratchet_event_internal_meta");
 		lua_setmetatable (L1, -2);
-		lua_rawseti (L1, -2, 2);
+		lua_rawseti (L1, -2, lua_rawlen (L1, -2) + 1);
 
 		/* Queue up the timeout event. */
 		evtimer_assign (timeout, e_b, signal_triggered, L1);
+		event_priority_set (timeout, priority);
 		evtimer_add (timeout, &tv);
 	}
 
@@ -934,18 +2474,20 @@ static int ratchet_wait_for_timeout (lua_State *L)
 	struct timeval tv;
 	gettimeval_arg (L, 3, &tv);
 
-	/* Cleanup table for kill()ing the thread. */
-	lua_createtable (L1, 0, 1);
-
-	/* Build event and queue it up. */
-	struct event *ev = (struct event *) lua_newuserdata (L1, event_get_struct_event_size ());
-	luaL_getmetatable (L1, "ratchet_event_internal_meta");
-	lua_setmetatable (L1, -2);
-	lua_setfield (L1, -2, "event");
-
+	/* Re-arm the thread's own event, it doubles as the cleanup object. */
+	struct thread_state *state = push_thread_state (L, 2);
+	struct event *ev = thread_event (state);
+	event_del (ev);
+	timerwheel_del (&state->timer);
 	evtimer_assign (ev, e_b, timeout_triggered, L1);
+	event_priority_set (ev, state->priority);
 	evtimer_add (ev, &tv);
 
+	/* Lag is measured from when the timer should have fired. */
+	state->ready_time = monotonic_time () + fromtimeval (&tv);
+
+	lua_xmove (L, L1, 1);
+
 	return 0;
 }
 /* }}} */
@@ -955,7 +2497,8 @@ static int ratchet_wait_for_multi (lua_State *L)
 {
 	/* Gather args into usable data. */
 	lua_settop (L, 5);
-	struct event_base *e_b = get_event_base (L, 1);
+	struct ratchet *r = get_ratchet (L, 1);
+	struct event_base *e_b = r->base;
 	get_thread (L, 2, L1);
 	luaL_checktype (L, 3, LUA_TTABLE);
 	if (!lua_isnoneornil (L, 4))
@@ -965,23 +2508,22 @@ static int ratchet_wait_for_multi (lua_State *L)
 		lua_newtable (L);
 		lua_replace (L, 4);
 	}
-	struct timeval tv;
-	int use_tv = gettimeval_opt (L, 5, &tv);
+	double timeout = (double) luaL_optnumber (L, 5, -1.0);
+	struct thread_state *state = push_thread_state (L, 2);
+	lua_pop (L, 1);
+	int priority = (state ? state->priority : RATCHET_PRIORITY_NORMAL);
 
 	int i, nread = lua_rawlen (L, 3), nwrite = lua_rawlen (L, 4);
 
 	lua_createtable (L1, 0, 2);
 
-	/* Create timeout event. */
-	struct event *timeout = (struct event *) lua_newuserdata (L1, event_get_struct_event_size ());
-	luaL_getmetatable (L1, "ratchet_event_internal_meta");
-	lua_setmetatable (L1, -2);
-	lua_setfield (L1, -2, "event");
-
-	/* Queue up timeout event. */
-	evtimer_assign (timeout, e_b, multi_event_triggered, L1);
-	if (use_tv)
-		evtimer_add (timeout, &tv);
+	/* Queue up timeout on the timer wheel. */
+	if (state && timeout >= 0.0)
+	{
+		timerwheel_add (&r->timers, &state->timer, timeout, multi_timer_expired, L1);
+		lua_pushlightuserdata (L1, &state->timer);
+		lua_setfield (L1, -2, "timer");
+	}
 
 	lua_newtable (L1);
 	lua_createtable (L1, nread+nwrite, 0);
@@ -989,7 +2531,7 @@ static int ratchet_wait_for_multi (lua_State *L)
 	for (i=1; i<=nread; i++)
 	{
 		lua_rawgeti (L, 3, i);
-		int fd = get_fd_from_object (L, -1);
+		int fd = ratchet_get_fd (L, -1);
 
 		lua_pushinteger (L1, fd);
 		lua_xmove (L, L1, 1);
@@ -1003,13 +2545,14 @@ static int ratchet_wait_for_multi (lua_State *L)
 
 		/* Queue up the event. */
 		event_assign (ev, e_b, fd, EV_READ, multi_event_triggered, L1);
+		event_priority_set (ev, priority);
 		event_add (ev, NULL);
 	}
 
 	for (i=1; i<=nwrite; i++)
 	{
 		lua_rawgeti (L, 4, i);
-		int fd = get_fd_from_object (L, -1);
+		int fd = ratchet_get_fd (L, -1);
 
 		lua_pushinteger (L1, fd);
 		lua_xmove (L, L1, 1);
@@ -1023,6 +2566,7 @@ static int ratchet_wait_for_multi (lua_State *L)
 
 		/* Queue up the event. */
 		event_assign (ev, e_b, fd, EV_WRITE, multi_event_triggered, L1);
+		event_priority_set (ev, priority);
 		event_add (ev, NULL);
 	}
 
@@ -1034,6 +2578,25 @@ static int ratchet_wait_for_multi (lua_State *L)
 
 /* ---- ratchet.thread Functions -------------------------------------------- */
 
+/* {{{ attach_thread() */
+/* Replaces the function below the top nargs values, and the values, with a
+ * new ready thread that calls the function with them. */
+static void attach_thread (lua_State *L, int nargs, int priority)
+{
+	int index = lua_gettop (L) - nargs;
+
+	/* Set up new coroutine. */
+	lua_State *L1 = push_new_thread (L);
+	lua_insert (L, index);
+	lua_xmove (L, L1, nargs+1);
+
+	set_thread_persist (L, index);
+	push_thread_state (L, index)->priority = priority;
+	lua_pop (L, 1);
+	set_thread_ready (L, index);
+}
+/* }}} */
+
 /* {{{ ratchet_attach() */
 static int ratchet_attach (lua_State *L)
 {
@@ -1047,22 +2610,52 @@ static int ratchet_attach (lua_State *L)
 	lua_insert (L, 1);
 	(void) get_event_base (L, 1);
 
-	luaL_checkany (L, 2);	/* Function or callable object. */
-	int nargs = lua_gettop (L) - 2;
-
-	/* Set up new coroutine. */
-	lua_State *L1 = lua_newthread (L);
-	lua_insert (L, 2);
-	lua_xmove (L, L1, nargs+1);
+	/* An optional priority name may come before the function. */
+	int priority = RATCHET_PRIORITY_NORMAL;
+	if (lua_type (L, 2) == LUA_TSTRING)
+	{
+		priority = check_priority (L, 2);
+		lua_remove (L, 2);
+	}
 
-	set_thread_persist (L, 2 /* index of thread */);
-	set_thread_ready (L, 2 /* index of thread */);
+	luaL_checkany (L, 2);	/* Function or callable object. */
+	attach_thread (L, lua_gettop (L) - 2, priority);
 
 	lua_pushvalue (L, 2);
 	return 1;
 }
 /* }}} */
 
+/* {{{ ratchet_set_priority() */
+static int ratchet_set_priority (lua_State *L)
+{
+	int ctx = 0;
+	if (LUA_OK == lua_getctx (L, &ctx))
+	{
+		lua_pushlightuserdata (L, RATCHET_YIELD_GET);
+		return lua_yieldk (L, 1, ctx, ratchet_set_priority);
+	}
+
+	lua_insert (L, 1);
+	(void) get_event_base (L, 1);
+	int priority = check_priority (L, 2);
+	lua_settop (L, 3);
+	if (lua_isnil (L, 3))
+	{
+		lua_pushthread (L);
+		lua_replace (L, 3);
+	}
+	else
+		luaL_checktype (L, 3, LUA_TTHREAD);
+
+	struct thread_state *state = push_thread_state (L, 3);
+	if (state)
+		state->priority = priority;
+
+	return 0;
+}
+/* }}} */
+
 /* {{{ ratchet_block_on() */
 static int ratchet_block_on (lua_State *L)
 {
@@ -1099,21 +2692,145 @@ static int ratchet_wait_all (lua_State *L)
 	lua_insert (L, 1);
 	(void) get_event_base (L, 1);
 
-	int i;
+	int i, join_count = 0;
 	luaL_checktype (L, 2, LUA_TTABLE);
 	lua_settop (L, 2);
 	if (lua_pushthread (L))
 		return luaL_error (L, "ratchet.thread.wait_all() cannot be called from main thread.");
-	lua_pop (L, 1);
 
-	lua_getuservalue (L, 1);
-	lua_getfield (L, -1, "waiting_on");
+	lua_getuservalue (L, 1);
+	lua_getfield (L, -1, "joiners");
+
+	/* Add this thread to the joiners set of each child still running. */
+	for (i=1; ; i++)
+	{
+		lua_rawgeti (L, 2, i);
+		if (lua_isnil (L, -1))
+		{
+			lua_pop (L, 1);
+			break;
+		}
+
+		if (!lua_isthread (L, -1))
+			return luaL_error (L, "Table item %d is not a thread.", i);
+
+		/* Skip if thread is finished, errored out or killed. */
+		if (!push_thread_state (L, -1))
+		{
+			lua_pop (L, 2);
+			continue;
+		}
+		lua_pop (L, 1);
+
+		lua_pushvalue (L, -1);
+		lua_rawget (L, 5);
+		if (lua_isnil (L, -1))
+		{
+			lua_pop (L, 1);
+			lua_newtable (L);
+			lua_getmetatable (L, 5);
+			lua_setmetatable (L, -2);
+			lua_pushvalue (L, -2);
+			lua_pushvalue (L, -2);
+			lua_rawset (L, 5);
+		}
+
+		lua_pushvalue (L, 3);
+		lua_rawget (L, -2);
+		if (lua_isnil (L, -1))
+		{
+			lua_pushvalue (L, 3);
+			lua_pushboolean (L, 1);
+			lua_rawset (L, -4);
+			join_count++;
+		}
+		lua_pop (L, 3);
+	}
+
+	struct thread_state *state = push_thread_state (L, 3);
+	lua_settop (L, 2);
+	if (0 == join_count)
+		return 0;
+	state->join_count = join_count;
+
+	lua_pushlightuserdata (L, RATCHET_YIELD_WAITALL);
+	return lua_yield (L, 1);
+}
+/* }}} */
+
+/* {{{ leave_joiners() */
+/* Removes the thread at index 3 from the joiners set of each thread in the
+ * table at index 2. */
+static void leave_joiners (lua_State *L)
+{
+	int i;
+
+	lua_getuservalue (L, 1);
+	lua_getfield (L, -1, "joiners");
+	for (i=1; ; i++)
+	{
+		lua_rawgeti (L, 2, i);
+		if (lua_isnil (L, -1))
+		{
+			lua_pop (L, 1);
+			break;
+		}
+
+		lua_rawget (L, -2);
+		if (lua_istable (L, -1))
+		{
+			lua_pushvalue (L, 3);
+			lua_pushnil (L);
+			lua_rawset (L, -3);
+		}
+		lua_pop (L, 1);
+	}
+	lua_pop (L, 2);
+}
+/* }}} */
+
+/* {{{ ratchet_wait_any() */
+static int ratchet_wait_any (lua_State *L)
+{
+	int ctx = 0;
+	lua_getctx (L, &ctx);
+
+	if (ctx == 0)
+	{
+		luaL_checktype (L, 1, LUA_TTABLE);
+		lua_settop (L, 1);
+		if (lua_pushthread (L))
+			return luaL_error (L, "ratchet.thread.wait_any() cannot be called from main thread.");
+		lua_pop (L, 1);
+
+		lua_pushlightuserdata (L, RATCHET_YIELD_GET);
+		return lua_yieldk (L, 1, 1, ratchet_wait_any);
+	}
+
+	if (ctx == 2)
+	{
+		/* Woken once, by a thread ending, an object's file descriptor, or
+		 * the earliest timer. Clean up whatever did not fire. */
+		struct thread_state *state = push_thread_state (L, 3);
+		lua_pop (L, 1);
+		state->wait_any = 0;
+		leave_joiners (L);
+
+		if (lua_toboolean (L, 5))
+			lua_pushvalue (L, 5);
+		else
+			lua_rawgeti (L, 2, lua_tointeger (L, 4));
+		return 1;
+	}
+
+	lua_insert (L, 1);
+	(void) get_event_base (L, 1);
+	lua_pushthread (L);
 
-	/* Iterate through table of children, building duplicate with
-	 * the child threads as weak keys. */
-	lua_newtable (L);
-	lua_getmetatable (L, 4);
-	lua_setmetatable (L, -2);
+	int i, timer = 0;
+	double timeout = -1.0;
+
+	/* Finished threads and zero timers need no waiting at all. */
 	for (i=1; ; i++)
 	{
 		lua_rawgeti (L, 2, i);
@@ -1123,28 +2840,85 @@ static int ratchet_wait_all (lua_State *L)
 			break;
 		}
 
-		if (!lua_isthread (L, -1))
-			return luaL_error (L, "Table item %d is not a thread.", i);
+		if (lua_isthread (L, -1))
+		{
+			if (!push_thread_state (L, -1))
+			{
+				lua_pop (L, 1);
+				return 1;
+			}
+			lua_pop (L, 1);
+		}
+		else if (lua_type (L, -1) == LUA_TNUMBER)
+		{
+			double secs = (double) lua_tonumber (L, -1);
+			if (secs <= 0.0)
+				return 1;
+			if (timeout < 0.0 || secs < timeout)
+			{
+				timeout = secs;
+				timer = i;
+			}
+		}
+		lua_pop (L, 1);
+	}
+	if (i == 1)
+		return 0;
 
-		lua_State *L1 = lua_tothread (L, -1);
+	/* Join each thread, and gather the rest to wait on their descriptors. */
+	lua_getuservalue (L, 1);
+	lua_getfield (L, -1, "joiners");
+	lua_replace (L, -2);
+	lua_newtable (L);
+	int joiners = lua_gettop (L) - 1, nread = 0;
 
-		/* Skip if thread is finished or errored out. */
-		if (lua_status (L1) == LUA_OK && lua_gettop (L1) == 0)
-			continue;
-		else if (lua_status (L1) != LUA_OK && lua_status (L1) != LUA_YIELD)
-			continue;
+	for (i=1; ; i++)
+	{
+		lua_rawgeti (L, 2, i);
+		if (lua_isnil (L, -1))
+		{
+			lua_pop (L, 1);
+			break;
+		}
 
-		lua_pushboolean (L, 1);
-		lua_rawset (L, 5);
+		if (lua_isthread (L, -1))
+		{
+			lua_pushvalue (L, -1);
+			lua_rawget (L, joiners);
+			if (lua_isnil (L, -1))
+			{
+				lua_pop (L, 1);
+				lua_newtable (L);
+				lua_getmetatable (L, joiners);
+				lua_setmetatable (L, -2);
+				lua_pushvalue (L, -2);
+				lua_pushvalue (L, -2);
+				lua_rawset (L, joiners);
+			}
+			lua_pushvalue (L, 3);
+			lua_pushboolean (L, 1);
+			lua_rawset (L, -3);
+			lua_pop (L, 2);
+		}
+		else if (lua_type (L, -1) == LUA_TNUMBER)
+			lua_pop (L, 1);
+		else
+			lua_rawseti (L, joiners+1, ++nread);
 	}
 
-	lua_pushthread (L);
-	lua_pushvalue (L, 5);
-	lua_settable (L, 4);
-	lua_settop (L, 2);
+	struct thread_state *state = push_thread_state (L, 3);
+	lua_pop (L, 1);
+	state->wait_any = 1;
 
-	lua_pushlightuserdata (L, RATCHET_YIELD_WAITALL);
-	return lua_yield (L, 1);
+	/* Keep the timer item index for the continuation, then yield the
+	 * descriptors and timeout as block_on() does. */
+	lua_pushinteger (L, timer);
+	lua_replace (L, joiners);
+	lua_pushlightuserdata (L, RATCHET_YIELD_MULTIRW);
+	lua_insert (L, -2);
+	lua_newtable (L);
+	lua_pushnumber (L, timeout);
+	return lua_yieldk (L, 4, 2, ratchet_wait_any);
 }
 /* }}} */
 
@@ -1204,6 +2978,35 @@ static int ratchet_pause (lua_State *L)
 }
 /* }}} */
 
+/* {{{ ratchet_yield() */
+static int ratchet_yield (lua_State *L)
+{
+	int ctx = 0;
+	if (LUA_OK == lua_getctx (L, &ctx))
+	{
+		if (lua_pushthread (L))
+			return luaL_error (L, "ratchet.thread.yield() cannot be called from main thread.");
+		lua_pop (L, 1);
+
+		lua_pushlightuserdata (L, RATCHET_YIELD_GET);
+		return lua_yieldk (L, 1, 1, ratchet_yield);
+	}
+
+	/* Resumed from the back of the ready queue. */
+	if (ctx == 2)
+		return 0;
+
+	lua_insert (L, 1);
+	lua_settop (L, 1);
+	lua_pushthread (L);
+	set_thread_ready (L, 2 /* index of thread */);
+
+	lua_settop (L, 0);
+	lua_pushlightuserdata (L, RATCHET_YIELD_PAUSE);
+	return lua_yieldk (L, 1, 2, ratchet_yield);
+}
+/* }}} */
+
 /* {{{ ratchet_unpause() */
 static int ratchet_unpause (lua_State *L)
 {
@@ -1304,29 +3107,19 @@ static int ratchet_alarm (lua_State *L)
 	if (lua_pushthread (L))
 		return luaL_error (L, "ratchet.thread.alarm() cannot be called from main thread.");
 
-	struct event_base *e_b = get_event_base (L, 1);
-	struct timeval tv;
-	gettimeval_arg (L, 2, &tv);
-
-	lua_getuservalue (L, 1);
-	lua_getfield (L, -1, "alarm_events");
+	struct ratchet *r = get_ratchet (L, 1);
+	double secs = (double) luaL_checknumber (L, 2);
+	if (secs < 0.0)
+		secs = 0.0;
 
-	/* Clean up and delete any existing alarm. */
-	lua_pushvalue (L, 4);
-	lua_rawget (L, -2);
-	if (!lua_isnil (L, -1))
-	{
-		struct event *ev = (struct event *) lua_touserdata (L, -1);
-		event_del (ev);
-	}
+	/* Re-arming the thread's alarm entry replaces any existing alarm. */
+	struct thread_state *state = push_thread_state (L, 4);
+	if (!state)
+		return luaL_error (L, "ratchet.thread.alarm() called from unknown thread.");
+	timerwheel_add (&r->timers, &state->alarm, secs, alarm_expired, L);
 	lua_pop (L, 1);
 
-	/* Setup new alarm event. */
-	lua_pushvalue (L, 4);
-	struct event *ev = (struct event *) lua_newuserdata (L, event_get_struct_event_size ());
-	evtimer_assign (ev, e_b, alarm_triggered, L);
-	evtimer_add (ev, &tv);
-	lua_rawset (L, -3);
+	lua_getuservalue (L, 1);
 
 	/* Set the callback, if given. */
 	lua_getfield (L, 5, "alarm_callbacks");
@@ -1340,6 +3133,319 @@ static int ratchet_alarm (lua_State *L)
 
 /* ---- Public Functions ---------------------------------------------------- */
 
+/* {{{ ratchet_get_event_base() */
+struct event_base *ratchet_get_event_base (lua_State *L, int index)
+{
+	return get_event_base (L, index);
+}
+/* }}} */
+
+/* {{{ ratchet_attach_thread() */
+void ratchet_attach_thread (lua_State *L, int nargs)
+{
+	(void) get_event_base (L, 1);
+	attach_thread (L, nargs, RATCHET_PRIORITY_NORMAL);
+}
+/* }}} */
+
+/* {{{ ratchet_wake_thread() */
+int ratchet_wake_thread (lua_State *L, int index, int nargs)
+{
+	(void) get_event_base (L, 1);
+	index = lua_absindex (L, index);
+	lua_State *L1 = lua_tothread (L, index);
+
+	/* Only threads the kernel still manages can be woken. */
+	struct thread_state *state = push_thread_state (L, index);
+	lua_pop (L, 1);
+	if (!L1 || !state || lua_status (L1) != LUA_YIELD)
+	{
+		lua_pop (L, nargs);
+		return 0;
+	}
+
+	/* The extra arguments become the return values of the yield. */
+	end_all_waiting_thread_events (L1);
+	lua_settop (L1, 0);
+	lua_xmove (L, L1, nargs);
+	set_thread_ready (L, index);
+
+	return 1;
+}
+/* }}} */
+
+/* {{{ ratchet_report_error() */
+void ratchet_report_error (lua_State *L, const char *where)
+{
+	lua_getuservalue (L, 1);
+	lua_getfield (L, -1, "error_handler");
+	lua_remove (L, -2);
+	if (!lua_isnil (L, -1))
+	{
+		lua_insert (L, -2);
+		lua_pushnil (L);
+		if (LUA_OK == lua_pcall (L, 2, 0, 0))
+			return;
+	}
+	else
+		lua_pop (L, 1);
+
+	fprintf (stderr, "%s: %s\n", where, luaL_tolstring (L, -1, NULL));
+	fflush (stderr);
+	lua_pop (L, 2);
+}
+/* }}} */
+
+/* {{{ ratchet_watch_child() */
+int ratchet_watch_child (lua_State *L, pid_t pid)
+{
+#if HAVE_SIGNALFD
+	int callback = lua_gettop (L);
+	struct signal_dispatch *d = push_signal_dispatch (L);
+	lua_getuservalue (L, -1);
+	lua_getfield (L, -1, "children");
+	int children = lua_gettop (L);
+
+	lua_pushinteger (L, (lua_Integer) pid);
+	lua_rawget (L, children);
+	if (lua_isnil (L, -1))
+		signal_ref (L, d, SIGCHLD);
+	lua_pop (L, 1);
+	lua_pushinteger (L, (lua_Integer) pid);
+	lua_pushvalue (L, callback);
+	lua_rawset (L, children);
+
+	/* The child may have exited before SIGCHLD was blocked. */
+	finish_child (L, d, children, pid);
+
+	lua_settop (L, callback-1);
+	return 1;
+#else
+	lua_pop (L, 1);
+	return 0;
+#endif
+}
+/* }}} */
+
+/* {{{ ratchet_uring_op_gc() */
+static int ratchet_uring_op_gc (lua_State *L)
+{
+	struct ratchet_uring_op *op = (struct ratchet_uring_op *) lua_touserdata (L, 1);
+	if (op->completed && RATCHET_URING_ACCEPT == op->type)
+		close (op->result);
+	op->completed = 0;
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ ratchet_uring_op_new() */
+struct ratchet_uring_op *ratchet_uring_op_new (lua_State *L)
+{
+	struct ratchet_uring_op *op = (struct ratchet_uring_op *) lua_newuserdata (L, sizeof (struct ratchet_uring_op));
+	memset (op, 0, sizeof (struct ratchet_uring_op));
+	op->fd = -1;
+	luaL_getmetatable (L, "ratchet_uring_op_meta");
+	lua_setmetatable (L, -2);
+	lua_newtable (L);
+	lua_setuservalue (L, -2);
+
+	return op;
+}
+/* }}} */
+
+/* {{{ is_removed_entry() */
+static int is_removed_entry (lua_State *L, int table, int pos)
+{
+	lua_rawgeti (L, table, pos);
+	int removed = (lua_touserdata (L, -1) == &ratchet_waitq_removed);
+	lua_pop (L, 1);
+	return removed;
+}
+/* }}} */
+
+/* {{{ trim_waitq() */
+/* Drops removed entries from both ends, so the head is always a value and a
+ * queue of only removed entries is empty. */
+static void trim_waitq (lua_State *L, struct ratchet_waitq *q, int table)
+{
+	while (q->head < q->tail && is_removed_entry (L, table, q->head+1))
+	{
+		lua_pushnil (L);
+		lua_rawseti (L, table, ++q->head);
+	}
+	while (q->head < q->tail && is_removed_entry (L, table, q->tail))
+	{
+		lua_pushnil (L);
+		lua_rawseti (L, table, q->tail--);
+	}
+
+	if (q->head == q->tail)
+		q->head = q->tail = 0;
+}
+/* }}} */
+
+/* {{{ ratchet_waitq_push() */
+int ratchet_waitq_push (lua_State *L, struct ratchet_waitq *q, int table)
+{
+	table = lua_absindex (L, table);
+	lua_rawseti (L, table, ++q->tail);
+	q->size++;
+
+	return q->tail;
+}
+/* }}} */
+
+/* {{{ ratchet_waitq_pop() */
+void ratchet_waitq_pop (lua_State *L, struct ratchet_waitq *q, int table)
+{
+	table = lua_absindex (L, table);
+	lua_rawgeti (L, table, ++q->head);
+	lua_pushnil (L);
+	lua_rawseti (L, table, q->head);
+	q->size--;
+
+	trim_waitq (L, q, table);
+}
+/* }}} */
+
+/* {{{ ratchet_waitq_remove() */
+int ratchet_waitq_remove (lua_State *L, struct ratchet_waitq *q, int table, int pos)
+{
+	table = lua_absindex (L, table);
+	int removed = 0;
+
+	/* A popped position may have been reused since, hence the comparison. */
+	if (pos > q->head && pos <= q->tail)
+	{
+		lua_rawgeti (L, table, pos);
+		removed = lua_rawequal (L, -1, -2);
+		lua_pop (L, 1);
+	}
+	lua_pop (L, 1);
+
+	if (removed)
+	{
+		lua_pushlightuserdata (L, &ratchet_waitq_removed);
+		lua_rawseti (L, table, pos);
+		q->size--;
+		trim_waitq (L, q, table);
+	}
+
+	return removed;
+}
+/* }}} */
+
+/* {{{ ratchet_waitq_wake() */
+int ratchet_waitq_wake (lua_State *L, struct ratchet_waitq *q, int table, int nargs)
+{
+	table = lua_absindex (L, table);
+	int args = lua_gettop (L) - nargs + 1;
+	int i;
+
+	while (!ratchet_waitq_empty (q))
+	{
+		ratchet_waitq_pop (L, q, table);
+		for (i=0; i<nargs; i++)
+			lua_pushvalue (L, args+i);
+		int woken = ratchet_wake_thread (L, -nargs-1, nargs);
+		lua_pop (L, 1);
+		if (woken)
+		{
+			lua_pop (L, nargs);
+			return 1;
+		}
+	}
+
+	lua_pop (L, nargs);
+	return 0;
+}
+/* }}} */
+
+/* {{{ ratchet_io_register() */
+void ratchet_io_register (lua_State *L, int index)
+{
+	index = lua_absindex (L, index);
+	lua_pushboolean (L, 1);
+	lua_rawsetp (L, index, &ratchet_io_key);
+}
+/* }}} */
+
+/* {{{ ratchet_io_test() */
+struct ratchet_io *ratchet_io_test (lua_State *L, int index)
+{
+	index = lua_absindex (L, index);
+	void *p = lua_touserdata (L, index);
+	if (!p || !lua_getmetatable (L, index))
+		return NULL;
+
+	lua_rawgetp (L, -1, &ratchet_io_key);
+	int registered = lua_toboolean (L, -1);
+	lua_pop (L, 2);
+
+	return (registered ? (struct ratchet_io *) p : NULL);
+}
+/* }}} */
+
+/* {{{ ratchet_get_fd() */
+int ratchet_get_fd (lua_State *L, int index)
+{
+	index = lua_absindex (L, index);
+	struct ratchet_io *io = ratchet_io_test (L, index);
+	if (io)
+		return io->fd;
+
+	lua_pushvalue (L, index);
+	lua_getfield (L, -1, "get_fd");
+	if (!lua_isfunction (L, -1))
+		luaL_argerror (L, index, "object has no get_fd() method");
+	lua_insert (L, -2);
+	lua_call (L, 1, 1);
+
+	int fd = lua_tointeger (L, -1);
+	lua_pop (L, 1);
+	return fd;
+}
+/* }}} */
+
+/* {{{ ratchet_watch_gc() */
+static int ratchet_watch_gc (lua_State *L)
+{
+	unlink_watch ((struct ratchet_watch *) lua_touserdata (L, 1));
+	return 0;
+}
+/* }}} */
+
+/* {{{ ratchet_watch_new() */
+struct ratchet_watch *ratchet_watch_new (lua_State *L, int fd)
+{
+	struct ratchet_watch *watch = (struct ratchet_watch *) lua_newuserdata (L, sizeof (struct ratchet_watch));
+	memset (watch, 0, sizeof (struct ratchet_watch));
+	watch->fd = fd;
+	watch->ready = RATCHET_WATCH_READ | RATCHET_WATCH_WRITE;
+
+	if (luaL_newmetatable (L, "ratchet_watch_internal_meta"))
+	{
+		lua_pushcfunction (L, ratchet_watch_gc);
+		lua_setfield (L, -2, "__gc");
+	}
+	lua_setmetatable (L, -2);
+
+	return watch;
+}
+/* }}} */
+
+/* {{{ ratchet_watch_detach() */
+void ratchet_watch_detach (struct ratchet_watch *watch)
+{
+	/* Threads blocked on the watch retry their operation, which fails with
+	 * EBADF if the object was closed or blocks again without the watch. */
+	wake_watch_waiters (watch, 0);
+	wake_watch_waiters (watch, 1);
+	unlink_watch (watch);
+}
+/* }}} */
+
 /* {{{ luaopen_ratchet() */
 int luaopen_ratchet (lua_State *L)
 {
@@ -1352,11 +3458,22 @@ int luaopen_ratchet (lua_State *L)
 	const luaL_Reg meths[] = {
 		/* Documented methods. */
 		{"get_method", ratchet_get_method},
+		{"get_io_backend", ratchet_get_io_backend},
 		{"get_num_threads", ratchet_get_num_threads},
 		{"loop", ratchet_loop},
 		{"break", ratchet_break},
 		{"loop_once", ratchet_loop_once},
 		{"get_space", ratchet_get_space},
+		{"stats", ratchet_stats},
+		{"get_watchdog", ratchet_get_watchdog},
+		{"set_watchdog", ratchet_set_watchdog},
+		{"get_run_budget", ratchet_get_run_budget},
+		{"set_run_budget", ratchet_set_run_budget},
+		{"get_thread_pool_size", ratchet_get_thread_pool_size},
+		{"set_thread_pool_size", ratchet_set_thread_pool_size},
+		{"get_timer_granularity", ratchet_get_timer_granularity},
+		{"set_timer_granularity", ratchet_set_timer_granularity},
+		{"set_method_dispatch", ratchet_set_method_dispatch},
 		/* Undocumented, helper methods. */
 		{"alarm_thread", ratchet_alarm_thread},
 		{"run_thread", ratchet_run_thread},
@@ -1367,7 +3484,6 @@ int luaopen_ratchet (lua_State *L)
 		{"wait_for_timeout", ratchet_wait_for_timeout},
 		{"wait_for_multi", ratchet_wait_for_multi},
 		{"start_threads_ready", ratchet_start_threads_ready},
-		{"start_threads_done_waiting", ratchet_start_threads_done_waiting},
 		{NULL}
 	};
 
@@ -1377,10 +3493,13 @@ int luaopen_ratchet (lua_State *L)
 		{"kill_all", ratchet_kill_all},
 		{"pause", ratchet_pause},
 		{"unpause", ratchet_unpause},
+		{"yield", ratchet_yield},
+		{"set_priority", ratchet_set_priority},
 		{"self", ratchet_running_thread},
 		{"block_on", ratchet_block_on},
 		{"sigwait", ratchet_sigwait},
 		{"wait_all", ratchet_wait_all},
+		{"wait_any", ratchet_wait_any},
 		{"space", ratchet_thread_space},
 		{"timer", ratchet_timer},
 		{"alarm", ratchet_alarm},
@@ -1401,6 +3520,21 @@ int luaopen_ratchet (lua_State *L)
 	luaL_setfuncs (L, eventmetameths, 0);
 	lua_pop (L, 1);
 
+	luaL_newmetatable (L, "ratchet_thread_internal_meta");
+	lua_pop (L, 1);
+
+	luaL_newmetatable (L, "ratchet_uring_op_meta");
+	lua_pushcfunction (L, ratchet_uring_op_gc);
+	lua_setfield (L, -2, "__gc");
+	lua_pop (L, 1);
+
+#if HAVE_SIGNALFD
+	luaL_newmetatable (L, "ratchet_signal_internal_meta");
+	lua_pushcfunction (L, ratchet_signal_gc);
+	lua_setfield (L, -2, "__gc");
+	lua_pop (L, 1);
+#endif
+
 	luaL_newmetatable (L, "ratchet_meta");
 	lua_newtable (L);
 	luaL_setfuncs (L, meths, 0);
@@ -1413,6 +3547,10 @@ int luaopen_ratchet (lua_State *L)
 	lua_setglobal (L, "ratchet");
 
 	luaL_newlib (L, thread_funcs);
+#if HAVE_OFFLOAD
+	luaopen_ratchet_offload (L);
+	lua_setfield (L, -2, "offload");
+#endif
 	lua_setfield (L, -2, "thread");
 
 	luaL_requiref (L, "ratchet.error", luaopen_ratchet_error, 0);
@@ -1421,9 +3559,22 @@ int luaopen_ratchet (lua_State *L)
 	luaL_requiref (L, "ratchet.exec", luaopen_ratchet_exec, 0);
 	lua_setfield (L, -2, "exec");
 
+	luaL_requiref (L, "ratchet.channel", luaopen_ratchet_channel, 0);
+	lua_setfield (L, -2, "channel");
+	luaL_requiref (L, "ratchet.semaphore", luaopen_ratchet_semaphore, 0);
+	lua_setfield (L, -2, "semaphore");
+	luaL_requiref (L, "ratchet.ratelimit", luaopen_ratchet_ratelimit, 0);
+	lua_setfield (L, -2, "ratelimit");
+	luaL_requiref (L, "ratchet.pollset", luaopen_ratchet_pollset, 0);
+	lua_setfield (L, -2, "pollset");
+	luaL_requiref (L, "ratchet.buffer", luaopen_ratchet_buffer, 0);
+	lua_setfield (L, -2, "buffer");
+
 #if HAVE_SOCKET
 	luaL_requiref (L, "ratchet.socket", luaopen_ratchet_socket, 0);
 	lua_setfield (L, -2, "socket");
+	luaL_requiref (L, "ratchet.cluster", luaopen_ratchet_cluster, 0);
+	lua_setfield (L, -2, "cluster");
 #endif
 #if HAVE_OPENSSL
 	luaL_requiref (L, "ratchet.ssl", luaopen_ratchet_ssl, 0);
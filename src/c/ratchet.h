@@ -1,12 +1,18 @@
 #ifndef __RATCHET_H
 #define __RATCHET_H
 
+#include <sys/types.h>
+#include <sys/socket.h>
+
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
 
 const char *ratchet_version (void);
 
+struct event_base;
+struct event;
+
 int luaopen_ratchet (lua_State *L);
 int luaopen_ratchet_error (lua_State *L);
 int luaopen_ratchet_socket (lua_State *L);
@@ -17,6 +23,13 @@ int luaopen_ratchet_dns (lua_State *L);
 int luaopen_ratchet_dns_hosts (lua_State *L);
 int luaopen_ratchet_dns_resolv_conf (lua_State *L);
 int luaopen_ratchet_exec (lua_State *L);
+int luaopen_ratchet_channel (lua_State *L);
+int luaopen_ratchet_semaphore (lua_State *L);
+int luaopen_ratchet_ratelimit (lua_State *L);
+int luaopen_ratchet_pollset (lua_State *L);
+int luaopen_ratchet_cluster (lua_State *L);
+int luaopen_ratchet_offload (lua_State *L);
+int luaopen_ratchet_buffer (lua_State *L);
 
 /* Error handling convenience functions. */
 #define ratchet_error_errno(L, f, s) ratchet_error_errno_ln (L, f, s, __FILE__, __LINE__)
@@ -38,5 +51,166 @@ int ratchet_error_str_ln (lua_State *L, const char *function, const char *code,
 #define RATCHET_YIELD_PAUSE ((void *) 7)
 #define RATCHET_YIELD_SIGNAL ((void *) 8)
 
+/* Kernel functions for C modules, the ratchet object must be at index 1. A
+ * woken thread gets the nargs values from the top of the stack as the
+ * return values of its yield. */
+struct event_base *ratchet_get_event_base (lua_State *L, int index);
+int ratchet_wake_thread (lua_State *L, int index, int nargs);
+
+/* Event callbacks have nowhere to raise an error, so they pass the one on top
+ * of the stack here. It goes to the error handler, with no thread, or is
+ * written to stderr if there is none or the handler fails too. The error is
+ * popped. */
+void ratchet_report_error (lua_State *L, const char *where);
+
+/* Attaches a new thread, as ratchet.thread.attach() does, calling the function
+ * below the top nargs values with them as arguments. The function and values
+ * are replaced by the new thread. */
+void ratchet_attach_thread (lua_State *L, int nargs);
+
+/* Has the kernel reap the child process once it exits, calling the function
+ * on top of the stack with the ratchet object and the wait status, or with
+ * no status if the child was reaped elsewhere. The function is popped. This
+ * returns 0 if the kernel cannot dispatch SIGCHLD itself, in which case the
+ * caller should wait for RATCHET_YIELD_SIGNAL and reap the child. */
+int ratchet_watch_child (lua_State *L, pid_t pid);
+
+/* A FIFO of values, usually waiting threads, stored at integer keys of the
+ * table at the given index. Pushing takes the value from the top of the
+ * stack and returns its position, popping pushes the value at the head.
+ * ratchet_waitq_remove() takes the value back out of the given position if
+ * it is still there, comparing it with and popping the value on top of the
+ * stack, and returns 1 if it was. A thread should call it with its position
+ * when it resumes, so it leaves the queue if something other than the queue
+ * woke it. ratchet_waitq_wake() wakes the first thread the kernel can still
+ * wake, skipping any that were killed, and returns 0 once the queue is
+ * exhausted. size counts the values not yet popped or removed. */
+struct ratchet_waitq
+{
+	int head;
+	int tail;
+	int size;
+};
+
+#define ratchet_waitq_empty(q) ((q)->head == (q)->tail)
+#define ratchet_waitq_size(q) ((q)->size)
+int ratchet_waitq_push (lua_State *L, struct ratchet_waitq *q, int table);
+void ratchet_waitq_pop (lua_State *L, struct ratchet_waitq *q, int table);
+int ratchet_waitq_remove (lua_State *L, struct ratchet_waitq *q, int table, int pos);
+int ratchet_waitq_wake (lua_State *L, struct ratchet_waitq *q, int table, int nargs);
+
+/* Objects whose userdata begins with this struct, and whose metatable was
+ * given to ratchet_io_register(), have their file descriptor and timeout read
+ * directly by the kernel instead of through their get_fd() and get_timeout()
+ * methods. A negative timeout means none. ratchet_get_fd() works on either
+ * kind of object. */
+struct ratchet_io
+{
+	int fd;
+	double timeout;
+};
+
+void ratchet_io_register (lua_State *L, int index);
+struct ratchet_io *ratchet_io_test (lua_State *L, int index);
+int ratchet_get_fd (lua_State *L, int index);
+
+/* A file descriptor registered with the kernel once, edge-triggered, for as
+ * long as the watch is attached. ready caches the RATCHET_WATCH_* directions
+ * seen since they were last cleared. An object clears a direction when its
+ * operation fails with EAGAIN, then yields RATCHET_YIELD_READ or
+ * RATCHET_YIELD_WRITE with the watch as a light userdata and a timeout.
+ * Any number of threads may block in each direction, waiting lists them in
+ * the kernel's private thread state. An edge, or detaching the watch, wakes
+ * all of them to retry. */
+#define RATCHET_WATCH_READ 1
+#define RATCHET_WATCH_WRITE 2
+
+struct thread_state;
+
+struct ratchet_watch
+{
+	int fd;
+	int ready;
+	struct event *ev;
+	struct thread_state *waiting[2];
+	struct ratchet_watch *next;
+	struct ratchet_watch **pprev;
+};
+
+struct ratchet_watch *ratchet_watch_new (lua_State *L, int fd);
+void ratchet_watch_detach (struct ratchet_watch *watch);
+
+/* An operation a kernel created with io_uring completes itself, instead of
+ * waiting for readiness, given after the object when yielding
+ * RATCHET_YIELD_READ or RATCHET_YIELD_WRITE. Other kernels ignore it and
+ * resume the thread with true, or false on timeout, as usual. Otherwise the
+ * thread resumes with the integer result of the operation, a negative errno
+ * on failure, or false on timeout. Receives are given a buffer of len bytes
+ * by the kernel, accepts fill in addr. A timed out operation is cancelled
+ * and the thread only resumes with false if that stopped it; if it completed
+ * anyway the thread gets its result. An operation stays busy until the kernel
+ * sees it complete, even if the thread stopped waiting on it, and yielding it
+ * again meanwhile waits for that completion instead of submitting another. A
+ * receive or accept that completes with no thread waiting sets completed and
+ * keeps result, the bytes in buf from start or the accepted socket, for the
+ * object to hand out before reading again. */
+#define RATCHET_URING_RECV 1
+#define RATCHET_URING_SEND 2
+#define RATCHET_URING_ACCEPT 3
+#define RATCHET_URING_POLL 4
+
+struct ratchet_uring_op
+{
+	int type;
+	int fd;
+	void *buf;
+	size_t len;
+	unsigned events;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	int busy;
+	int timed_out;
+	int completed;
+	int result;
+	size_t start;
+	lua_State *L1;
+	void *ring;
+};
+
+struct ratchet_uring_op *ratchet_uring_op_new (lua_State *L);
+
+/* The ratchet.buffer object, a growable byte buffer that objects read into
+ * without creating Lua strings. ratchet_buffer_prep() makes room for len more
+ * bytes and returns where they go, raising an error if it cannot, then
+ * ratchet_buffer_add() appends as many as were actually written. Data
+ * consumed from the front is only reclaimed when the room is needed. */
+struct ratchet_buffer
+{
+	char *data;
+	size_t start;
+	size_t len;
+	size_t size;
+};
+
+#define ratchet_buffer_add(buf, n) ((buf)->len += (n))
+struct ratchet_buffer *ratchet_buffer_check (lua_State *L, int index);
+char *ratchet_buffer_prep (lua_State *L, struct ratchet_buffer *buf, size_t len);
+
+/* A job for ratchet.thread.offload(), which may be given the job name or
+ * the registered job as a light userdata. prepare() copies what the job needs
+ * from the arguments starting at index into memory from malloc(), run() is
+ * called on a pool thread and must not use any lua_State, and finish()
+ * pushes the results. The data is freed once finish() returns or raises an
+ * error. */
+struct ratchet_offload_job
+{
+	const char *name;
+	void *(*prepare) (lua_State *L, int index);
+	void (*run) (void *data);
+	int (*finish) (lua_State *L, void *data);
+};
+
+void ratchet_offload_register (lua_State *L, const struct ratchet_offload_job *job);
+
 #endif
 // vim:fdm=marker:ai:ts=4:sw=4:noet:
@@ -0,0 +1,194 @@
+/* Copyright (c) 2010 Ian C. Good
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include <string.h>
+
+#include "ratchet.h"
+#include "misc.h"
+
+#define get_ratelimit(L, i) ((struct ratelimit *) luaL_checkudata (L, i, "ratchet_ratelimit_meta"))
+
+/* {{{ struct ratelimit */
+/* A token bucket kept as the time its next token is due, the generic cell
+ * rate algorithm. Each acquire() reserves its tokens immediately and sleeps
+ * until they are due, so callers are served in order with no wait queue and
+ * no timer polling. */
+struct ratelimit
+{
+	double interval;
+	double burst;
+	double due;
+};
+/* }}} */
+
+/* {{{ check_wait() */
+/* Returns how long the caller would wait for n tokens, setting due to the
+ * time the next token is due after them. */
+static double check_wait (struct ratelimit *rl, int n, double *due)
+{
+	double now = monotonic_time ();
+	*due = (rl->due > now ? rl->due : now) + n * rl->interval;
+	double wait = *due - now - rl->burst * rl->interval;
+
+	return (wait > 0.0 ? wait : 0.0);
+}
+/* }}} */
+
+/* ---- Namespace Functions ------------------------------------------------- */
+
+/* {{{ rrl_new() */
+static int rrl_new (lua_State *L)
+{
+	double rate = luaL_checknumber (L, 1);
+	luaL_argcheck (L, rate > 0.0, 1, "rate must be positive");
+	int burst = luaL_optint (L, 2, 1);
+	luaL_argcheck (L, burst >= 1, 2, "burst must be at least 1");
+
+	struct ratelimit *rl = (struct ratelimit *) lua_newuserdata (L, sizeof (struct ratelimit));
+	memset (rl, 0, sizeof (struct ratelimit));
+	rl->interval = 1.0 / rate;
+	rl->burst = (double) burst;
+
+	luaL_getmetatable (L, "ratchet_ratelimit_meta");
+	lua_setmetatable (L, -2);
+
+	return 1;
+}
+/* }}} */
+
+/* {{{ rrl_call() */
+static int rrl_call (lua_State *L)
+{
+	lua_remove (L, 1);
+	return rrl_new (L);
+}
+/* }}} */
+
+/* ---- Member Functions ---------------------------------------------------- */
+
+/* {{{ rrl_acquire() */
+static int rrl_acquire (lua_State *L)
+{
+	struct ratelimit *rl = get_ratelimit (L, 1);
+	int ctx = 0;
+	if (LUA_YIELD == lua_getctx (L, &ctx))
+		return 0;
+
+	int n = luaL_optint (L, 2, 1);
+	luaL_argcheck (L, n >= 1 && n <= rl->burst, 2, "must be between 1 and the burst size");
+
+	double due;
+	double wait = check_wait (rl, n, &due);
+	rl->due = due;
+	if (wait <= 0.0)
+		return 0;
+
+	/* Sleep on the kernel's timer until the reserved tokens are due. */
+	lua_settop (L, 1);
+	lua_pushlightuserdata (L, RATCHET_YIELD_TIMEOUT);
+	lua_pushnumber (L, wait);
+	return lua_yieldk (L, 2, 1, rrl_acquire);
+}
+/* }}} */
+
+/* {{{ rrl_try_acquire() */
+static int rrl_try_acquire (lua_State *L)
+{
+	struct ratelimit *rl = get_ratelimit (L, 1);
+	int n = luaL_optint (L, 2, 1);
+	luaL_argcheck (L, n >= 1 && n <= rl->burst, 2, "must be between 1 and the burst size");
+
+	double due;
+	if (check_wait (rl, n, &due) > 0.0)
+	{
+		lua_pushboolean (L, 0);
+		return 1;
+	}
+
+	rl->due = due;
+	lua_pushboolean (L, 1);
+	return 1;
+}
+/* }}} */
+
+/* {{{ rrl_get_wait() */
+static int rrl_get_wait (lua_State *L)
+{
+	struct ratelimit *rl = get_ratelimit (L, 1);
+	int n = luaL_optint (L, 2, 1);
+
+	double due;
+	lua_pushnumber (L, check_wait (rl, n, &due));
+	return 1;
+}
+/* }}} */
+
+/* ---- Public Functions ---------------------------------------------------- */
+
+/* {{{ luaopen_ratchet_ratelimit() */
+int luaopen_ratchet_ratelimit (lua_State *L)
+{
+	/* Static functions in the ratchet.ratelimit namespace. */
+	const luaL_Reg funcs[] = {
+		{"new", rrl_new},
+		{NULL}
+	};
+
+	/* Methods in the ratchet.ratelimit class. */
+	const luaL_Reg meths[] = {
+		/* Documented methods. */
+		{"acquire", rrl_acquire},
+		{"try_acquire", rrl_try_acquire},
+		{"get_wait", rrl_get_wait},
+		/* Undocumented, helper methods. */
+		{NULL}
+	};
+
+	/* Set up the ratchet.ratelimit namespace functions. */
+	luaL_newlib (L, funcs);
+	lua_pushvalue (L, -1);
+	lua_setfield (L, LUA_REGISTRYINDEX, "ratchet_ratelimit_class");
+
+	/* Allow ratchet.ratelimit(rate, burst) as a shortcut for new(). */
+	lua_createtable (L, 0, 1);
+	lua_pushcfunction (L, rrl_call);
+	lua_setfield (L, -2, "__call");
+	lua_setmetatable (L, -2);
+
+	/* Set up the ratchet.ratelimit class and metatables. */
+	luaL_newmetatable (L, "ratchet_ratelimit_meta");
+	lua_newtable (L);
+	luaL_setfuncs (L, meths, 0);
+	lua_setfield (L, -2, "__index");
+	lua_pop (L, 1);
+
+	return 1;
+}
+/* }}} */
+
+// vim:fdm=marker:ai:ts=4:sw=4:noet:
@@ -0,0 +1,505 @@
+/* Copyright (c) 2010 Ian C. Good
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <string.h>
+#include <errno.h>
+#include <event2/event.h>
+
+#include "ratchet.h"
+
+#ifndef RATCHET_RELAY_BUFFER
+#define RATCHET_RELAY_BUFFER 16384
+#endif
+
+#ifndef RATCHET_RELAY_PIPE_SIZE
+#define RATCHET_RELAY_PIPE_SIZE 65536
+#endif
+
+#ifndef RATCHET_RELAY_ROUNDS
+#define RATCHET_RELAY_ROUNDS 16
+#endif
+
+int rsock_relay (lua_State *L);
+int rsock_relay_gc (lua_State *L);
+
+struct relay;
+
+/* {{{ struct relay_dir */
+/* One direction of a relay. Data read from src waits in the pipe, or in buf
+ * from start, until it is written to dst. Only one of read_ev and write_ev
+ * is armed at a time, and neither once the direction is done. */
+struct relay_dir
+{
+	struct relay *relay;
+	int src;
+	int dst;
+	int pipe[2];
+	char *buf;
+	size_t start;
+	size_t pending;
+	size_t total;
+	int eof;
+	int done;
+	struct event *read_ev;
+	struct event *write_ev;
+};
+/* }}} */
+
+/* {{{ struct relay */
+/* A relay between two objects, pumped from libevent callbacks without
+ * resuming the waiting thread. L is a helper thread holding the ratchet
+ * object at index 1 and the relay at index 2, the waiting thread is kept in
+ * the relay's uservalue. error is 0 once both directions reached
+ * end-of-file, otherwise the errno that ended the relay early. Buffers for
+ * both directions follow this struct in the same userdata when splice() is
+ * not used. */
+struct relay
+{
+	struct relay_dir dir[2];
+	struct event_base *base;
+	struct event *timeout_ev;
+	struct timeval timeout;
+	struct timeval last;
+	lua_State *L;
+	int sigpipe;
+	int finished;
+	int error;
+};
+/* }}} */
+
+#if HAVE_SPLICE
+/* Unlike send(), splice() has no MSG_NOSIGNAL. While any relay splices,
+ * SIGPIPE stays blocked, and one raised by a failed write is drained. */
+static int sigpipe_refs = 0;
+static int sigpipe_was_unblocked = 0;
+
+/* {{{ block_sigpipe() */
+static void block_sigpipe (void)
+{
+	if (0 == sigpipe_refs++)
+	{
+		sigset_t one, old;
+		sigemptyset (&one);
+		sigaddset (&one, SIGPIPE);
+		pthread_sigmask (SIG_BLOCK, &one, &old);
+		sigpipe_was_unblocked = !sigismember (&old, SIGPIPE);
+	}
+}
+/* }}} */
+
+/* {{{ unblock_sigpipe() */
+static void unblock_sigpipe (void)
+{
+	if (0 == --sigpipe_refs && sigpipe_was_unblocked)
+	{
+		sigset_t one;
+		sigemptyset (&one);
+		sigaddset (&one, SIGPIPE);
+		pthread_sigmask (SIG_UNBLOCK, &one, NULL);
+	}
+}
+/* }}} */
+
+/* {{{ drain_sigpipe() */
+static void drain_sigpipe (void)
+{
+	sigset_t one;
+	struct timespec zero = {0, 0};
+	sigemptyset (&one);
+	sigaddset (&one, SIGPIPE);
+	while (-1 == sigtimedwait (&one, NULL, &zero) && EINTR == errno);
+}
+/* }}} */
+#endif
+
+/* {{{ relay_stop() */
+static void relay_stop (struct relay *r)
+{
+	int i;
+
+	for (i=0; i<2; i++)
+	{
+		struct relay_dir *d = &r->dir[i];
+		if (d->read_ev)
+			event_free (d->read_ev);
+		if (d->write_ev)
+			event_free (d->write_ev);
+		d->read_ev = d->write_ev = NULL;
+		if (d->pipe[0] >= 0)
+			close (d->pipe[0]);
+		if (d->pipe[1] >= 0)
+			close (d->pipe[1]);
+		d->pipe[0] = d->pipe[1] = -1;
+	}
+
+	if (r->timeout_ev)
+		event_free (r->timeout_ev);
+	r->timeout_ev = NULL;
+
+#if HAVE_SPLICE
+	if (r->sigpipe)
+		unblock_sigpipe ();
+	r->sigpipe = 0;
+#endif
+
+	r->finished = 1;
+}
+/* }}} */
+
+/* {{{ relay_finish() */
+static void relay_finish (struct relay *r, int error)
+{
+	if (r->finished)
+		return;
+	r->error = error;
+	relay_stop (r);
+
+	/* The kernel only wakes the thread if it still manages it, a killed
+	 * thread is left alone. */
+	lua_State *L = r->L;
+	if (!L)
+		return;
+	lua_getuservalue (L, 2);
+	lua_getfield (L, -1, "waiter");
+	if (lua_isthread (L, -1))
+	{
+		lua_pushnil (L);
+		lua_setfield (L, -3, "waiter");
+		ratchet_wake_thread (L, -1, 0);
+	}
+	lua_settop (L, 2);
+}
+/* }}} */
+
+/* {{{ relay_read() */
+static ssize_t relay_read (struct relay_dir *d)
+{
+#if HAVE_SPLICE
+	if (d->pipe[1] >= 0)
+		return splice (d->src, NULL, d->pipe[1], NULL, RATCHET_RELAY_PIPE_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#endif
+
+	d->start = 0;
+	return recv (d->src, d->buf, RATCHET_RELAY_BUFFER, 0);
+}
+/* }}} */
+
+/* {{{ relay_write() */
+static ssize_t relay_write (struct relay_dir *d)
+{
+#if HAVE_SPLICE
+	if (d->pipe[0] >= 0)
+	{
+		ssize_t ret = splice (d->pipe[0], NULL, d->dst, NULL, d->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (-1 == ret && EPIPE == errno)
+		{
+			drain_sigpipe ();
+			errno = EPIPE;
+		}
+		return ret;
+	}
+#endif
+
+	return send (d->dst, d->buf + d->start, d->pending, MSG_NOSIGNAL);
+}
+/* }}} */
+
+/* {{{ relay_pump() */
+/* Moves data until either side would block, then arms the event for it. A
+ * busy direction stops after a number of rounds to let other events run,
+ * and continues from the event loop. */
+static void relay_pump (struct relay_dir *d)
+{
+	struct relay *r = d->relay;
+	ssize_t ret;
+	int rounds;
+
+	for (rounds=0; rounds<RATCHET_RELAY_ROUNDS; rounds++)
+	{
+		if (!d->pending)
+		{
+			if (d->eof)
+			{
+				/* Pass the half-close on, as with socket:shutdown("write"). */
+				shutdown (d->dst, SHUT_WR);
+				d->done = 1;
+				if (r->dir[0].done && r->dir[1].done)
+					relay_finish (r, 0);
+				return;
+			}
+
+			ret = relay_read (d);
+			if (ret < 0)
+			{
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					event_add (d->read_ev, NULL);
+				else
+					relay_finish (r, errno);
+				return;
+			}
+			else if (ret == 0)
+				d->eof = 1;
+			d->pending = (size_t) ret;
+			continue;
+		}
+
+		ret = relay_write (d);
+		if (ret < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				event_add (d->write_ev, NULL);
+			else
+				relay_finish (r, errno);
+			return;
+		}
+		d->start += (size_t) ret;
+		d->pending -= (size_t) ret;
+		d->total += (size_t) ret;
+		event_base_gettimeofday_cached (r->base, &r->last);
+	}
+
+	event_add ((d->pending ? d->write_ev : d->read_ev), NULL);
+}
+/* }}} */
+
+/* {{{ relay_triggered() */
+static void relay_triggered (int fd, short event, void *arg)
+{
+	relay_pump ((struct relay_dir *) arg);
+}
+/* }}} */
+
+/* {{{ relay_timeout_triggered() */
+/* The timeout only limits idle time, so it is pushed back by however long
+ * ago data last moved instead of being re-armed on every write. */
+static void relay_timeout_triggered (int fd, short event, void *arg)
+{
+	struct relay *r = (struct relay *) arg;
+	struct timeval now, idle, left;
+
+	event_base_gettimeofday_cached (r->base, &now);
+	timersub (&now, &r->last, &idle);
+	if (timercmp (&idle, &r->timeout, <))
+	{
+		timersub (&r->timeout, &idle, &left);
+		event_add (r->timeout_ev, &left);
+	}
+	else
+		relay_finish (r, ETIMEDOUT);
+}
+/* }}} */
+
+/* {{{ check_unencrypted() */
+static void check_unencrypted (lua_State *L, int index)
+{
+	lua_getfield (L, index, "get_encryption");
+	if (lua_isfunction (L, -1))
+	{
+		lua_pushvalue (L, index);
+		lua_call (L, 1, 1);
+		if (lua_toboolean (L, -1))
+			ratchet_error_str (L, "ratchet.socket.relay()", "ENOTSUP", "Cannot relay an encrypted socket.");
+	}
+	lua_pop (L, 1);
+}
+/* }}} */
+
+/* {{{ setup_relay() */
+static struct relay *setup_relay (lua_State *L, struct event_base *base)
+{
+	double timeout = 0.0;
+	int i, use_splice = 0;
+
+	if (lua_istable (L, 3))
+	{
+		lua_getfield (L, 3, "timeout");
+		timeout = (double) lua_tonumber (L, -1);
+		lua_pop (L, 1);
+#if HAVE_SPLICE
+		lua_getfield (L, 3, "splice");
+		use_splice = (lua_isnil (L, -1) || lua_toboolean (L, -1));
+		lua_pop (L, 1);
+#endif
+	}
+	else
+	{
+#if HAVE_SPLICE
+		use_splice = 1;
+#endif
+	}
+
+	size_t size = sizeof (struct relay) + (use_splice ? 0 : 2 * RATCHET_RELAY_BUFFER);
+	struct relay *r = (struct relay *) lua_newuserdata (L, size);
+	memset (r, 0, sizeof (struct relay));
+	r->base = base;
+	for (i=0; i<2; i++)
+	{
+		r->dir[i].relay = r;
+		r->dir[i].pipe[0] = r->dir[i].pipe[1] = -1;
+	}
+
+	luaL_getmetatable (L, "ratchet_socket_relay_meta");
+	lua_setmetatable (L, -2);
+
+	r->dir[0].src = r->dir[1].dst = ratchet_get_fd (L, 1);
+	r->dir[1].src = r->dir[0].dst = ratchet_get_fd (L, 2);
+
+	for (i=0; i<2; i++)
+	{
+		struct relay_dir *d = &r->dir[i];
+		if (use_splice)
+		{
+#if HAVE_SPLICE
+			if (pipe2 (d->pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+				ratchet_error_errno (L, "ratchet.socket.relay()", "pipe2");
+#endif
+		}
+		else
+			d->buf = ((char *) (r + 1)) + i * RATCHET_RELAY_BUFFER;
+
+		d->read_ev = event_new (base, d->src, EV_READ, relay_triggered, d);
+		d->write_ev = event_new (base, d->dst, EV_WRITE, relay_triggered, d);
+		event_add (d->read_ev, NULL);
+	}
+
+#if HAVE_SPLICE
+	if (use_splice)
+	{
+		block_sigpipe ();
+		r->sigpipe = 1;
+	}
+#endif
+
+	if (timeout > 0.0)
+	{
+		r->timeout.tv_sec = (time_t) timeout;
+		r->timeout.tv_usec = (suseconds_t) ((timeout - (double) r->timeout.tv_sec) * 1000000.0);
+		event_base_gettimeofday_cached (base, &r->last);
+		r->timeout_ev = evtimer_new (base, relay_timeout_triggered, r);
+		event_add (r->timeout_ev, &r->timeout);
+	}
+
+	return r;
+}
+/* }}} */
+
+/* ---- Namespace Functions ------------------------------------------------- */
+
+/* {{{ rsock_relay() */
+int rsock_relay (lua_State *L)
+{
+	struct relay *r;
+
+	int ctx = 0;
+	lua_getctx (L, &ctx);
+	if (ctx == 0)
+	{
+		lua_settop (L, 3);
+		check_unencrypted (L, 1);
+		check_unencrypted (L, 2);
+
+		lua_pushlightuserdata (L, RATCHET_YIELD_GET);
+		return lua_yieldk (L, 1, 1, rsock_relay);
+	}
+	else if (ctx == 1)
+	{
+		struct event_base *base = ratchet_get_event_base (L, 4);
+		lua_settop (L, 4);
+
+		r = setup_relay (L, base);
+
+		lua_createtable (L, 0, 2);
+		r->L = lua_newthread (L);
+		lua_pushvalue (L, 4);
+		lua_pushvalue (L, 5);
+		lua_xmove (L, r->L, 2);
+		lua_setfield (L, -2, "thread");
+		lua_pushthread (L);
+		lua_setfield (L, -2, "waiter");
+		lua_setuservalue (L, 5);
+		lua_remove (L, 4);
+
+		lua_pushlightuserdata (L, RATCHET_YIELD_PAUSE);
+		return lua_yieldk (L, 1, 2, rsock_relay);
+	}
+
+	r = (struct relay *) lua_touserdata (L, 4);
+	lua_getuservalue (L, 4);
+	lua_pushnil (L);
+	lua_setfield (L, -2, "waiter");
+	lua_settop (L, 4);
+
+	/* Resumed by ratchet.thread.unpause() before the relay ended. */
+	if (!r->finished)
+	{
+		r->error = ECANCELED;
+		relay_stop (r);
+	}
+
+	lua_pushnumber (L, (lua_Number) r->dir[0].total);
+	lua_pushnumber (L, (lua_Number) r->dir[1].total);
+	if (r->error)
+	{
+		ratchet_error_push_code (L, r->error);
+		if (lua_isnil (L, -1))
+		{
+			lua_pop (L, 1);
+			lua_pushfstring (L, "errno %d", r->error);
+		}
+	}
+	else
+		lua_pushliteral (L, "closed");
+
+	return 3;
+}
+/* }}} */
+
+/* ---- Member Functions ---------------------------------------------------- */
+
+/* {{{ rsock_relay_gc() */
+int rsock_relay_gc (lua_State *L)
+{
+	struct relay *r = (struct relay *) lua_touserdata (L, 1);
+	r->L = NULL;
+	relay_stop (r);
+
+	return 0;
+}
+/* }}} */
+
+// vim:fdm=marker:ai:ts=4:sw=4:noet:
@@ -0,0 +1,230 @@
+/* Copyright (c) 2010 Ian C. Good
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include <string.h>
+
+#include "ratchet.h"
+
+#define get_semaphore(L, i) ((struct semaphore *) luaL_checkudata (L, i, "ratchet_semaphore_meta"))
+
+/* {{{ struct semaphore */
+/* Waiting threads are queued in the uservalue table. A release() with
+ * waiters hands its count directly to the first of them. */
+struct semaphore
+{
+	int count;
+	struct ratchet_waitq waiters;
+};
+/* }}} */
+
+/* ---- Namespace Functions ------------------------------------------------- */
+
+/* {{{ rsem_new() */
+static int rsem_new (lua_State *L)
+{
+	int count = luaL_optint (L, 1, 1);
+	luaL_argcheck (L, count >= 0, 1, "count must not be negative");
+
+	struct semaphore *sem = (struct semaphore *) lua_newuserdata (L, sizeof (struct semaphore));
+	memset (sem, 0, sizeof (struct semaphore));
+	sem->count = count;
+
+	luaL_getmetatable (L, "ratchet_semaphore_meta");
+	lua_setmetatable (L, -2);
+
+	lua_newtable (L);
+	lua_setuservalue (L, -2);
+
+	return 1;
+}
+/* }}} */
+
+/* {{{ rsem_call() */
+static int rsem_call (lua_State *L)
+{
+	lua_remove (L, 1);
+	return rsem_new (L);
+}
+/* }}} */
+
+/* ---- Member Functions ---------------------------------------------------- */
+
+/* {{{ rsem_acquire() */
+static int rsem_acquire (lua_State *L)
+{
+	struct semaphore *sem = get_semaphore (L, 1);
+	int ctx = 0;
+	if (LUA_YIELD == lua_getctx (L, &ctx))
+	{
+		/* release() takes the thread off the queue as it hands over the
+		 * count, if it is still queued something else woke it. */
+		int pos = lua_tointeger (L, 2);
+		lua_settop (L, 1);
+		lua_getuservalue (L, 1);
+		lua_pushthread (L);
+		if (ratchet_waitq_remove (L, &sem->waiters, 2, pos))
+			return ratchet_error_str (L, "ratchet.semaphore.acquire()", "ECANCELED", "Woken while waiting to acquire.");
+		return 0;
+	}
+
+	if (sem->count > 0 && ratchet_waitq_empty (&sem->waiters))
+	{
+		sem->count--;
+		return 0;
+	}
+
+	/* Wait in line for a release(). */
+	lua_settop (L, 1);
+	lua_getuservalue (L, 1);
+	lua_pushthread (L);
+	int pos = ratchet_waitq_push (L, &sem->waiters, 2);
+	lua_settop (L, 1);
+	lua_pushinteger (L, pos);
+
+	lua_pushlightuserdata (L, RATCHET_YIELD_PAUSE);
+	return lua_yieldk (L, 1, 1, rsem_acquire);
+}
+/* }}} */
+
+/* {{{ rsem_try_acquire() */
+static int rsem_try_acquire (lua_State *L)
+{
+	struct semaphore *sem = get_semaphore (L, 1);
+
+	if (sem->count > 0 && ratchet_waitq_empty (&sem->waiters))
+	{
+		sem->count--;
+		lua_pushboolean (L, 1);
+	}
+	else
+		lua_pushboolean (L, 0);
+
+	return 1;
+}
+/* }}} */
+
+/* {{{ rsem_release() */
+static int rsem_release (lua_State *L)
+{
+	struct semaphore *sem = get_semaphore (L, 1);
+	int n = luaL_optint (L, 2, 1);
+	luaL_argcheck (L, n >= 0, 2, "count must not be negative");
+	int ctx = 0;
+	lua_getctx (L, &ctx);
+
+	if (ctx == 0)
+	{
+		if (ratchet_waitq_empty (&sem->waiters))
+		{
+			sem->count += n;
+			return 0;
+		}
+
+		/* Waking threads needs the ratchet object. */
+		lua_settop (L, 2);
+		lua_pushlightuserdata (L, RATCHET_YIELD_GET);
+		return lua_yieldk (L, 1, 1, rsem_release);
+	}
+
+	lua_insert (L, 1);
+	lua_getuservalue (L, 2);
+	for (; n > 0; n--)
+	{
+		if (!ratchet_waitq_wake (L, &sem->waiters, 4, 0))
+			break;
+	}
+	sem->count += n;
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ rsem_get_count() */
+static int rsem_get_count (lua_State *L)
+{
+	struct semaphore *sem = get_semaphore (L, 1);
+	lua_pushinteger (L, sem->count);
+	return 1;
+}
+/* }}} */
+
+/* {{{ rsem_get_num_waiting() */
+static int rsem_get_num_waiting (lua_State *L)
+{
+	struct semaphore *sem = get_semaphore (L, 1);
+	lua_pushinteger (L, ratchet_waitq_size (&sem->waiters));
+	return 1;
+}
+/* }}} */
+
+/* ---- Public Functions ---------------------------------------------------- */
+
+/* {{{ luaopen_ratchet_semaphore() */
+int luaopen_ratchet_semaphore (lua_State *L)
+{
+	/* Static functions in the ratchet.semaphore namespace. */
+	const luaL_Reg funcs[] = {
+		{"new", rsem_new},
+		{NULL}
+	};
+
+	/* Methods in the ratchet.semaphore class. */
+	const luaL_Reg meths[] = {
+		/* Documented methods. */
+		{"acquire", rsem_acquire},
+		{"try_acquire", rsem_try_acquire},
+		{"release", rsem_release},
+		{"get_count", rsem_get_count},
+		{"get_num_waiting", rsem_get_num_waiting},
+		/* Undocumented, helper methods. */
+		{NULL}
+	};
+
+	/* Set up the ratchet.semaphore namespace functions. */
+	luaL_newlib (L, funcs);
+	lua_pushvalue (L, -1);
+	lua_setfield (L, LUA_REGISTRYINDEX, "ratchet_semaphore_class");
+
+	/* Allow ratchet.semaphore(count) as a shortcut for new(). */
+	lua_createtable (L, 0, 1);
+	lua_pushcfunction (L, rsem_call);
+	lua_setfield (L, -2, "__call");
+	lua_setmetatable (L, -2);
+
+	/* Set up the ratchet.semaphore class and metatables. */
+	luaL_newmetatable (L, "ratchet_semaphore_meta");
+	lua_newtable (L);
+	luaL_setfuncs (L, meths, 0);
+	lua_setfield (L, -2, "__index");
+	lua_pop (L, 1);
+
+	return 1;
+}
+/* }}} */
+
+// vim:fdm=marker:ai:ts=4:sw=4:noet:
@@ -19,6 +19,8 @@
  * THE SOFTWARE.
  */
 
+#define _GNU_SOURCE
+
 #include "config.h"
 
 #include <lua.h>
@@ -29,12 +31,18 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <arpa/inet.h>
 #include <math.h>
 #include <netdb.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#if HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 
 #include "ratchet.h"
 #include "misc.h"
@@ -47,7 +55,52 @@
 #define DEFAULT_TCPUDP_PORT 80
 #endif
 
+#ifndef RATCHET_SENDV_IOV
+#define RATCHET_SENDV_IOV 64
+#endif
+
+#ifndef RATCHET_ACCEPT_MANY
+#define RATCHET_ACCEPT_MANY 64
+#endif
+
+#ifndef RATCHET_SENDFILE_CHUNK
+#define RATCHET_SENDFILE_CHUNK 1048576
+#endif
+
+#ifndef RATCHET_SPLICE_PIPE_SIZE
+#define RATCHET_SPLICE_PIPE_SIZE 65536
+#endif
+
 #define socket_fd(L, i) (*((int *) luaL_checkudata (L, i, "ratchet_socket_meta")))
+#define socket_io(L, i) ((struct ratchet_io *) luaL_checkudata (L, i, "ratchet_socket_meta"))
+#define socket_watch(L, i) (((struct rsock_socket *) lua_touserdata (L, i))->watch)
+
+/* {{{ struct rsock_socket */
+/* The ratchet_io header must come first, other modules read the file
+ * descriptor as an int. */
+struct rsock_socket
+{
+	struct ratchet_io io;
+	struct ratchet_watch *watch;
+};
+/* }}} */
+
+/* {{{ struct rsock_transfer */
+/* Progress of a sendfile() or splice() across waits, kept on the stack of
+ * the calling thread. Descriptors it opened itself are owned and closed when
+ * it is collected, even if the thread was killed while waiting. */
+struct rsock_transfer
+{
+	int in;
+	int owned[2];
+	off_t offset;
+	int limited;
+	size_t remaining;
+	size_t pending;
+	size_t total;
+	int eof;
+};
+/* }}} */
 
 #if HAVE_OPENSSL
 int rsock_get_encryption (lua_State *L);
@@ -57,6 +110,9 @@ int rsock_encrypt (lua_State *L);
 int rsockopt_get (lua_State *L);
 int rsockopt_set (lua_State *L);
 
+int rsock_relay (lua_State *L);
+int rsock_relay_gc (lua_State *L);
+
 /* {{{ push_inet_ntop() */
 static int push_inet_ntop (lua_State *L, struct sockaddr *addr)
 {
@@ -109,6 +165,238 @@ static int call_tracer (lua_State *L, int index, const char *type, int args)
 }
 /* }}} */
 
+/* {{{ push_socket() */
+/* Pushes a new socket object for a descriptor that is already non-blocking
+ * and close-on-exec. */
+static struct rsock_socket *push_socket (lua_State *L, int fd)
+{
+	struct rsock_socket *sock = (struct rsock_socket *) lua_newuserdata (L, sizeof (struct rsock_socket));
+	sock->watch = NULL;
+	sock->io.timeout = -1.0;
+	sock->io.fd = fd;
+
+	luaL_getmetatable (L, "ratchet_socket_meta");
+	lua_setmetatable (L, -2);
+
+	lua_newtable (L);
+	lua_setuservalue (L, -2);
+
+	return sock;
+}
+/* }}} */
+
+/* {{{ push_sockaddr() */
+static struct sockaddr *push_sockaddr (lua_State *L, struct sockaddr_storage *from)
+{
+	struct sockaddr *addr = (struct sockaddr *) lua_newuserdata (L, sizeof (struct sockaddr_storage));
+	if (from)
+		memcpy (addr, from, sizeof (struct sockaddr_storage));
+	luaL_getmetatable (L, "ratchet_socket_sockaddr_meta");
+	lua_setmetatable (L, -2);
+
+	return addr;
+}
+/* }}} */
+
+/* {{{ accept_client() */
+/* Accepts a connection as a non-blocking, close-on-exec descriptor, or
+ * returns -1 with errno set. */
+static int accept_client (int sockfd, struct sockaddr *addr, socklen_t *addr_len)
+{
+#if HAVE_ACCEPT4
+	return accept4 (sockfd, addr, addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+	int fd = accept (sockfd, addr, addr_len);
+	if (fd >= 0 && (set_nonblocking (fd) < 0 || set_closeonexec (fd) < 0))
+	{
+		int orig_errno = errno;
+		close (fd);
+		errno = orig_errno;
+		return -1;
+	}
+	return fd;
+#endif
+}
+/* }}} */
+
+/* {{{ socket_blocked() */
+/* A persistent registration that last saw EAGAIN, and no edge since, would
+ * only fail again, so the operation waits without trying the syscall. */
+static int socket_blocked (lua_State *L, int flag)
+{
+	struct ratchet_watch *watch = socket_watch (L, 1);
+	return (watch && watch->ev && !(watch->ready & flag));
+}
+/* }}} */
+
+#if HAVE_LIBURING
+/* {{{ push_uring_op() */
+/* Pushes the socket's io_uring operation of the given type, filled in from
+ * the method argument at index 2. One is kept for each direction and reused.
+ * An abandoned receive or accept the kernel still holds is pushed as it is,
+ * to be waited on again, other busy operations are replaced. */
+static struct ratchet_uring_op *push_uring_op (lua_State *L, int type)
+{
+	const char *field = (RATCHET_URING_SEND == type || RATCHET_URING_POLL == type) ? "uring_write" : "uring_read";
+
+	lua_getuservalue (L, 1);
+	lua_getfield (L, -1, field);
+	struct ratchet_uring_op *op = (struct ratchet_uring_op *) lua_touserdata (L, -1);
+	if (op && op->busy && !op->L1 && op->type == type && (RATCHET_URING_RECV == type || RATCHET_URING_ACCEPT == type))
+	{
+		lua_remove (L, -2);
+		return op;
+	}
+	else if (!op || op->busy)
+	{
+		lua_pop (L, 1);
+		op = ratchet_uring_op_new (L);
+		lua_pushvalue (L, -1);
+		lua_setfield (L, -3, field);
+	}
+	lua_remove (L, -2);
+
+	op->type = type;
+	op->fd = socket_fd (L, 1);
+	if (RATCHET_URING_RECV == type)
+		op->len = (size_t) luaL_optunsigned (L, 2, (lua_Unsigned) LUAL_BUFFERSIZE);
+	else if (RATCHET_URING_SEND == type)
+	{
+		/* The string stays referenced by the operation while it is sent. */
+		op->buf = (void *) lua_tolstring (L, 2, &op->len);
+		lua_getuservalue (L, -1);
+		lua_pushvalue (L, 2);
+		lua_setfield (L, -2, "data");
+		lua_pop (L, 1);
+	}
+	else if (RATCHET_URING_POLL == type)
+		op->events = POLLOUT;
+
+	return op;
+}
+/* }}} */
+
+/* {{{ get_abandoned_uring_op() */
+/* Returns the socket's read operation of the given type if a wait on it was
+ * abandoned. Until it completes the socket must not be read past it, after
+ * that its result is handed out before reading again, see ratchet.h. */
+static struct ratchet_uring_op *get_abandoned_uring_op (lua_State *L, int type)
+{
+	lua_getuservalue (L, 1);
+	lua_getfield (L, -1, "uring_read");
+	struct ratchet_uring_op *op = (struct ratchet_uring_op *) lua_touserdata (L, -1);
+	lua_pop (L, 2);
+
+	if (op && op->type == type && (op->completed || (op->busy && !op->L1)))
+		return op;
+	return NULL;
+}
+/* }}} */
+
+/* {{{ take_uring_bytes() */
+/* Hands out up to len of the bytes a receive left in its buffer, keeping the
+ * rest for the next receive. */
+static const char *take_uring_bytes (struct ratchet_uring_op *op, size_t *len)
+{
+	const char *data = (const char *) op->buf + op->start;
+	size_t avail = (size_t) op->result - op->start;
+	if (*len > avail)
+		*len = avail;
+	op->start += *len;
+	op->completed = (op->start < (size_t) op->result);
+
+	return data;
+}
+/* }}} */
+#endif
+
+/* {{{ get_wait_result() */
+/* After a wait, returns -1 if it timed out, 1 if the kernel completed the
+ * io_uring operation at index 3 and left its result in res, or 0 if the
+ * syscall should be tried again. */
+static int get_wait_result (lua_State *L, int ctx, ssize_t *res)
+{
+	int i = (2 == ctx ? 4 : 3);
+	if (0 == ctx)
+		return 0;
+
+	if (LUA_TNUMBER == lua_type (L, i))
+	{
+		*res = (ssize_t) lua_tointeger (L, i);
+		return (-EAGAIN == *res ? 0 : 1);
+	}
+
+	return (lua_toboolean (L, i) ? 0 : -1);
+}
+/* }}} */
+
+/* {{{ yield_socket() */
+/* Stack must only hold the socket and the method argument. When an io_uring
+ * operation type is given it is yielded after the socket, and kept at index
+ * 3 for the continuation, see get_wait_result(). */
+static int yield_socket (lua_State *L, void *yield_type, int flag, int op_type, lua_CFunction k)
+{
+	struct ratchet_watch *watch = socket_watch (L, 1);
+
+	lua_pushlightuserdata (L, yield_type);
+	if (watch)
+	{
+		watch->ready &= ~flag;
+		lua_pushlightuserdata (L, watch);
+		lua_pushnumber (L, (lua_Number) socket_io (L, 1)->timeout);
+		return lua_yieldk (L, 3, 1, k);
+	}
+
+#if HAVE_LIBURING
+	if (op_type)
+	{
+		push_uring_op (L, op_type);
+		lua_insert (L, 3);
+		lua_pushvalue (L, 1);
+		lua_pushvalue (L, 3);
+		return lua_yieldk (L, 3, 2, k);
+	}
+#endif
+
+	lua_pushvalue (L, 1);
+	return lua_yieldk (L, 2, 1, k);
+}
+/* }}} */
+
+/* {{{ push_transfer() */
+static struct rsock_transfer *push_transfer (lua_State *L, int length)
+{
+	struct rsock_transfer *t = (struct rsock_transfer *) lua_newuserdata (L, sizeof (struct rsock_transfer));
+	memset (t, 0, sizeof (struct rsock_transfer));
+	t->in = t->owned[0] = t->owned[1] = -1;
+	t->limited = !lua_isnoneornil (L, length);
+	t->remaining = (size_t) luaL_optunsigned (L, length, 0);
+
+	luaL_getmetatable (L, "ratchet_socket_transfer_meta");
+	lua_setmetatable (L, -2);
+
+	return t;
+}
+/* }}} */
+
+/* {{{ transfer_close() */
+static void transfer_close (struct rsock_transfer *t)
+{
+	if (t->owned[0] >= 0)
+		close (t->owned[0]);
+	if (t->owned[1] >= 0)
+		close (t->owned[1]);
+	t->owned[0] = t->owned[1] = -1;
+}
+/* }}} */
+
+/* {{{ transfer_count() */
+static size_t transfer_count (struct rsock_transfer *t, size_t max)
+{
+	return ((t->limited && t->remaining < max) ? t->remaining : max);
+}
+/* }}} */
+
 /* {{{ push_query_types_table() */
 static void push_query_types_table (lua_State *L, int index)
 {
@@ -341,7 +629,10 @@ static int rsock_new (lua_State *L)
 	extra_flags |= SOCK_CLOEXEC;
 #endif
 
-	int *fd = (int *) lua_newuserdata (L, sizeof (int));
+	struct rsock_socket *sock = (struct rsock_socket *) lua_newuserdata (L, sizeof (struct rsock_socket));
+	sock->watch = NULL;
+	sock->io.timeout = -1.0;
+	int *fd = &sock->io.fd;
 	*fd = socket (family, socktype | extra_flags, protocol);
 	if (*fd < 0)
 		return ratchet_error_errno (L, "ratchet.socket.new()", "socket");
@@ -358,9 +649,7 @@ static int rsock_new (lua_State *L)
 	luaL_getmetatable (L, "ratchet_socket_meta");
 	lua_setmetatable (L, -2);
 
-	lua_createtable (L, 0, 1);
-	lua_pushnumber (L, (lua_Number) -1.0);
-	lua_setfield (L, -2, "timeout");
+	lua_newtable (L);
 	lua_setuservalue (L, -2);
 
 	return 1;
@@ -374,8 +663,11 @@ static int rsock_new_pair (lua_State *L)
 	int socktype = luaL_optint (L, 2, SOCK_STREAM);
 	int protocol = luaL_optint (L, 3, 0);
 
-	int *fd1 = (int *) lua_newuserdata (L, sizeof (int));
-	int *fd2 = (int *) lua_newuserdata (L, sizeof (int));
+	struct rsock_socket *sock1 = (struct rsock_socket *) lua_newuserdata (L, sizeof (struct rsock_socket));
+	struct rsock_socket *sock2 = (struct rsock_socket *) lua_newuserdata (L, sizeof (struct rsock_socket));
+	sock1->watch = sock2->watch = NULL;
+	sock1->io.timeout = sock2->io.timeout = -1.0;
+	int *fd1 = &sock1->io.fd, *fd2 = &sock2->io.fd;
 
 	int extra_flags = 0;
 #ifdef SOCK_NONBLOCK
@@ -411,14 +703,10 @@ static int rsock_new_pair (lua_State *L)
 	luaL_getmetatable (L, "ratchet_socket_meta");
 	lua_setmetatable (L, -3);
 
-	lua_createtable (L, 0, 1);
-	lua_pushnumber (L, (lua_Number) -1.0);
-	lua_setfield (L, -2, "timeout");
+	lua_newtable (L);
 	lua_setuservalue (L, -2);
 
-	lua_createtable (L, 0, 1);
-	lua_pushnumber (L, (lua_Number) -1.0);
-	lua_setfield (L, -2, "timeout");
+	lua_newtable (L);
 	lua_setuservalue (L, -3);
 
 	return 2;
@@ -428,24 +716,16 @@ static int rsock_new_pair (lua_State *L)
 /* {{{ rsock_from_fd() */
 static int rsock_from_fd (lua_State *L)
 {
-	int *fd = (int *) lua_newuserdata (L, sizeof (int));
-	*fd = luaL_checkint (L, 1);
-	if (*fd < 0)
+	int fd = luaL_checkint (L, 1);
+	if (fd < 0)
 		return ratchet_error_str (L, "ratchet.socket.from_fd()", "EBADF", "Invalid file descriptor.");
 
-	if (set_nonblocking (*fd) < 0)
+	if (set_nonblocking (fd) < 0)
 		return ratchet_error_errno (L, "ratchet.socket.from_fd()", "fcntl");
-	if (set_closeonexec (*fd) < 0)
+	if (set_closeonexec (fd) < 0)
 		return ratchet_error_errno (L, "ratchet.socket.from_fd()", "fcntl");
 
-	luaL_getmetatable (L, "ratchet_socket_meta");
-	lua_setmetatable (L, -2);
-
-	lua_createtable (L, 0, 1);
-	lua_pushnumber (L, (lua_Number) -1.0);
-	lua_setfield (L, -2, "timeout");
-	lua_setuservalue (L, -2);
-
+	push_socket (L, fd);
 	return 1;
 }
 /* }}} */
@@ -691,8 +971,91 @@ static int rsock_multi_recv (lua_State *L)
 }
 /* }}} */
 
+#if HAVE_SPLICE
+/* {{{ rsock_splice() */
+static int rsock_splice (lua_State *L)
+{
+	int src = ratchet_get_fd (L, 1);
+	int dst = ratchet_get_fd (L, 2);
+	struct rsock_transfer *t;
+	ssize_t ret;
+
+	int ctx = 0;
+	lua_getctx (L, &ctx);
+	if (ctx == 1 && !lua_toboolean (L, 5))
+		return ratchet_error_str (L, "ratchet.socket.splice()", "ETIMEDOUT", "Timed out on splice.");
+	else if (ctx == 0)
+	{
+		lua_settop (L, 3);
+		t = push_transfer (L, 3);
+		if (pipe2 (t->owned, O_NONBLOCK | O_CLOEXEC) < 0)
+			return ratchet_error_errno (L, "ratchet.socket.splice()", "pipe2");
+	}
+	lua_settop (L, 4);
+	t = (struct rsock_transfer *) lua_touserdata (L, 4);
+
+	/* Data is moved through the pipe one pipeful at a time, and the pipe is
+	 * emptied into dst before src is read again. */
+	while (1)
+	{
+		if (!t->pending)
+		{
+			if (t->eof || (t->limited && !t->remaining))
+				break;
+
+			ret = splice (src, NULL, t->owned[1], NULL, transfer_count (t, RATCHET_SPLICE_PIPE_SIZE), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (ret == -1)
+			{
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+				{
+					lua_pushlightuserdata (L, RATCHET_YIELD_READ);
+					lua_pushvalue (L, 1);
+					return lua_yieldk (L, 2, 1, rsock_splice);
+				}
+				else
+					return ratchet_error_errno (L, "ratchet.socket.splice()", "splice");
+			}
+			else if (ret == 0)
+				t->eof = 1;
+			t->pending += (size_t) ret;
+			if (t->limited)
+				t->remaining -= (size_t) ret;
+			continue;
+		}
+
+		ret = splice (t->owned[0], NULL, dst, NULL, t->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (ret == -1)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				lua_pushlightuserdata (L, RATCHET_YIELD_WRITE);
+				lua_pushvalue (L, 2);
+				return lua_yieldk (L, 2, 1, rsock_splice);
+			}
+			else
+				return ratchet_error_errno (L, "ratchet.socket.splice()", "splice");
+		}
+		t->pending -= (size_t) ret;
+		t->total += (size_t) ret;
+	}
+
+	transfer_close (t);
+	lua_pushnumber (L, (lua_Number) t->total);
+	return 1;
+}
+/* }}} */
+#endif
+
 /* ---- Member Functions ---------------------------------------------------- */
 
+/* {{{ rsock_transfer_gc() */
+static int rsock_transfer_gc (lua_State *L)
+{
+	transfer_close ((struct rsock_transfer *) lua_touserdata (L, 1));
+	return 0;
+}
+/* }}} */
+
 /* {{{ rsock_sockaddr_tostring() */
 static int rsock_sockaddr_tostring (lua_State *L)
 {
@@ -706,6 +1069,8 @@ static int rsock_sockaddr_tostring (lua_State *L)
 static int rsock_gc (lua_State *L)
 {
 	int *fd = &socket_fd (L, 1);
+	if (socket_watch (L, 1))
+		ratchet_watch_detach (socket_watch (L, 1));
 	if (*fd >= 0)
 		close (*fd);
 	*fd = -1;
@@ -737,10 +1102,7 @@ static int rsock_get_fd (lua_State *L)
 /* {{{ rsock_get_timeout() */
 static int rsock_get_timeout (lua_State *L)
 {
-	(void) socket_fd (L, 1);
-
-	lua_getuservalue (L, 1);
-	lua_getfield (L, -1, "timeout");
+	lua_pushnumber (L, (lua_Number) socket_io (L, 1)->timeout);
 	return 1;
 }
 /* }}} */
@@ -748,12 +1110,43 @@ static int rsock_get_timeout (lua_State *L)
 /* {{{ rsock_set_timeout() */
 static int rsock_set_timeout (lua_State *L)
 {
-	(void) socket_fd (L, 1);
-	luaL_checknumber (L, 2);
+	struct ratchet_io *io = socket_io (L, 1);
+	io->timeout = (double) luaL_checknumber (L, 2);
 
-	lua_getuservalue (L, 1);
-	lua_pushvalue (L, 2);
-	lua_setfield (L, -2, "timeout");
+	return 0;
+}
+/* }}} */
+
+/* {{{ rsock_set_persistent() */
+static int rsock_set_persistent (lua_State *L)
+{
+	struct rsock_socket *sock = (struct rsock_socket *) luaL_checkudata (L, 1, "ratchet_socket_meta");
+	int enabled = lua_toboolean (L, 2);
+	lua_settop (L, 2);
+
+	if (enabled && !sock->watch)
+	{
+		if (sock->io.fd < 0)
+			return ratchet_error_str (L, "ratchet.socket.set_persistent()", "EBADF", "Socket is closed.");
+
+		/* The watch stays referenced by the socket even once disabled, a
+		 * waiting thread may still point to it. */
+		lua_getuservalue (L, 1);
+		lua_getfield (L, 3, "watch");
+		struct ratchet_watch *watch = (struct ratchet_watch *) lua_touserdata (L, 4);
+		if (!watch)
+		{
+			watch = ratchet_watch_new (L, sock->io.fd);
+			lua_setfield (L, 3, "watch");
+		}
+		watch->fd = sock->io.fd;
+		sock->watch = watch;
+	}
+	else if (!enabled && sock->watch)
+	{
+		ratchet_watch_detach (sock->watch);
+		sock->watch = NULL;
+	}
 
 	return 0;
 }
@@ -852,6 +1245,13 @@ static int rsock_close (lua_State *L)
 	if (*fd < 0)
 		return 0;
 
+	struct ratchet_watch *watch = socket_watch (L, 1);
+	if (watch)
+	{
+		ratchet_watch_detach (watch);
+		watch->fd = -1;
+	}
+
 	int ret = close (*fd);
 	if (ret == -1)
 		return ratchet_error_errno (L, "ratchet.socket.close()", "close");
@@ -886,20 +1286,23 @@ static int rsock_connect (lua_State *L)
 	socklen_t addrlen = (socklen_t) lua_rawlen (L, 2);
 
 	int ctx = 0;
+	ssize_t polled = 0;
 	lua_getctx (L, &ctx);
-	if (ctx == 1 && !lua_toboolean (L, 3))
+	int done = get_wait_result (L, ctx, &polled);
+	if (done < 0)
 		return ratchet_error_str (L, "ratchet.socket.connect()", "ETIMEDOUT", "Timed out on connect.");
+	else if (done && polled < 0)
+	{
+		errno = (int) -polled;
+		return ratchet_error_errno (L, "ratchet.socket.connect()", "connect");
+	}
 	lua_settop (L, 2);
 
 	int ret = connect (sockfd, addr, addrlen);
 	if (ret < 0)
 	{
 		if (errno == EALREADY || errno == EINPROGRESS)
-		{
-			lua_pushlightuserdata (L, RATCHET_YIELD_WRITE);
-			lua_pushvalue (L, 1);
-			return lua_yieldk (L, 2, 1, rsock_connect);
-		}
+			return yield_socket (L, RATCHET_YIELD_WRITE, RATCHET_WATCH_WRITE, RATCHET_URING_POLL, rsock_connect);
 		else
 			return ratchet_error_errno (L, "ratchet.socket.connect()", "connect");
 	}
@@ -921,44 +1324,70 @@ static int rsock_connect (lua_State *L)
 static int rsock_accept (lua_State *L)
 {
 	int sockfd = socket_fd (L, 1);
+	int clientfd;
 
 	int ctx = 0;
+	ssize_t ret = 0;
 	lua_getctx (L, &ctx);
-	if (ctx == 1 && !lua_toboolean (L, 3))
+	int done = get_wait_result (L, ctx, &ret);
+	if (done < 0)
 		return ratchet_error_str (L, "ratchet.socket.accept()", "ETIMEDOUT", "Timed out on accept.");
-	lua_settop (L, 2);
+	lua_settop (L, (done ? 3 : 2));
 
 	socklen_t addr_len = sizeof (struct sockaddr_storage);
 	struct sockaddr *addr = (struct sockaddr *) lua_touserdata (L, 2);
 	if (!addr)
 	{
-		addr = (struct sockaddr *) lua_newuserdata (L, sizeof (struct sockaddr_storage));
-		luaL_getmetatable (L, "ratchet_socket_sockaddr_meta");
-		lua_setmetatable (L, -2);
+		addr = push_sockaddr (L, NULL);
 		lua_replace (L, 2);
 	}
 
-	int clientfd = accept (sockfd, addr, &addr_len);
-	if (clientfd == -1)
+	if (done)
 	{
-		if (errno == EAGAIN || errno == EWOULDBLOCK)
+		/* Completed by io_uring, the operation at index 3 holds the address. */
+		struct ratchet_uring_op *op = (struct ratchet_uring_op *) lua_touserdata (L, 3);
+		if (ret < 0)
 		{
-			lua_pushlightuserdata (L, RATCHET_YIELD_READ);
-			lua_pushvalue (L, 1);
-			return lua_yieldk (L, 2, 1, rsock_accept);
-		}
-
-		else
+			errno = (int) -ret;
 			return ratchet_error_errno (L, "ratchet.socket.accept()", "accept");
+		}
+		clientfd = (int) ret;
+		memcpy (addr, &op->addr, sizeof (struct sockaddr_storage));
 	}
+	else
+	{
+#if HAVE_LIBURING
+		/* A connection an abandoned accept took comes first. */
+		struct ratchet_uring_op *op = get_abandoned_uring_op (L, RATCHET_URING_ACCEPT);
+		if (op && op->busy)
+			return yield_socket (L, RATCHET_YIELD_READ, RATCHET_WATCH_READ, RATCHET_URING_ACCEPT, rsock_accept);
+		else if (op)
+		{
+			op->completed = 0;
+			clientfd = op->result;
+			memcpy (addr, &op->addr, sizeof (struct sockaddr_storage));
+			goto accepted;
+		}
+#endif
 
-	/* Create the new socket object from file descriptor. */
-	lua_getfield (L, LUA_REGISTRYINDEX, "ratchet_socket_class");
-	lua_getfield (L, -1, "from_fd");
-	lua_pushinteger (L, clientfd);
-	lua_call (L, 1, 1);
-	lua_remove (L, -2);
+		if (socket_blocked (L, RATCHET_WATCH_READ))
+			return yield_socket (L, RATCHET_YIELD_READ, RATCHET_WATCH_READ, RATCHET_URING_ACCEPT, rsock_accept);
+
+		clientfd = accept_client (sockfd, addr, &addr_len);
+		if (clientfd == -1)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return yield_socket (L, RATCHET_YIELD_READ, RATCHET_WATCH_READ, RATCHET_URING_ACCEPT, rsock_accept);
+
+			else
+				return ratchet_error_errno (L, "ratchet.socket.accept()", "accept");
+		}
+	}
 
+#if HAVE_LIBURING
+accepted:
+#endif
+	push_socket (L, clientfd);
 	lua_pushvalue (L, 2);
 
 	push_inet_ntop (L, addr);
@@ -968,6 +1397,100 @@ static int rsock_accept (lua_State *L)
 }
 /* }}} */
 
+/* {{{ rsock_accept_many() */
+static int rsock_accept_many (lua_State *L)
+{
+	int sockfd = socket_fd (L, 1);
+	int max = luaL_optint (L, 2, RATCHET_ACCEPT_MANY);
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	int i, clientfd, num = 0;
+
+	int ctx = 0;
+	lua_getctx (L, &ctx);
+	if (ctx == 2)
+		goto attach_handlers;
+	else if (ctx == 1 && !lua_toboolean (L, 4))
+		return ratchet_error_str (L, "ratchet.socket.accept_many()", "ETIMEDOUT", "Timed out on accept.");
+	luaL_argcheck (L, max > 0, 2, "must be positive");
+	if (!lua_isnoneornil (L, 3))
+		luaL_checktype (L, 3, LUA_TFUNCTION);
+	lua_settop (L, 3);
+
+	if (socket_blocked (L, RATCHET_WATCH_READ))
+		return yield_socket (L, RATCHET_YIELD_READ, RATCHET_WATCH_READ, 0, rsock_accept_many);
+
+	lua_newtable (L);
+	lua_newtable (L);
+
+#if HAVE_LIBURING
+	/* A connection an abandoned accept took comes first. */
+	struct ratchet_uring_op *op = get_abandoned_uring_op (L, RATCHET_URING_ACCEPT);
+	if (op && op->completed)
+	{
+		op->completed = 0;
+		push_socket (L, op->result);
+		lua_rawseti (L, 4, ++num);
+		push_sockaddr (L, &op->addr);
+		lua_rawseti (L, 5, num);
+
+		push_inet_ntop (L, (struct sockaddr *) &op->addr);
+		call_tracer (L, 1, "accept", 1);
+	}
+#endif
+
+	while (num < max)
+	{
+		addr_len = sizeof (struct sockaddr_storage);
+		clientfd = accept_client (sockfd, (struct sockaddr *) &addr, &addr_len);
+		if (clientfd == -1)
+		{
+			if (errno == ECONNABORTED || errno == EINTR)
+				continue;
+			else if (num)
+				break;
+			else if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				lua_settop (L, 3);
+				return yield_socket (L, RATCHET_YIELD_READ, RATCHET_WATCH_READ, 0, rsock_accept_many);
+			}
+			else
+				return ratchet_error_errno (L, "ratchet.socket.accept_many()", "accept");
+		}
+
+		push_socket (L, clientfd);
+		lua_rawseti (L, 4, ++num);
+		push_sockaddr (L, &addr);
+		lua_rawseti (L, 5, num);
+
+		push_inet_ntop (L, (struct sockaddr *) &addr);
+		call_tracer (L, 1, "accept", 1);
+	}
+
+	if (lua_isnil (L, 3))
+		return 2;
+
+	/* Handler threads are attached with the ratchet object. */
+	lua_pushlightuserdata (L, RATCHET_YIELD_GET);
+	return lua_yieldk (L, 1, 2, rsock_accept_many);
+
+attach_handlers:
+	lua_insert (L, 1);
+	num = (int) lua_rawlen (L, 5);
+	for (i=1; i<=num; i++)
+	{
+		lua_pushvalue (L, 4);
+		lua_rawgeti (L, 5, i);
+		lua_rawgeti (L, 6, i);
+		ratchet_attach_thread (L, 2);
+		lua_pop (L, 1);
+	}
+
+	lua_pushinteger (L, num);
+	return 1;
+}
+/* }}} */
+
 /* {{{ rsock_send() */
 static int rsock_send (lua_State *L)
 {
@@ -978,21 +1501,33 @@ static int rsock_send (lua_State *L)
 
 	int ctx = 0;
 	lua_getctx (L, &ctx);
-	if (ctx == 1 && !lua_toboolean (L, 3))
+	int done = get_wait_result (L, ctx, &ret);
+	if (done < 0)
 		return ratchet_error_str (L, "ratchet.socket.send()", "ETIMEDOUT", "Timed out on send.");
 	lua_settop (L, 2);
 
-	ret = send (sockfd, data, data_len, MSG_NOSIGNAL);
-	if (ret == -1)
+	if (done)
 	{
-		if (errno == EAGAIN || errno == EWOULDBLOCK)
+		/* Completed by io_uring. */
+		if (ret < 0)
 		{
-			lua_pushlightuserdata (L, RATCHET_YIELD_WRITE);
-			lua_pushvalue (L, 1);
-			return lua_yieldk (L, 2, 1, rsock_send);
-		}
-		else
+			errno = (int) -ret;
 			return ratchet_error_errno (L, "ratchet.socket.send()", "send");
+		}
+	}
+	else
+	{
+		if (socket_blocked (L, RATCHET_WATCH_WRITE))
+			return yield_socket (L, RATCHET_YIELD_WRITE, RATCHET_WATCH_WRITE, RATCHET_URING_SEND, rsock_send);
+
+		ret = send (sockfd, data, data_len, MSG_NOSIGNAL);
+		if (ret == -1)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return yield_socket (L, RATCHET_YIELD_WRITE, RATCHET_WATCH_WRITE, RATCHET_URING_SEND, rsock_send);
+			else
+				return ratchet_error_errno (L, "ratchet.socket.send()", "send");
+		}
 	}
 
 	if ((size_t) ret < data_len)
@@ -1014,6 +1549,199 @@ static int rsock_send (lua_State *L)
 }
 /* }}} */
 
+/* {{{ get_sendv_part() */
+/* Returns the data of the string or ratchet.buffer at the given index, which
+ * must stay referenced by the sendv() table while the pointer is used. */
+static const char *get_sendv_part (lua_State *L, int index, size_t *len)
+{
+	struct ratchet_buffer *buf = (struct ratchet_buffer *) luaL_testudata (L, index, "ratchet_buffer_meta");
+	if (buf)
+	{
+		*len = buf->len;
+		return buf->data + buf->start;
+	}
+	if (LUA_TSTRING != lua_type (L, index))
+		luaL_argerror (L, 2, "table must only contain strings or buffers");
+	return lua_tolstring (L, index, len);
+}
+/* }}} */
+
+/* {{{ rsock_sendv() */
+/* The position in the table, as the index of the first part not fully sent
+ * and the bytes of it already sent, is kept at stack indexes 3 and 4 while
+ * the thread waits. */
+static int rsock_sendv (lua_State *L)
+{
+	int sockfd = socket_fd (L, 1);
+	luaL_checktype (L, 2, LUA_TTABLE);
+	struct iovec iov[RATCHET_SENDV_IOV];
+	struct msghdr msg;
+	const char *data;
+	size_t len, offset;
+	int i, n, num;
+	ssize_t ret;
+
+	int ctx = 0;
+	lua_getctx (L, &ctx);
+	if (ctx == 1 && !lua_toboolean (L, 5))
+		return ratchet_error_str (L, "ratchet.socket.sendv()", "ETIMEDOUT", "Timed out on sendv.");
+	else if (ctx == 0)
+	{
+		lua_settop (L, 2);
+		lua_pushinteger (L, 1);
+		lua_pushinteger (L, 0);
+	}
+	lua_settop (L, 4);
+
+	i = (int) lua_tointeger (L, 3);
+	offset = (size_t) lua_tounsigned (L, 4);
+	num = (int) lua_rawlen (L, 2);
+
+	while (i <= num)
+	{
+		if (socket_blocked (L, RATCHET_WATCH_WRITE))
+			goto wait;
+
+		for (n=0; n<RATCHET_SENDV_IOV && i+n<=num; n++)
+		{
+			lua_rawgeti (L, 2, i+n);
+			data = get_sendv_part (L, -1, &len);
+			lua_pop (L, 1);
+
+			if (0 == n)
+			{
+				/* A buffer may have shrunk while the thread waited. */
+				if (offset > len)
+					offset = len;
+				data += offset;
+				len -= offset;
+			}
+			iov[n].iov_base = (void *) data;
+			iov[n].iov_len = len;
+		}
+
+		memset (&msg, 0, sizeof (struct msghdr));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = (size_t) n;
+
+		ret = sendmsg (sockfd, &msg, MSG_NOSIGNAL);
+		if (ret == -1)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				goto wait;
+			else
+				return ratchet_error_errno (L, "ratchet.socket.sendv()", "sendmsg");
+		}
+
+		/* Skip past every part that was sent completely. */
+		for (n=0; n<RATCHET_SENDV_IOV && i<=num && (size_t) ret >= iov[n].iov_len; n++, i++)
+		{
+			ret -= (ssize_t) iov[n].iov_len;
+			offset = 0;
+		}
+		offset += (size_t) ret;
+	}
+
+	lua_pushvalue (L, 2);
+	call_tracer (L, 1, "sendv", 1);
+
+	return 0;
+
+wait:
+	lua_pushinteger (L, (lua_Integer) i);
+	lua_replace (L, 3);
+	lua_pushunsigned (L, (lua_Unsigned) offset);
+	lua_replace (L, 4);
+	return yield_socket (L, RATCHET_YIELD_WRITE, RATCHET_WATCH_WRITE, 0, rsock_sendv);
+}
+/* }}} */
+
+/* {{{ rsock_sendfile() */
+static int rsock_sendfile (lua_State *L)
+{
+	int sockfd = socket_fd (L, 1);
+	struct rsock_transfer *t;
+	ssize_t ret;
+#if !HAVE_SYS_SENDFILE_H
+	char buffer[LUAL_BUFFERSIZE];
+#endif
+
+	int ctx = 0;
+	lua_getctx (L, &ctx);
+	if (ctx == 1 && !lua_toboolean (L, 6))
+		return ratchet_error_str (L, "ratchet.socket.sendfile()", "ETIMEDOUT", "Timed out on sendfile.");
+	else if (ctx == 0)
+	{
+		lua_settop (L, 4);
+
+#if HAVE_OPENSSL
+		lua_getfield (L, 1, "get_encryption");
+		lua_pushvalue (L, 1);
+		lua_call (L, 1, 1);
+		if (lua_toboolean (L, -1))
+			return ratchet_error_str (L, "ratchet.socket.sendfile()", "ENOTSUP", "Cannot sendfile() on an encrypted socket.");
+		lua_pop (L, 1);
+#endif
+
+		t = push_transfer (L, 4);
+		t->offset = (off_t) luaL_optnumber (L, 3, 0.0);
+		if (LUA_TSTRING == lua_type (L, 2))
+		{
+			t->owned[0] = open (lua_tostring (L, 2), O_RDONLY | O_CLOEXEC);
+			if (t->owned[0] < 0)
+				return ratchet_error_errno (L, "ratchet.socket.sendfile()", "open");
+			t->in = t->owned[0];
+		}
+		else if (LUA_TNUMBER == lua_type (L, 2))
+			t->in = (int) lua_tointeger (L, 2);
+		else
+			t->in = ratchet_get_fd (L, 2);
+	}
+	lua_settop (L, 5);
+	t = (struct rsock_transfer *) lua_touserdata (L, 5);
+
+	while (!t->limited || t->remaining)
+	{
+		if (socket_blocked (L, RATCHET_WATCH_WRITE))
+			return yield_socket (L, RATCHET_YIELD_WRITE, RATCHET_WATCH_WRITE, 0, rsock_sendfile);
+
+#if HAVE_SYS_SENDFILE_H
+		ret = sendfile (sockfd, t->in, &t->offset, transfer_count (t, RATCHET_SENDFILE_CHUNK));
+#else
+		/* Without sendfile(), the data that could not be sent is read again
+		 * from the file after the wait instead of being kept. */
+		ret = pread (t->in, buffer, transfer_count (t, LUAL_BUFFERSIZE), t->offset);
+		if (ret > 0)
+		{
+			ret = send (sockfd, buffer, (size_t) ret, MSG_NOSIGNAL);
+			if (ret > 0)
+				t->offset += (off_t) ret;
+		}
+#endif
+		if (ret == -1)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return yield_socket (L, RATCHET_YIELD_WRITE, RATCHET_WATCH_WRITE, 0, rsock_sendfile);
+			else
+				return ratchet_error_errno (L, "ratchet.socket.sendfile()", "sendfile");
+		}
+		else if (ret == 0)
+			break;
+
+		t->total += (size_t) ret;
+		if (t->limited)
+			t->remaining -= (size_t) ret;
+	}
+
+	transfer_close (t);
+	lua_pushnumber (L, (lua_Number) t->total);
+	lua_pushvalue (L, -1);
+	call_tracer (L, 1, "sendfile", 1);
+
+	return 1;
+}
+/* }}} */
+
 /* {{{ rsock_recv() */
 static int rsock_recv (lua_State *L)
 {
@@ -1023,35 +1751,156 @@ static int rsock_recv (lua_State *L)
 
 	int ctx = 0;
 	lua_getctx (L, &ctx);
-	if (ctx == 1 && !lua_toboolean (L, 3))
+	int done = get_wait_result (L, ctx, &ret);
+	if (done < 0)
 		return ratchet_error_str (L, "ratchet.socket.recv()", "ETIMEDOUT", "Timed out on recv.");
-	lua_settop (L, 2);
+#if HAVE_LIBURING
+	else if (done)
+	{
+		/* Completed by io_uring, into the buffer of the operation at index 3.
+		 * One taken over from an abandoned wait may hold more than was
+		 * asked for, the rest is kept for the next receive. */
+		struct ratchet_uring_op *op = (struct ratchet_uring_op *) lua_touserdata (L, 3);
+		if (ret < 0)
+		{
+			errno = (int) -ret;
+			return ratchet_error_errno (L, "ratchet.socket.recv()", "recv");
+		}
+		size_t len = (size_t) luaL_optunsigned (L, 2, (lua_Unsigned) LUAL_BUFFERSIZE);
+		op->completed = 1;
+		op->result = (int) ret;
+		op->start = 0;
+		const char *data = take_uring_bytes (op, &len);
+		lua_pushlstring (L, data, len);
+	}
+#endif
+	else
+	{
+		lua_settop (L, 2);
 
-	luaL_buffinit (L, &buffer);
-	char *prepped = luaL_prepbuffer (&buffer);
+		size_t len = (size_t) luaL_optunsigned (L, 2, (lua_Unsigned) LUAL_BUFFERSIZE);
+		if (len > LUAL_BUFFERSIZE)
+			return luaL_error (L, "Cannot recv more than %u bytes, %u requested", (unsigned) LUAL_BUFFERSIZE, (unsigned) len);
 
-	size_t len = (size_t) luaL_optunsigned (L, 2, (lua_Unsigned) LUAL_BUFFERSIZE);
-	if (len > LUAL_BUFFERSIZE)
-		return luaL_error (L, "Cannot recv more than %u bytes, %u requested", (unsigned) LUAL_BUFFERSIZE, (unsigned) len);
+#if HAVE_LIBURING
+		/* Bytes an abandoned receive took off the socket come first. */
+		struct ratchet_uring_op *op = get_abandoned_uring_op (L, RATCHET_URING_RECV);
+		if (op && op->busy)
+			return yield_socket (L, RATCHET_YIELD_READ, RATCHET_WATCH_READ, RATCHET_URING_RECV, rsock_recv);
+		else if (op)
+		{
+			const char *data = take_uring_bytes (op, &len);
+			lua_pushlstring (L, data, len);
+			goto received;
+		}
+#endif
+
+		luaL_buffinit (L, &buffer);
+		char *prepped = luaL_prepbuffer (&buffer);
+
+		if (socket_blocked (L, RATCHET_WATCH_READ))
+			return yield_socket (L, RATCHET_YIELD_READ, RATCHET_WATCH_READ, RATCHET_URING_RECV, rsock_recv);
+
+		ret = recv (sockfd, prepped, len, 0);
+		if (ret == -1)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return yield_socket (L, RATCHET_YIELD_READ, RATCHET_WATCH_READ, RATCHET_URING_RECV, rsock_recv);
+			else
+				return ratchet_error_errno (L, "ratchet.socket.recv()", "recv");
+		}
+
+		luaL_addsize (&buffer, (size_t) ret);
+		luaL_pushresult (&buffer);
+	}
+
+#if HAVE_LIBURING
+received:
+#endif
+	lua_pushvalue (L, -1);
+	call_tracer (L, 1, "recv", 1);
+
+	return 1;
+}
+/* }}} */
+
+/* {{{ rsock_recv_into() */
+static int rsock_recv_into (lua_State *L)
+{
+	int sockfd = socket_fd (L, 1);
+	struct ratchet_buffer *buf = ratchet_buffer_check (L, 2);
+	size_t len = (size_t) luaL_optunsigned (L, 3, (lua_Unsigned) LUAL_BUFFERSIZE);
+	ssize_t ret;
+
+	int ctx = 0;
+	lua_getctx (L, &ctx);
+	if (ctx && !lua_toboolean (L, 3 + ctx))
+		return ratchet_error_str (L, "ratchet.socket.recv_into()", "ETIMEDOUT", "Timed out on recv.");
+
+#if HAVE_LIBURING
+	/* Woken by the completion of an abandoned receive at index 4. */
+	struct ratchet_uring_op *op = NULL;
+	if (ctx == 2 && -EAGAIN != lua_tointeger (L, 5))
+	{
+		op = (struct ratchet_uring_op *) lua_touserdata (L, 4);
+		ret = (ssize_t) lua_tointeger (L, 5);
+		if (ret < 0)
+		{
+			errno = (int) -ret;
+			return ratchet_error_errno (L, "ratchet.socket.recv_into()", "recv");
+		}
+		op->completed = 1;
+		op->result = (int) ret;
+		op->start = 0;
+	}
+#endif
+	lua_settop (L, 3);
+
+#if HAVE_LIBURING
+	/* Bytes an abandoned receive took off the socket come first. */
+	if (!op)
+		op = get_abandoned_uring_op (L, RATCHET_URING_RECV);
+	if (op && op->busy)
+	{
+		push_uring_op (L, RATCHET_URING_RECV);
+		lua_pushlightuserdata (L, RATCHET_YIELD_READ);
+		lua_pushvalue (L, 1);
+		lua_pushvalue (L, 4);
+		return lua_yieldk (L, 3, 2, rsock_recv_into);
+	}
+	else if (op)
+	{
+		size_t n = len;
+		const char *data = take_uring_bytes (op, &n);
+		memcpy (ratchet_buffer_prep (L, buf, n), data, n);
+		ratchet_buffer_add (buf, n);
+		ret = (ssize_t) n;
+		goto received;
+	}
+#endif
 
+	/* Received straight into the buffer, so io_uring is not given an
+	 * operation to complete into its own memory. */
+	if (socket_blocked (L, RATCHET_WATCH_READ))
+		return yield_socket (L, RATCHET_YIELD_READ, RATCHET_WATCH_READ, 0, rsock_recv_into);
+
+	char *prepped = ratchet_buffer_prep (L, buf, len);
 	ret = recv (sockfd, prepped, len, 0);
 	if (ret == -1)
 	{
 		if (errno == EAGAIN || errno == EWOULDBLOCK)
-		{
-			lua_pushlightuserdata (L, RATCHET_YIELD_READ);
-			lua_pushvalue (L, 1);
-			return lua_yieldk (L, 2, 1, rsock_recv);
-		}
+			return yield_socket (L, RATCHET_YIELD_READ, RATCHET_WATCH_READ, 0, rsock_recv_into);
 		else
-			return ratchet_error_errno (L, "ratchet.socket.recv()", "recv");
+			return ratchet_error_errno (L, "ratchet.socket.recv_into()", "recv");
 	}
+	ratchet_buffer_add (buf, (size_t) ret);
 
-	luaL_addsize (&buffer, (size_t) ret);
-	luaL_pushresult (&buffer);
-
+#if HAVE_LIBURING
+received:
+#endif
+	lua_pushinteger (L, (lua_Integer) ret);
 	lua_pushvalue (L, -1);
-	call_tracer (L, 1, "recv", 1);
+	call_tracer (L, 1, "recv_into", 1);
 
 	return 1;
 }
@@ -1094,6 +1943,56 @@ encrypted_send_complete:
 }
 /* }}} */
 
+/* {{{ rsock_try_encrypted_sendv() */
+/* An encryption session has no scatter-gather write, so each part is given
+ * to its write() in turn. The continuation context is the last part done. */
+static int rsock_try_encrypted_sendv (lua_State *L)
+{
+	(void) socket_fd (L, 1);
+	size_t len;
+	int i, num;
+
+	int ctx = 0;
+	if (LUA_YIELD == lua_getctx (L, &ctx))
+		goto encrypted_sendv_next;
+
+	luaL_checktype (L, 2, LUA_TTABLE);
+	lua_settop (L, 2);
+
+	lua_getfield (L, 1, "get_encryption");
+	lua_pushvalue (L, 1);
+	lua_call (L, 1, 1);
+
+	if (!lua_toboolean (L, -1))
+	{
+		lua_settop (L, 2);
+		return rsock_sendv (L);
+	}
+
+encrypted_sendv_next:
+	lua_settop (L, 3);
+	num = (int) lua_rawlen (L, 2);
+	for (i=ctx+1; i<=num; i++)
+	{
+		lua_getfield (L, 3, "write");
+		lua_pushvalue (L, 3);
+		lua_rawgeti (L, 2, i);
+		if (luaL_testudata (L, -1, "ratchet_buffer_meta"))
+		{
+			const char *data = get_sendv_part (L, -1, &len);
+			lua_pushlstring (L, data, len);
+			lua_replace (L, -2);
+		}
+		lua_callk (L, 2, 0, i, rsock_try_encrypted_sendv);
+	}
+
+	lua_pushvalue (L, 2);
+	call_tracer (L, 1, "encrypted sendv", 1);
+
+	return 0;
+}
+/* }}} */
+
 /* {{{ rsock_try_encrypted_recv() */
 static int rsock_try_encrypted_recv (lua_State *L)
 {
@@ -1129,6 +2028,43 @@ encrypted_recv_complete:
 	return 1;
 }
 /* }}} */
+
+/* {{{ rsock_try_encrypted_recv_into() */
+static int rsock_try_encrypted_recv_into (lua_State *L)
+{
+	(void) socket_fd (L, 1);
+	int ctx = 0;
+	if (LUA_YIELD == lua_getctx (L, &ctx))
+		goto encrypted_recv_into_complete;
+
+	lua_settop (L, 3);
+
+	lua_getfield (L, 1, "get_encryption");
+	lua_pushvalue (L, 1);
+	lua_call (L, 1, 1);
+
+	if (lua_toboolean (L, -1))
+	{
+		lua_getfield (L, -1, "read_into");
+		lua_pushvalue (L, -2);
+		lua_pushvalue (L, 2);
+		lua_pushvalue (L, 3);
+		lua_callk (L, 3, 1, 1, rsock_try_encrypted_recv_into);
+		goto encrypted_recv_into_complete;
+	}
+	else
+	{
+		lua_settop (L, 3);
+		return rsock_recv_into (L);
+	}
+
+encrypted_recv_into_complete:
+	lua_pushvalue (L, -1);
+	call_tracer (L, 1, "encrypted recv_into", 1);
+
+	return 1;
+}
+/* }}} */
 #endif
 
 /* ---- Public Functions ---------------------------------------------------- */
@@ -1151,6 +2087,10 @@ int luaopen_ratchet_socket (lua_State *L)
 		{"prepare_unix", rsock_prepare_unix},
 		{"prepare_tcp", rsock_prepare_tcp},
 		{"prepare_udp", rsock_prepare_udp},
+		{"relay", rsock_relay},
+#if HAVE_SPLICE
+		{"splice", rsock_splice},
+#endif
 		/* Undocumented, helper methods. */
 		{NULL}
 	};
@@ -1168,20 +2108,28 @@ int luaopen_ratchet_socket (lua_State *L)
 		{"get_fd", rsock_get_fd},
 		{"get_timeout", rsock_get_timeout},
 		{"set_timeout", rsock_set_timeout},
+		{"set_persistent", rsock_set_persistent},
 #if HAVE_OPENSSL
 		{"get_encryption", rsock_get_encryption},
 		{"encrypt", rsock_encrypt},
 		{"send", rsock_try_encrypted_send},
+		{"sendv", rsock_try_encrypted_sendv},
+		{"sendfile", rsock_sendfile},
 		{"recv", rsock_try_encrypted_recv},
+		{"recv_into", rsock_try_encrypted_recv_into},
 #else
 		{"send", rsock_send},
+		{"sendv", rsock_sendv},
+		{"sendfile", rsock_sendfile},
 		{"recv", rsock_recv},
+		{"recv_into", rsock_recv_into},
 #endif
 		{"bind", rsock_bind},
 		{"listen", rsock_listen},
 		{"check_errors", rsock_check_errors},
 		{"connect", rsock_connect},
 		{"accept", rsock_accept},
+		{"accept_many", rsock_accept_many},
 		{"shutdown", rsock_shutdown},
 		{"close", rsock_close},
 		{"set_tracer", rsock_set_tracer},
@@ -1204,11 +2152,24 @@ int luaopen_ratchet_socket (lua_State *L)
 
 	/* Set up the ratchet.socket class and metatables. */
 	luaL_newmetatable (L, "ratchet_socket_meta");
+	ratchet_io_register (L, -1);
 	luaL_setfuncs (L, metameths, 0);
 	luaL_newlib (L, meths);
 	lua_setfield (L, -2, "__index");
 	lua_pop (L, 1);
 
+	/* Set up the metatable for sendfile() and splice() progress. */
+	luaL_newmetatable (L, "ratchet_socket_transfer_meta");
+	lua_pushcfunction (L, rsock_transfer_gc);
+	lua_setfield (L, -2, "__gc");
+	lua_pop (L, 1);
+
+	/* Set up the metatable for relay() state. */
+	luaL_newmetatable (L, "ratchet_socket_relay_meta");
+	lua_pushcfunction (L, rsock_relay_gc);
+	lua_setfield (L, -2, "__gc");
+	lua_pop (L, 1);
+
 	/* Set up the struct sockaddr userdata metatable. */
 	luaL_newmetatable (L, "ratchet_socket_sockaddr_meta");
 	luaL_setfuncs (L, sockaddrmeta, 0);
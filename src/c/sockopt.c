@@ -297,6 +297,9 @@ int rsockopt_get (lua_State *L)
 	CHECK_OPT_GET (SO_RCVTIMEO, timeval);
 	CHECK_OPT_GET (SO_SNDTIMEO, timeval);
 	CHECK_OPT_GET (SO_REUSEADDR, boolean);
+#ifdef SO_REUSEPORT
+	CHECK_OPT_GET (SO_REUSEPORT, boolean);
+#endif
 	CHECK_OPT_GET (SO_SNDBUF, int);
 #ifdef SO_SNDBUFFORCE
 	CHECK_OPT_GET (SO_SNDBUFFORCE, int);
@@ -347,6 +350,9 @@ int rsockopt_set (lua_State *L)
 	CHECK_OPT_SET (SO_RCVTIMEO, timeval);
 	CHECK_OPT_SET (SO_SNDTIMEO, timeval);
 	CHECK_OPT_SET (SO_REUSEADDR, boolean);
+#ifdef SO_REUSEPORT
+	CHECK_OPT_SET (SO_REUSEPORT, boolean);
+#endif
 	CHECK_OPT_SET (SO_SNDBUF, int);
 #ifdef SO_SNDBUFFORCE
 	CHECK_OPT_SET (SO_SNDBUFFORCE, int);
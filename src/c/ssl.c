@@ -34,6 +34,7 @@
 #include <netdb.h>
 #include <errno.h>
 #include <signal.h>
+#include <limits.h>
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
@@ -569,6 +570,62 @@ static int rssl_session_read (lua_State *L)
 }
 /* }}} */
 
+/* {{{ rssl_session_read_into() */
+static int rssl_session_read_into (lua_State *L)
+{
+	SSL *session = *(SSL **) luaL_checkudata (L, 1, "ratchet_ssl_session_meta");
+	struct ratchet_buffer *buf = ratchet_buffer_check (L, 2);
+	size_t len = (size_t) luaL_optunsigned (L, 3, (lua_Unsigned) LUAL_BUFFERSIZE);
+
+	int ctx = 0;
+	lua_getctx (L, &ctx);
+	if (ctx == 1 && !lua_toboolean (L, 4))
+		return ratchet_error_str (L, "ratchet.ssl.session.read_into()", "ETIMEDOUT", "Timed out on read.");
+	lua_settop (L, 3);
+
+	if (len > INT_MAX)
+		len = INT_MAX;
+	char *prepped = ratchet_buffer_prep (L, buf, len);
+
+	signal_handler old = signal (SIGPIPE, SIG_IGN);
+	int ret = SSL_read (session, prepped, (int) len);
+	int orig_errno = errno;
+	signal (SIGPIPE, old);
+
+	unsigned long error = SSL_get_error (session, ret);
+	switch (error)
+	{
+		case SSL_ERROR_NONE:
+			ratchet_buffer_add (buf, (size_t) ret);
+			lua_pushinteger (L, (lua_Integer) ret);
+			return 1;
+
+		case SSL_ERROR_ZERO_RETURN:
+			lua_pushinteger (L, 0);
+			return 1;
+
+		case SSL_ERROR_WANT_READ:
+			lua_pushlightuserdata (L, RATCHET_YIELD_READ);
+			lua_getuservalue (L, 1);
+			lua_getfield (L, -1, "engine");
+			lua_remove (L, -2);
+			return lua_yieldk (L, 2, 1, rssl_session_read_into);
+
+		case SSL_ERROR_WANT_WRITE:
+			lua_pushlightuserdata (L, RATCHET_YIELD_WRITE);
+			lua_getuservalue (L, 1);
+			lua_getfield (L, -1, "engine");
+			lua_remove (L, -2);
+			return lua_yieldk (L, 2, 1, rssl_session_read_into);
+
+		default:
+			return handle_ssl_error (L, "ratchet.ssl.session.read_into()", ret, error, orig_errno);
+	}
+
+	return luaL_error (L, "unreachable");
+}
+/* }}} */
+
 /* {{{ rssl_session_write() */
 static int rssl_session_write (lua_State *L)
 {
@@ -725,6 +782,13 @@ int rsock_encrypt (lua_State *L)
 	int fd = *(int *) luaL_checkudata (L, 1, "ratchet_socket_meta");
 	luaL_checkudata (L, 2, "ratchet_ssl_ctx_meta");
 
+	/* Sessions wait on the descriptor themselves, which cannot be mixed
+	 * with an edge-triggered registration. */
+	lua_getfield (L, 1, "set_persistent");
+	lua_pushvalue (L, 1);
+	lua_pushboolean (L, 0);
+	lua_call (L, 2, 0);
+
 	BIO *bio = BIO_new_socket (fd, BIO_NOCLOSE);
 	if (!bio)
 		return luaL_error (L, "Could not create BIO object from: %d", fd);
@@ -779,6 +843,7 @@ int luaopen_ratchet_ssl (lua_State *L)
 		{"get_rfc2253", rssl_session_get_rfc2253},
 		{"get_cipher", rssl_session_get_cipher},
 		{"read", rssl_session_read},
+		{"read_into", rssl_session_read_into},
 		{"write", rssl_session_write},
 		{"shutdown", rssl_session_shutdown},
 		{"connect", rssl_session_connect},
@@ -54,7 +54,9 @@ static int rtfd_new (lua_State *L)
 	flags |= TFD_CLOEXEC;
 #endif
 
-	int *tfd = (int *) lua_newuserdata (L, sizeof (int));
+	struct ratchet_io *io = (struct ratchet_io *) lua_newuserdata (L, sizeof (struct ratchet_io));
+	io->timeout = -1.0;
+	int *tfd = &io->fd;
 	*tfd = timerfd_create (how, flags);
 	if (*tfd < 0)
 		return ratchet_error_errno (L, "ratchet.timerfd.new()", "timerfd_create");
@@ -218,6 +220,7 @@ int luaopen_ratchet_timerfd (lua_State *L)
 
 	/* Set up the ratchet.timerfd class and metatables. */
 	luaL_newmetatable (L, "ratchet_timerfd_meta");
+	ratchet_io_register (L, -1);
 	lua_newtable (L);
 	luaL_setfuncs (L, meths, 0);
 	lua_setfield (L, -2, "__index");
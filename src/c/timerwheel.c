@@ -0,0 +1,227 @@
+/* Copyright (c) 2010 Ian C. Good
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <event2/event.h>
+#include <time.h>
+#include <string.h>
+
+#include "timerwheel.h"
+
+#define SLOT_MASK (TIMERWHEEL_SLOTS - 1)
+#define LEVEL_SPAN(l) (((uint64_t) 1) << (TIMERWHEEL_SLOT_BITS * (l)))
+#define MAX_TICKS (LEVEL_SPAN (TIMERWHEEL_LEVELS) - 1)
+
+/* {{{ monotonic_ms() */
+static uint64_t monotonic_ms (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec) * 1000 + ((uint64_t) ts.tv_nsec) / 1000000;
+}
+/* }}} */
+
+/* {{{ current_tick() */
+static uint64_t current_tick (struct timerwheel *tw)
+{
+	return (monotonic_ms () - tw->start_ms) / tw->granularity;
+}
+/* }}} */
+
+/* {{{ list_unlink() */
+static void list_unlink (struct timer_entry *t)
+{
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	t->next = t->prev = NULL;
+}
+/* }}} */
+
+/* {{{ list_append() */
+static void list_append (struct timer_entry *head, struct timer_entry *t)
+{
+	t->prev = head->prev;
+	t->next = head;
+	head->prev->next = t;
+	head->prev = t;
+}
+/* }}} */
+
+/* {{{ place_entry() */
+static void place_entry (struct timerwheel *tw, struct timer_entry *t)
+{
+	uint64_t delta = (t->expires > tw->now ? t->expires - tw->now : 0);
+	uint64_t target = tw->now + (delta > MAX_TICKS ? MAX_TICKS : delta);
+	int level;
+
+	for (level=0; level<TIMERWHEEL_LEVELS-1; level++)
+		if (delta < LEVEL_SPAN (level+1))
+			break;
+
+	size_t slot = (size_t) ((target >> (TIMERWHEEL_SLOT_BITS * level)) & SLOT_MASK);
+	list_append (&tw->slots[level][slot], t);
+}
+/* }}} */
+
+/* {{{ cascade() */
+static void cascade (struct timerwheel *tw, int level)
+{
+	size_t slot = (size_t) ((tw->now >> (TIMERWHEEL_SLOT_BITS * level)) & SLOT_MASK);
+	struct timer_entry *head = &tw->slots[level][slot];
+
+	/* Detach the slot first, entries may be placed back into it. */
+	struct timer_entry pending;
+	pending.next = pending.prev = &pending;
+	if (head->next != head)
+	{
+		pending.next = head->next;
+		pending.prev = head->prev;
+		pending.next->prev = &pending;
+		pending.prev->next = &pending;
+		head->next = head->prev = head;
+	}
+
+	while (pending.next != &pending)
+	{
+		struct timer_entry *t = pending.next;
+		list_unlink (t);
+		place_entry (tw, t);
+	}
+}
+/* }}} */
+
+/* {{{ timerwheel_tick() */
+static void timerwheel_tick (int fd, short event, void *arg)
+{
+	struct timerwheel *tw = (struct timerwheel *) arg;
+	uint64_t target = current_tick (tw);
+
+	while (tw->count > 0 && tw->now < target)
+	{
+		tw->now++;
+
+		int level;
+		for (level=1; level<TIMERWHEEL_LEVELS; level++)
+		{
+			if (tw->now & (LEVEL_SPAN (level) - 1))
+				break;
+			cascade (tw, level);
+		}
+
+		/* Entries are unlinked before their callback runs, which may arm
+		 * timers again or not return at all. */
+		struct timer_entry *head = &tw->slots[0][tw->now & SLOT_MASK];
+		while (head->next != head)
+		{
+			struct timer_entry *t = head->next;
+			timerwheel_del (t);
+			t->callback (t->arg);
+		}
+	}
+
+	if (tw->count == 0)
+		tw->now = target;
+}
+/* }}} */
+
+/* {{{ timer_entry_init() */
+void timer_entry_init (struct timer_entry *t)
+{
+	memset (t, 0, sizeof (struct timer_entry));
+}
+/* }}} */
+
+/* {{{ timerwheel_init() */
+int timerwheel_init (struct timerwheel *tw, struct event_base *base, unsigned int granularity)
+{
+	int i, j;
+	for (i=0; i<TIMERWHEEL_LEVELS; i++)
+		for (j=0; j<TIMERWHEEL_SLOTS; j++)
+			tw->slots[i][j].next = tw->slots[i][j].prev = &tw->slots[i][j];
+
+	tw->granularity = (granularity > 0 ? granularity : 1);
+	tw->start_ms = monotonic_ms ();
+	tw->now = 0;
+	tw->count = 0;
+	tw->ev = event_new (base, -1, EV_PERSIST, timerwheel_tick, tw);
+
+	return (tw->ev ? 0 : -1);
+}
+/* }}} */
+
+/* {{{ timerwheel_free() */
+void timerwheel_free (struct timerwheel *tw)
+{
+	if (tw->ev)
+		event_free (tw->ev);
+	tw->ev = NULL;
+}
+/* }}} */
+
+/* {{{ timerwheel_add() */
+void timerwheel_add (struct timerwheel *tw, struct timer_entry *t, double secs, void (*callback) (void *), void *arg)
+{
+	timerwheel_del (t);
+
+	/* The wheel does not advance while empty, catch it up first. */
+	if (tw->count == 0)
+		tw->now = current_tick (tw);
+
+	/* Round the deadline up to a whole tick, timers never fire early. */
+	uint64_t ms = (uint64_t) (secs * 1000.0);
+	if ((double) ms < secs * 1000.0)
+		ms++;
+	ms += monotonic_ms () - tw->start_ms;
+
+	t->expires = (ms + tw->granularity - 1) / tw->granularity;
+	if (t->expires <= tw->now)
+		t->expires = tw->now + 1;
+	t->callback = callback;
+	t->arg = arg;
+	t->wheel = tw;
+	place_entry (tw, t);
+
+	if (tw->count++ == 0)
+	{
+		struct timeval tv;
+		tv.tv_sec = tw->granularity / 1000;
+		tv.tv_usec = (tw->granularity % 1000) * 1000;
+		event_add (tw->ev, &tv);
+	}
+}
+/* }}} */
+
+/* {{{ timerwheel_del() */
+void timerwheel_del (struct timer_entry *t)
+{
+	struct timerwheel *tw = t->wheel;
+	if (!tw)
+		return;
+
+	list_unlink (t);
+	t->wheel = NULL;
+	if (--tw->count == 0)
+		event_del (tw->ev);
+}
+/* }}} */
+
+// vim:fdm=marker:ai:ts=4:sw=4:noet:
@@ -0,0 +1,47 @@
+#ifndef __RATCHET_TIMERWHEEL_H
+#define __RATCHET_TIMERWHEEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <event2/event.h>
+
+#define TIMERWHEEL_LEVELS 4
+#define TIMERWHEEL_SLOT_BITS 6
+#define TIMERWHEEL_SLOTS (1 << TIMERWHEEL_SLOT_BITS)
+
+struct timerwheel;
+
+/* A timer embedded in the structure it times out, so arming and cancelling
+ * it never allocates. */
+struct timer_entry
+{
+	struct timer_entry *next;
+	struct timer_entry *prev;
+	struct timerwheel *wheel;
+	uint64_t expires;
+	void (*callback) (void *arg);
+	void *arg;
+};
+
+/* Hierarchical timer wheel, timeouts are rounded up to whole ticks of
+ * granularity milliseconds and driven by a single libevent timer that is
+ * only added while any timer is pending. */
+struct timerwheel
+{
+	struct timer_entry slots[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS];
+	struct event *ev;
+	uint64_t now;
+	uint64_t start_ms;
+	unsigned int granularity;
+	size_t count;
+};
+
+void timer_entry_init (struct timer_entry *t);
+int timerwheel_init (struct timerwheel *tw, struct event_base *base, unsigned int granularity);
+void timerwheel_free (struct timerwheel *tw);
+void timerwheel_add (struct timerwheel *tw, struct timer_entry *t, double secs, void (*callback) (void *), void *arg);
+void timerwheel_del (struct timer_entry *t);
+
+#endif
+// vim:fdm=marker:ai:ts=4:sw=4:noet:
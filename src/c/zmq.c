@@ -39,14 +39,15 @@
 #endif
 
 #define socket_ptr(L, i) (((struct socket_data *) luaL_checkudata (L, i, "ratchet_zmqsocket_meta"))->socket)
-#define socket_timeout(L, i) (((struct socket_data *) luaL_checkudata (L, i, "ratchet_zmqsocket_meta"))->timeout)
+#define socket_timeout(L, i) (((struct socket_data *) luaL_checkudata (L, i, "ratchet_zmqsocket_meta"))->io.timeout)
 
 #define raise_zmq_error(L, f) raise_zmq_error_ln (L, f, __FILE__, __LINE__)
 
+/* The ZMQ_FD of a socket does not change, so it is cached for the kernel. */
 struct socket_data
 {
+	struct ratchet_io io;
 	void *socket;
-	double timeout;
 };
 
 /* {{{ raise_zmq_error_ln() */
@@ -122,7 +123,14 @@ static int rzmq_new (lua_State *L)
 	{
 		struct socket_data *sd = (struct socket_data *) lua_newuserdata (L, sizeof (struct socket_data));
 		sd->socket = socket;
-		sd->timeout = -1.0;
+		sd->io.timeout = -1.0;
+
+		size_t fd_len = sizeof (int);
+		if (-1 == zmq_getsockopt (socket, ZMQ_FD, &sd->io.fd, &fd_len))
+		{
+			zmq_close (socket);
+			return raise_zmq_error (L, "ratchet.zmqsocket.new()");
+		}
 
 		luaL_getmetatable (L, "ratchet_zmqsocket_meta");
 		lua_setmetatable (L, -2);
@@ -182,15 +190,8 @@ static int rzmq_gc (lua_State *L)
 /* {{{ rzmq_get_fd() */
 static int rzmq_get_fd (lua_State *L)
 {
-	void *socket = socket_ptr (L, 1);
-	int fd;
-	size_t fd_len = sizeof (int);
-
-	int ret = zmq_getsockopt (socket, ZMQ_FD, &fd, &fd_len);
-	if (ret == -1)
-		return raise_zmq_error (L, "ratchet.zmqsocket.get_fd()");
-
-	lua_pushinteger (L, fd);
+	struct socket_data *sd = (struct socket_data *) luaL_checkudata (L, 1, "ratchet_zmqsocket_meta");
+	lua_pushinteger (L, sd->io.fd);
 	return 1;
 }
 /* }}} */
@@ -495,6 +496,7 @@ int luaopen_ratchet_zmqsocket (lua_State *L)
 
 	/* Set up the ratchet.zmqsocket class and metatables. */
 	luaL_newmetatable (L, "ratchet_zmqsocket_meta");
+	ratchet_io_register (L, -1);
 	lua_newtable (L);
 	lua_pushvalue (L, -3);
 	luaL_setfuncs (L, meths, 1);
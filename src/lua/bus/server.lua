@@ -15,41 +15,37 @@ function server.new(socket, request_from_bus, response_to_bus)
     self.response_to_bus = response_to_bus or tostring
     self.queue = {}
 
-    self.sockets = {server = socket}
+    self.server_socket = socket
+    self.sockets = {}
+    self.updated = {}
+    self.pollset = ratchet.pollset.new()
+    self.pollset:add(socket)
 
     return self
 end
 -- }}}
 
--- {{{ build_socket_array()
-local function build_socket_array(sockets)
-    local ret = {}
-    for k, v in pairs(sockets) do
-        if k == 'server' then
-            table.insert(ret, v)
-        else
-            table.insert(ret, k)
-        end
-    end
-    return ret
-end
--- }}}
-
 -- {{{ receive_connections_and_data()
 local function receive_connections_and_data(self)
-    local ready, err = ratchet.thread.block_on(build_socket_array(self.sockets))
+    local ready, err = self.pollset:wait()
     if not ready then
         return nil, err
     end
 
-    if ready == self.sockets.server then
-        local pad = ratchet.socketpad.new(ready:accept())
-        self.sockets[pad.socket] = pad
-    else
-        local pad = self.sockets[ready]
-        local _, closed = pad:update_and_peek()
-        if not closed then
-            self.updated = pad
+    for i, socket in ipairs(ready) do
+        if socket == self.server_socket then
+            local pad = ratchet.socketpad.new(socket:accept())
+            self.sockets[pad.socket] = pad
+            self.pollset:add(pad.socket)
+        else
+            local pad = self.sockets[socket]
+            local _, closed = pad:update_and_peek()
+            if closed then
+                self.sockets[socket] = nil
+                self.pollset:remove(socket)
+            else
+                table.insert(self.updated, pad)
+            end
         end
     end
 
@@ -117,17 +113,19 @@ end
 
 -- {{{ check_for_full_requests()
 local function check_for_full_requests(self)
-    if self.updated then
-        local request = pop_full_request(self, self.updated)
+    while self.updated[1] do
+        local pad = table.remove(self.updated, 1)
+        local request = pop_full_request(self, pad)
 
         if request then
-            self.sockets[self.updated.socket] = nil
+            self.sockets[pad.socket] = nil
+            self.pollset:remove(pad.socket)
 
             local transaction = server_transaction.new(
                 request,
                 self.response_to_bus,
-                self.updated,
-                self.updated.from
+                pad,
+                pad.from
             )
             return transaction, request
         end
@@ -137,16 +135,17 @@ end
 
 -- {{{ server:recv_request()
 function server:recv_request()
-    local transaction, request
+    -- Pads updated by an earlier wait may already hold a full request.
+    local transaction, request = check_for_full_requests(self)
 
-    repeat
+    while not transaction do
         local okay, err = receive_connections_and_data(self)
         if not okay then
             return nil, err
         end
 
         transaction, request = check_for_full_requests(self)
-    until transaction
+    end
 
     return transaction, request
 end
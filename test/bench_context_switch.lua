@@ -0,0 +1,63 @@
+require "ratchet"
+
+-- Measures context switches per second between ratchet threads, once with
+-- the kernel's native helper dispatch and once with Lua method dispatch
+-- turned on through set_method_dispatch(). Not run as part of "make check".
+
+local iterations = tonumber(arg and arg[1]) or 100000
+
+local function ping_pong(method_dispatch)
+    local t1, t2
+
+    local function ping()
+        for i=1, iterations do
+            ratchet.thread.unpause(t2)
+            ratchet.thread.pause()
+        end
+    end
+
+    local function pong()
+        for i=1, iterations do
+            ratchet.thread.pause()
+            ratchet.thread.unpause(t1)
+        end
+    end
+
+    local r = ratchet.new(function ()
+        t2 = ratchet.thread.attach(pong)
+        t1 = ratchet.thread.attach(ping)
+    end)
+    r:set_method_dispatch(method_dispatch)
+
+    local start = os.clock()
+    r:loop()
+    return (iterations * 2) / (os.clock() - start)
+end
+
+local function timers(method_dispatch)
+    local function sleeper()
+        for i=1, iterations / 10 do
+            ratchet.thread.timer(0)
+        end
+    end
+
+    local r = ratchet.new(function ()
+        for i=1, 10 do
+            ratchet.thread.attach(sleeper)
+        end
+    end)
+    r:set_method_dispatch(method_dispatch)
+
+    local start = os.clock()
+    r:loop()
+    return iterations / (os.clock() - start)
+end
+
+for _, bench in ipairs({{"pause/unpause", ping_pong}, {"timer(0)", timers}}) do
+    local native = bench[2](false)
+    local method = bench[2](true)
+    print(("%-14s native: %10.0f/s  method: %10.0f/s  (%.2fx)"):format(
+        bench[1], native, method, native / method))
+end
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
@@ -0,0 +1,58 @@
+require "ratchet"
+
+local function ctx1()
+    local buf = ratchet.buffer()
+    assert(#buf == 0 and buf:tostring() == "")
+
+    -- String-like access without converting the whole buffer.
+    buf:append("HELO there\r\n", "QUIT\r\n")
+    assert(buf:len() == 18)
+    local s, e = buf:find("\r\n")
+    assert(s == 11 and e == 12)
+    assert(buf:sub(1, s-1) == "HELO there")
+    assert(buf:sub(-6) == "QUIT\r\n")
+    assert(buf:find("\r\n", e+1) == 17)
+    assert(nil == buf:find("MAIL"))
+    buf:consume(e)
+    assert(tostring(buf) == "QUIT\r\n")
+    buf:consume()
+    assert(#buf == 0)
+
+    -- Reads append to whatever is already buffered.
+    local a, b = ratchet.socket.new_pair()
+    ratchet.thread.attach(function ()
+        b:send("hello ")
+        ratchet.thread.timer(0.1)
+        local rest = ("x"):rep(100000)
+        repeat rest = b:send(rest) until not rest
+        b:close()
+    end)
+
+    buf:append(">")
+    assert(a:recv_into(buf) == 6)
+    assert(buf:tostring() == ">hello ")
+
+    local total = 0
+    while true do
+        local n = a:recv_into(buf, 65536)
+        if n == 0 then break end
+        total = total + n
+    end
+    assert(total == 100000)
+    assert(#buf == 100007)
+    assert(buf:sub(8, 12) == "xxxxx")
+    buf:consume(7)
+    assert(buf:find("xx", 99999) == 99999)
+
+    -- Timeouts behave as with recv().
+    local c, d = ratchet.socket.new_pair()
+    c:set_timeout(0.1)
+    local ok, err = pcall(c.recv_into, c, buf)
+    assert(not ok and ratchet.error.is(err, "ETIMEDOUT"))
+    assert(#buf == 100000)
+end
+
+local kernel = ratchet.new(ctx1)
+kernel:loop()
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
@@ -0,0 +1,103 @@
+require "ratchet"
+
+local kernel
+local received = {}
+local got_closed_error = false
+
+local function producer(ch, first, last)
+    for i=first, last do
+        ch:send(i)
+        -- The channel never holds more than its capacity.
+        assert(#ch <= 2)
+    end
+end
+
+local function consumer(ch, out)
+    while true do
+        local n = ch:recv()
+        if not n then
+            break
+        end
+        table.insert(out, n)
+    end
+end
+
+local function ctx1()
+    local ch = ratchet.channel(2)
+
+    -- Two producers and two consumers sharing one channel.
+    local out1, out2 = {}, {}
+    local c1 = ratchet.thread.attach(consumer, ch, out1)
+    local c2 = ratchet.thread.attach(consumer, ch, out2)
+    ratchet.thread.wait_all({
+        ratchet.thread.attach(producer, ch, 1, 50),
+        ratchet.thread.attach(producer, ch, 51, 100),
+    })
+    ch:close()
+    ratchet.thread.wait_all({c1, c2})
+
+    for i, n in ipairs(out1) do received[n] = (received[n] or 0) + 1 end
+    for i, n in ipairs(out2) do received[n] = (received[n] or 0) + 1 end
+
+    -- Non-blocking variants.
+    local ch2 = ratchet.channel.new(1)
+    assert(ch2:try_recv() == false)
+    assert(ch2:try_send("a"))
+    assert(ch2:try_send("b") == false)
+    local ok, val = ch2:try_recv()
+    assert(ok and val == "a")
+
+    -- Unbuffered channels hand values directly to a waiting receiver.
+    local ch3 = ratchet.channel(0)
+    assert(ch3:try_send("x") == false)
+    local t = ratchet.thread.attach(function ()
+        assert(ch3:recv() == "y")
+    end)
+    ratchet.thread.yield()
+    assert(ch3:try_send("y"))
+    ratchet.thread.wait_all({t})
+
+    -- Blocked senders fail when the channel is closed.
+    local ch4 = ratchet.channel(0)
+    local t = ratchet.thread.attach(function ()
+        local ok, err = pcall(ch4.send, ch4, "z")
+        got_closed_error = (not ok and ratchet.error.is(err, "CLOSED"))
+    end)
+    ratchet.thread.yield()
+    ch4:close()
+    ratchet.thread.wait_all({t})
+    assert(ch4:recv() == nil)
+
+    -- A sender woken by unpause() takes its value back.
+    local ch6 = ratchet.channel(0)
+    local canceled = false
+    local t = ratchet.thread.attach(function ()
+        local ok, err = pcall(ch6.send, ch6, "lost")
+        canceled = (not ok and ratchet.error.is(err, "ECANCELED"))
+    end)
+    ratchet.thread.yield()
+    ratchet.thread.unpause(t)
+    ratchet.thread.wait_all({t})
+    assert(canceled)
+    assert(not ch6:try_recv())
+
+    -- Channels can be waited on alongside other file descriptors.
+    local ch5 = ratchet.channel(4)
+    ratchet.thread.attach(function ()
+        ratchet.thread.timer(0.1)
+        ch5:send("ready")
+    end)
+    assert(ch5 == ratchet.thread.block_on({ch5}, {}, 5.0))
+    assert(ch5:recv() == "ready")
+    assert(nil == ratchet.thread.block_on({ch5}, {}, 0.1))
+end
+
+kernel = ratchet.new(ctx1)
+kernel:loop()
+
+for i=1, 100 do
+    assert(received[i] == 1)
+end
+assert(got_closed_error)
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
@@ -0,0 +1,21 @@
+require "ratchet"
+
+assert(ratchet.cluster.get_num_cpus() >= 1)
+
+local function worker(i)
+    local kernel = ratchet.new(function ()
+        local rec = ratchet.socket.prepare_tcp("*", 10026, "AF_INET")
+        local socket = ratchet.cluster.listen(rec)
+        assert(socket:getsockopt("SO_REUSEPORT"))
+
+        -- Keep the listener open long enough that all workers share the port.
+        ratchet.thread.timer(0.5)
+        socket:close()
+    end)
+    kernel:loop()
+end
+
+local failures = ratchet.cluster.run(worker, {workers = 3, restart = false})
+assert(failures == 0, failures.." workers failed")
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
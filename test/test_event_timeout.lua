@@ -7,7 +7,9 @@ function ctx1(host, port)
     socket:bind(rec.addr)
     socket:listen()
 
+    assert(socket:get_timeout() == -1.0)
     socket:set_timeout(0.0)
+    assert(socket:get_timeout() == 0.0)
     local worked, err = pcall(socket.accept, socket)
     assert(not worked and ratchet.error.is(err, "ETIMEDOUT"), "accept failed to timeout")
 end
@@ -37,14 +37,58 @@ function communicate_test()
     tests = tests + 4
 end
 
+function exit_status_test()
+    local p = ratchet.exec.new({"sh", "-c", "exit 3"})
+    p:start()
+    local status, exited = p:wait()
+    assert(3 == status)
+    assert(exited)
+
+    tests = tests + 2
+end
+
+function many_children_test()
+    local procs = {}
+    for i=1, 20 do
+        local p = ratchet.exec.new({"sh", "-c", "exit " .. i})
+        p:start()
+        procs[i] = p
+    end
+
+    local threads = {}
+    for i, p in ipairs(procs) do
+        threads[i] = ratchet.thread.attach(function ()
+            assert(i == p:wait())
+        end)
+    end
+    ratchet.thread.wait_all(threads)
+
+    tests = tests + 1
+end
+
+function wait_timeout_test()
+    local p = ratchet.exec.new({"sleep", "5"})
+    p:start()
+    local ok, err = pcall(p.wait, p, 0.1)
+    assert(not ok and ratchet.error.is(err, "ETIMEDOUT"))
+    p:kill()
+    local status, exited = p:wait()
+    assert(not exited)
+
+    tests = tests + 2
+end
+
 kernel = ratchet.new(function ()
     ratchet.thread.attach(hello_world)
     ratchet.thread.attach(hello_world)
     ratchet.thread.attach(cat_test)
     ratchet.thread.attach(communicate_test)
+    ratchet.thread.attach(exit_status_test)
+    ratchet.thread.attach(many_children_test)
+    ratchet.thread.attach(wait_timeout_test)
 end)
 kernel:loop()
 
-assert(tests == 9)
+assert(tests == 14)
 
 -- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
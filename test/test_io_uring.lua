@@ -0,0 +1,116 @@
+require "ratchet"
+
+-- These pass with either backend, io_uring is used where available.
+
+function server(socket)
+    local client = socket:accept()
+    local data = ""
+    while #data < 100000 do
+        local more = client:recv()
+        assert(more ~= "")
+        data = data .. more
+    end
+    assert(data == string.rep("x", 100000))
+    client:send("done")
+    client:close()
+end
+
+function client(host, port)
+    local rec = ratchet.socket.prepare_tcp(host, port, "AF_INET")
+    local socket = ratchet.socket.new(rec.family, rec.socktype, rec.protocol)
+    socket:connect(rec.addr)
+
+    local data = string.rep("x", 100000)
+    repeat
+        data = socket:send(data)
+    until not data
+    assert(socket:recv() == "done")
+    assert(socket:recv() == "")
+end
+
+function timeouts()
+    local a, b = ratchet.socket.new_pair()
+
+    a:set_timeout(0.1)
+    local ok, err = pcall(a.recv, a)
+    assert(not ok and ratchet.error.is(err, "ETIMEDOUT"))
+
+    -- A killed reader leaves the socket usable.
+    local t = ratchet.thread.attach(function ()
+        a:recv()
+        error("should have been killed")
+    end)
+    ratchet.thread.yield()
+    ratchet.thread.kill(t)
+
+    b:send("after")
+    assert(a:recv() == "after")
+
+    -- Data taken by a killed reader goes to the next one.
+    t = ratchet.thread.attach(function ()
+        a:recv()
+        error("should have been killed")
+    end)
+    ratchet.thread.yield()
+    b:send("taken")
+    ratchet.thread.kill(t)
+    assert(a:recv() == "taken")
+end
+
+function lossless_timeouts()
+    local a, b = ratchet.socket.new_pair()
+    a:set_timeout(0.01)
+
+    -- Data arrives while receives are timing out.
+    local expected = {}
+    ratchet.thread.attach(function ()
+        for i=1, 50 do
+            local chunk = string.format("%04d", i)
+            table.insert(expected, chunk)
+            b:send(chunk)
+            ratchet.thread.timer(0.005 * (i % 4))
+        end
+        b:close()
+    end)
+
+    local data, timeouts = {}, 0
+    while true do
+        local ok, ret = pcall(a.recv, a)
+        if not ok then
+            assert(ratchet.error.is(ret, "ETIMEDOUT"))
+            timeouts = timeouts + 1
+        elseif ret == "" then
+            break
+        else
+            table.insert(data, ret)
+        end
+    end
+    assert(timeouts > 0)
+    assert(table.concat(data) == table.concat(expected))
+end
+
+function ctx1(host, port)
+    local rec = ratchet.socket.prepare_tcp(host, port, "AF_INET")
+    local socket = ratchet.socket.new(rec.family, rec.socktype, rec.protocol)
+    socket:setsockopt("SO_REUSEADDR", true)
+    socket:bind(rec.addr)
+    socket:listen()
+
+    ratchet.thread.wait_all({
+        ratchet.thread.attach(server, socket),
+        ratchet.thread.attach(client, host, port),
+        ratchet.thread.attach(timeouts),
+        ratchet.thread.attach(lossless_timeouts),
+    })
+end
+
+kernel = ratchet.new(function ()
+    ratchet.thread.attach(ctx1, "127.0.0.1", 10035)
+end, nil, {io_uring = true})
+local backend = kernel:get_io_backend()
+assert(backend == "io_uring" or backend == "libevent")
+kernel:loop()
+
+assert(ratchet.new(function () end):get_io_backend() == "libevent")
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
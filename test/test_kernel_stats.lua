@@ -0,0 +1,53 @@
+require "ratchet"
+
+local kernel
+
+local function sleeper()
+    ratchet.thread.timer(0.01)
+end
+
+local function pauser()
+    ratchet.thread.pause()
+end
+
+local function ctx1()
+    local t = ratchet.thread.attach(pauser)
+    ratchet.thread.attach(sleeper)
+    ratchet.thread.yield()
+
+    local stats = kernel:stats()
+    assert(stats.threads == 3)
+    assert(kernel:get_num_threads() == 3)
+
+    ratchet.thread.unpause(t)
+    ratchet.thread.wait_all({t})
+end
+
+kernel = ratchet.new(ctx1)
+kernel:loop()
+
+local stats = kernel:stats(true)
+assert(stats.threads == 0)
+assert(kernel:get_num_threads() == 0)
+assert(stats.ready == 0)
+assert(stats.resumes.START == 3)
+assert(stats.resumes.TIMEOUT == 1)
+assert(stats.resumes.PAUSE == 2)
+assert(stats.resumes.WAITALL == 1)
+assert(stats.context_switches == 7)
+assert(stats.iterations > 0)
+assert(stats.elapsed > 0)
+assert(stats.max_resume_thread)
+assert(#stats.lag == 5 and #stats.iteration_time == 5)
+
+local lagged = 0
+for i, n in ipairs(stats.lag) do
+    lagged = lagged + n
+end
+assert(lagged > 0)
+
+stats = kernel:stats()
+assert(stats.context_switches == 0)
+assert(stats.max_resume_thread == nil)
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
@@ -0,0 +1,28 @@
+require "ratchet"
+
+local finished = 0
+
+local function ctx1()
+    local pw = ratchet.thread.offload("getpwnam", "root")
+    assert(pw and pw.uid == 0 and pw.name == "root")
+
+    assert(nil == ratchet.thread.offload("getpwnam", "no-such-user-ratchet"))
+    finished = finished + 1
+end
+
+local function ctx2()
+    assert(not pcall(ratchet.thread.offload, "no-such-job"))
+    finished = finished + 1
+end
+
+local kernel = ratchet.new(function ()
+    for i=1, 20 do
+        ratchet.thread.attach(ctx1)
+    end
+    ratchet.thread.attach(ctx2)
+end)
+kernel:loop()
+
+assert(finished == 21)
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
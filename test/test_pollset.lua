@@ -0,0 +1,54 @@
+require "ratchet"
+
+local function ctx1()
+    local ps = ratchet.pollset()
+    local a1, b1 = ratchet.socket.new_pair()
+    local a2, b2 = ratchet.socket.new_pair()
+    local a3, b3 = ratchet.socket.new_pair()
+    ps:add(a1)
+    ps:add(a2)
+    ps:add(a3)
+    assert(ps:get_num_items() == 3)
+
+    -- Nothing is ready yet.
+    assert(nil == ps:wait(0.1))
+
+    -- Every ready object is returned by a single wait.
+    b1:send("one")
+    b3:send("three")
+    local ready = assert(ps:wait(1.0))
+    assert(#ready == 2)
+    local seen = {}
+    for i, s in ipairs(ready) do
+        seen[s] = true
+    end
+    assert(seen[a1] and seen[a3])
+    assert(a1:recv() == "one")
+    assert(a3:recv() == "three")
+
+    -- Objects stay registered across waits.
+    ratchet.thread.attach(function ()
+        ratchet.thread.timer(0.1)
+        b2:send("two")
+    end)
+    local ready = assert(ps:wait(2.0))
+    assert(#ready == 1 and ready[1] == a2)
+    assert(a2:recv() == "two")
+
+    -- Removed objects are no longer returned.
+    assert(ps:remove(a1))
+    assert(not ps:remove(a1))
+    b1:send("ignored")
+    assert(nil == ps:wait(0.1))
+    assert(ps:get_num_items() == 2)
+
+    -- Write readiness.
+    ps:add(b1, "write")
+    local ready = assert(ps:wait(1.0))
+    assert(ready[1] == b1)
+end
+
+local kernel = ratchet.new(ctx1)
+kernel:loop()
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
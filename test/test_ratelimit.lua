@@ -0,0 +1,40 @@
+require "ratchet"
+
+local kernel
+local times = {}
+
+local function ctx1()
+    local rl = ratchet.ratelimit(20.0, 2)
+
+    -- The burst is available immediately.
+    assert(rl:try_acquire())
+    assert(rl:try_acquire())
+    assert(not rl:try_acquire())
+    assert(rl:get_wait() > 0.0)
+
+    local threads = {}
+    for i=1, 10 do
+        table.insert(threads, ratchet.thread.attach(function ()
+            rl:acquire()
+            table.insert(times, i)
+        end))
+    end
+    ratchet.thread.wait_all(threads)
+
+    -- Acquirers are served in order.
+    for i=1, 10 do
+        assert(times[i] == i)
+    end
+
+    assert(not pcall(rl.acquire, rl, 3))
+end
+
+kernel = ratchet.new(ctx1)
+kernel:loop()
+
+assert(#times == 10)
+
+-- Ten more tokens at 20 per second take about half a second.
+assert(kernel:stats().elapsed >= 0.4)
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
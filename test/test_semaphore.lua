@@ -0,0 +1,77 @@
+require "ratchet"
+
+local kernel
+local active, max_active = 0, 0
+local order = {}
+
+local function worker(sem, i)
+    sem:acquire()
+    active = active + 1
+    if active > max_active then
+        max_active = active
+    end
+    table.insert(order, i)
+    ratchet.thread.yield()
+    active = active - 1
+    sem:release()
+end
+
+local function ctx1()
+    local sem = ratchet.semaphore(3)
+    assert(sem:get_count() == 3)
+
+    local threads = {}
+    for i=1, 10 do
+        table.insert(threads, ratchet.thread.attach(worker, sem, i))
+    end
+    ratchet.thread.wait_all(threads)
+    assert(sem:get_count() == 3)
+    assert(sem:get_num_waiting() == 0)
+
+    -- Waiters are served in the order they started waiting.
+    for i=1, 10 do
+        assert(order[i] == i)
+    end
+
+    local sem2 = ratchet.semaphore.new(1)
+    assert(sem2:try_acquire())
+    assert(not sem2:try_acquire())
+    sem2:release()
+    assert(sem2:get_count() == 1)
+
+    -- Killed waiters are skipped when releasing.
+    local sem3 = ratchet.semaphore(0)
+    local got = false
+    local dead = ratchet.thread.attach(function () sem3:acquire() end)
+    local live = ratchet.thread.attach(function () sem3:acquire(); got = true end)
+    ratchet.thread.yield()
+    assert(sem3:get_num_waiting() == 2)
+    ratchet.thread.kill(dead)
+    sem3:release()
+    ratchet.thread.wait_all({live})
+    assert(got)
+    assert(sem3:get_count() == 0)
+
+    -- Waiters woken by unpause() leave the queue with an error.
+    local sem4 = ratchet.semaphore(0)
+    local canceled = false
+    local woken = ratchet.thread.attach(function ()
+        local ok, err = pcall(sem4.acquire, sem4)
+        canceled = (not ok and ratchet.error.is(err, "ECANCELED"))
+    end)
+    ratchet.thread.yield()
+    assert(sem4:get_num_waiting() == 1)
+    ratchet.thread.unpause(woken)
+    ratchet.thread.wait_all({woken})
+    assert(canceled)
+    assert(sem4:get_num_waiting() == 0)
+    sem4:release()
+    assert(sem4:get_count() == 1)
+end
+
+kernel = ratchet.new(ctx1)
+kernel:loop()
+
+assert(max_active == 3)
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
@@ -0,0 +1,67 @@
+require "ratchet"
+
+local function connect_all(file, n)
+    local rec = ratchet.socket.prepare_unix(file)
+    local clients = {}
+    for i = 1, n do
+        clients[i] = ratchet.socket.new(rec.family, rec.socktype, rec.protocol)
+        clients[i]:connect(rec.addr)
+        clients[i]:send("client " .. i)
+    end
+    for i = 1, n do
+        assert(clients[i]:recv() == "hello " .. i)
+    end
+end
+
+local function ctx1(file)
+    local rec = ratchet.socket.prepare_unix(file)
+    local server = ratchet.socket.new(rec.family, rec.socktype, rec.protocol)
+    server:bind(rec.addr)
+    server:listen(32)
+
+    -- Every pending connection is returned by one call.
+    local connect_all_thread = ratchet.thread.attach(connect_all, file, 5)
+    ratchet.thread.timer(0.1)
+    local socks, addrs = server:accept_many()
+    assert(#socks == 5 and #addrs == 5)
+    for i, sock in ipairs(socks) do
+        local n = sock:recv():match("^client (%d+)$")
+        sock:send("hello " .. n)
+    end
+    ratchet.thread.wait_all({connect_all_thread})
+
+    -- The maximum is respected, and a handler is attached for each one.
+    local t = ratchet.thread.attach(connect_all, file, 3)
+    ratchet.thread.timer(0.1)
+    local socks = server:accept_many(2)
+    assert(#socks == 2)
+    local handled = 0
+    local function handler(sock, addr)
+        local n = sock:recv():match("^client (%d+)$")
+        sock:send("hello " .. n)
+        handled = handled + 1
+    end
+    for i, sock in ipairs(socks) do
+        handler(sock)
+    end
+    assert(server:accept_many(10, handler) == 1)
+    ratchet.thread.wait_all({t})
+    assert(handled == 3)
+
+    -- Nothing pending times out as with accept().
+    server:set_timeout(0.1)
+    local ok, err = pcall(server.accept_many, server)
+    assert(not ok and ratchet.error.is(err, "ETIMEDOUT"))
+
+    server:close()
+    os.remove(file)
+end
+
+local file = os.tmpname()
+os.remove(file)
+local kernel = ratchet.new(function ()
+    ratchet.thread.attach(ctx1, file)
+end)
+kernel:loop()
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
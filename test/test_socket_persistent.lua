@@ -0,0 +1,104 @@
+require "ratchet"
+
+function ctx1()
+    local socket_a, socket_b = ratchet.socket.new_pair()
+    socket_a:set_persistent(true)
+    socket_b:set_persistent(true)
+
+    ratchet.thread.attach(ctx2, socket_b)
+
+    for i=1, 100 do
+        socket_a:send("ping" .. i)
+        local data = socket_a:recv()
+        assert(data == "pong" .. i)
+    end
+
+    -- Fill the socket buffer so send() has to wait for the peer.
+    local big = ("x"):rep(65536)
+    for i=1, 16 do
+        local remaining = socket_a:send(big)
+        while remaining do
+            remaining = socket_a:send(remaining)
+        end
+    end
+    socket_a:close()
+end
+
+function ctx2(socket_b)
+    for i=1, 100 do
+        local data = socket_b:recv()
+        assert(data == "ping" .. i)
+        socket_b:send("pong" .. i)
+    end
+
+    socket_b:set_timeout(5.0)
+    local total = 0
+    while total < 16 * 65536 do
+        local data = socket_b:recv()
+        total = total + #data
+    end
+    assert(total == 16 * 65536)
+end
+
+function ctx3()
+    local socket_a, socket_b = ratchet.socket.new_pair()
+    socket_a:set_persistent(true)
+    socket_a:set_timeout(0.05)
+
+    local worked, err = pcall(socket_a.recv, socket_a)
+    assert(not worked and ratchet.error.is(err, "ETIMEDOUT"), "recv failed to timeout")
+
+    socket_b:send("late")
+    assert(socket_a:recv() == "late")
+
+    socket_a:set_persistent(false)
+    socket_b:send("again")
+    assert(socket_a:recv() == "again")
+end
+
+function acceptor(server, accepted)
+    local client = server:accept()
+    table.insert(accepted, client:recv())
+    client:close()
+end
+
+function ctx4(file)
+    local rec = ratchet.socket.prepare_unix(file)
+    local server = ratchet.socket.new(rec.family, rec.socktype, rec.protocol)
+    server:bind(rec.addr)
+    server:listen(8)
+    server:set_persistent(true)
+    server:set_timeout(5.0)
+
+    -- Both threads block on the same watch, neither may be stranded.
+    local accepted = {}
+    local threads = {
+        ratchet.thread.attach(acceptor, server, accepted),
+        ratchet.thread.attach(acceptor, server, accepted),
+    }
+    ratchet.thread.yield()
+
+    for i=1, 2 do
+        local client = ratchet.socket.new(rec.family, rec.socktype, rec.protocol)
+        client:connect(rec.addr)
+        client:send("client" .. i)
+        client:close()
+    end
+
+    ratchet.thread.wait_all(threads)
+    assert(#accepted == 2)
+
+    server:close()
+    os.remove(file)
+end
+
+local file = os.tmpname()
+os.remove(file)
+kernel = ratchet.new(function ()
+    ratchet.thread.attach(ctx1)
+    ratchet.thread.attach(ctx3)
+    ratchet.thread.attach(ctx4, file)
+end)
+kernel:loop()
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
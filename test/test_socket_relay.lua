@@ -0,0 +1,56 @@
+require "ratchet"
+
+local function relay_test(options)
+    local client, a = ratchet.socket.new_pair()
+    local b, server = ratchet.socket.new_pair()
+
+    local relay_thread = ratchet.thread.attach(function ()
+        local to_b, to_a, reason = ratchet.socket.relay(a, b, options)
+        assert(to_b == 300000, to_b)
+        assert(to_a == 5, to_a)
+        assert(reason == "closed", reason)
+    end)
+
+    ratchet.thread.attach(function ()
+        local rest = ("x"):rep(300000)
+        repeat rest = client:send(rest) until not rest
+        client:shutdown("write")
+        assert(client:recv() == "done.")
+        assert(client:recv() == "")
+    end)
+
+    -- The half-close reaches the server once all data has.
+    local buf = ratchet.buffer()
+    while server:recv_into(buf, 65536) > 0 do end
+    assert(#buf == 300000)
+    server:send("done.")
+    server:shutdown("write")
+
+    ratchet.thread.wait_all({relay_thread})
+end
+
+local function ctx1()
+    relay_test()
+    relay_test({splice = false})
+
+    -- Idle timeout.
+    local client, a = ratchet.socket.new_pair()
+    local b, server = ratchet.socket.new_pair()
+    local to_b, to_a, reason = ratchet.socket.relay(a, b, {timeout = 0.1})
+    assert(to_b == 0 and to_a == 0 and reason == "ETIMEDOUT")
+
+    -- Stopped by unpause.
+    local self = ratchet.thread.self()
+    ratchet.thread.attach(function ()
+        client:send("hello")
+        assert(server:recv() == "hello")
+        ratchet.thread.unpause(self)
+    end)
+    local to_b, to_a, reason = ratchet.socket.relay(a, b)
+    assert(to_b == 5 and to_a == 0 and reason == "ECANCELED")
+end
+
+local kernel = ratchet.new(ctx1)
+kernel:loop()
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
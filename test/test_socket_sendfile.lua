@@ -0,0 +1,54 @@
+require "ratchet"
+
+local function ctx1()
+    local path = os.tmpname()
+    local f = assert(io.open(path, "w"))
+    f:write(("0123456789"):rep(50000))
+    f:close()
+
+    local a, b = ratchet.socket.new_pair()
+
+    -- The whole file, larger than the socket buffers.
+    ratchet.thread.attach(function ()
+        assert(a:sendfile(path) == 500000)
+        assert(a:sendfile(path, 499990, 100) == 10)
+        a:close()
+    end)
+    local buf = ratchet.buffer()
+    while b:recv_into(buf, 65536) > 0 do end
+    assert(#buf == 500010)
+    assert(buf:sub(499996, 500010) == "567890123456789")
+
+    -- Part of the file.
+    local c, d = ratchet.socket.new_pair()
+    assert(c:sendfile(path, 3, 4) == 4)
+    assert(d:recv() == "3456")
+
+    local ok, err = pcall(c.sendfile, c, path .. ".missing")
+    assert(not ok and ratchet.error.is(err, "ENOENT"))
+
+    os.remove(path)
+
+    -- splice() moves data between two other objects.
+    if ratchet.socket.splice then
+        local e, f = ratchet.socket.new_pair()
+        local g, h = ratchet.socket.new_pair()
+        ratchet.thread.attach(function ()
+            local rest = ("x"):rep(200000)
+            repeat rest = e:send(rest) until not rest
+            e:close()
+        end)
+        ratchet.thread.attach(function ()
+            assert(ratchet.socket.splice(f, g) == 200000)
+            g:close()
+        end)
+        local buf = ratchet.buffer()
+        while h:recv_into(buf, 65536) > 0 do end
+        assert(#buf == 200000)
+    end
+end
+
+local kernel = ratchet.new(ctx1)
+kernel:loop()
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
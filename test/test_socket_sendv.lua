@@ -0,0 +1,43 @@
+require "ratchet"
+
+local function ctx1()
+    local a, b = ratchet.socket.new_pair()
+
+    -- Many small parts are sent together.
+    local parts = {}
+    for i = 1, 200 do
+        parts[i] = "part" .. i .. ";"
+    end
+    local buf = ratchet.buffer()
+    buf:append("from a buffer")
+    table.insert(parts, buf)
+    table.insert(parts, "")
+    local expected = table.concat(parts, "", 1, 200) .. "from a buffer"
+
+    a:sendv(parts)
+    local got = ratchet.buffer()
+    while #got < #expected do
+        assert(b:recv_into(got) > 0)
+    end
+    assert(got:tostring() == expected)
+
+    -- Large parts fill the socket and resume where they left off.
+    local big = {("a"):rep(300000), "middle", ("b"):rep(300000)}
+    ratchet.thread.attach(function ()
+        a:sendv(big)
+        a:close()
+    end)
+    got:consume()
+    while b:recv_into(got, 65536) > 0 do end
+    assert(#got == 600006)
+    assert(got:find("middle") == 300001)
+    assert(got:sub(-1) == "b")
+
+    -- Nothing to send.
+    b:sendv({})
+end
+
+local kernel = ratchet.new(ctx1)
+kernel:loop()
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
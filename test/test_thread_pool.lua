@@ -0,0 +1,48 @@
+require "ratchet"
+
+local kernel
+local seen = {}
+local count = 0
+
+local function child(i)
+    assert(not ratchet.thread.space().used)
+    ratchet.thread.space().used = true
+    seen[ratchet.thread.self()] = true
+    count = count + i
+end
+
+local function ctx1()
+    for i=1, 50 do
+        ratchet.thread.wait_all({ratchet.thread.attach(child, 1)})
+    end
+
+    -- Threads that error are not returned to the pool.
+    local t = ratchet.thread.attach(error, "oops")
+    ratchet.thread.wait_all({t})
+end
+
+kernel = ratchet.new(ctx1, function (err, thread)
+    got_error = true
+end)
+assert(kernel:get_thread_pool_size() == 0)
+kernel:set_thread_pool_size(4)
+assert(kernel:get_thread_pool_size() == 4)
+kernel:loop()
+
+assert(count == 50)
+assert(got_error)
+
+local distinct = 0
+for t in pairs(seen) do
+    distinct = distinct + 1
+end
+assert(distinct < 50)
+
+local stats = kernel:stats()
+assert(stats.pool_hits > 0)
+assert(stats.pool_size > 0 and stats.pool_size <= 4)
+
+kernel:set_thread_pool_size(0)
+assert(kernel:stats().pool_size == 0)
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
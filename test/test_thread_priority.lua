@@ -0,0 +1,25 @@
+require "ratchet"
+
+local order = {}
+
+local function ctx1(name)
+    table.insert(order, name)
+end
+
+local function ctx2()
+    ratchet.thread.set_priority("low")
+    ratchet.thread.yield()
+    table.insert(order, "demoted")
+end
+
+local kernel = ratchet.new(function ()
+    ratchet.thread.attach("low", ctx1, "low")
+    ratchet.thread.attach(ctx2)
+    ratchet.thread.attach(ctx1, "normal")
+    ratchet.thread.attach("high", ctx1, "high")
+end)
+kernel:loop()
+
+assert(table.concat(order, ",") == "high,normal,low,demoted", table.concat(order, ","))
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
@@ -0,0 +1,39 @@
+require "ratchet"
+
+local order = {}
+local timer_fired = false
+
+local function ctx1(name)
+    for i=1, 3 do
+        table.insert(order, name)
+        ratchet.thread.yield()
+    end
+end
+
+local function busy()
+    -- Never waits on IO, the timer must still get its turn.
+    while not timer_fired do
+        ratchet.thread.yield()
+    end
+end
+
+local function sleeper()
+    ratchet.thread.timer(0.05)
+    timer_fired = true
+end
+
+local kernel = ratchet.new(function ()
+    ratchet.thread.attach(ctx1, "a")
+    ratchet.thread.attach(ctx1, "b")
+    ratchet.thread.attach(busy)
+    ratchet.thread.attach(sleeper)
+end)
+assert(kernel:get_run_budget() > 0)
+kernel:set_run_budget(8)
+assert(kernel:get_run_budget() == 8)
+kernel:loop()
+
+assert(table.concat(order) == "ababab")
+assert(timer_fired)
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
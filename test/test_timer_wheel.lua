@@ -0,0 +1,64 @@
+require "ratchet"
+
+-- Socket timeouts and alarms share the kernel's timer wheel; check that many
+-- of them expire, none early, and that IO cancels a pending timeout.
+
+local timeouts = 0
+
+function waiter(sock, secs)
+    sock:set_timeout(secs)
+    local worked, err = pcall(sock.recv, sock)
+    assert(not worked and ratchet.error.is(err, "ETIMEDOUT"), "recv failed to timeout")
+    timeouts = timeouts + 1
+end
+
+function receiver(sock)
+    sock:set_timeout(5.0)
+    local data = sock:recv()
+    assert(data == "hello")
+    got_data = true
+end
+
+function ctx1()
+    local held = {}
+    for i=1, 100 do
+        local a, b = ratchet.socket.new_pair()
+        held[i] = b
+        ratchet.thread.attach(waiter, a, (i % 10) * 0.01)
+    end
+
+    local a, b = ratchet.socket.new_pair()
+    ratchet.thread.attach(receiver, a)
+    ratchet.thread.timer(0.05)
+    b:send("hello")
+
+    ratchet.thread.timer(0.2)
+    assert(timeouts == 100)
+end
+
+function ctx2()
+    ratchet.thread.alarm(0.05)
+    ratchet.thread.timer(5.0)
+end
+
+kernel = ratchet.new(function ()
+    ratchet.thread.attach(ctx1)
+    ratchet.thread.attach(ctx2)
+end, function (err, thread)
+    if ratchet.error.is(err, "ALARM") then
+        got_alarm_error = true
+    else
+        error(err)
+    end
+end)
+
+assert(kernel:get_timer_granularity() == 0.01)
+kernel:set_timer_granularity(0.005)
+assert(kernel:get_timer_granularity() == 0.005)
+
+kernel:loop()
+
+assert(got_data)
+assert(got_alarm_error)
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
@@ -0,0 +1,30 @@
+require "ratchet"
+
+order = {}
+paused = {}
+
+local function ctx1(n)
+    ratchet.thread.pause()
+    table.insert(order, n)
+end
+
+local function ctx2()
+    for i=1, 50 do
+        ratchet.thread.unpause(paused[i])
+    end
+end
+
+local r = ratchet.new(function ()
+    for i=1, 50 do
+        paused[i] = ratchet.thread.attach(ctx1, i)
+    end
+    ratchet.thread.attach(ctx2)
+end)
+r:loop()
+
+assert(#order == 50)
+for i=1, 50 do
+    assert(order[i] == i, "thread "..order[i].." resumed at position "..i)
+end
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
@@ -16,6 +16,9 @@ local function ctx2()
     ratchet.thread.wait_all({t1, t2, t3, t4, t5})
     assert(count == 15)
     count = count + 6
+
+    -- Waiting again on finished threads returns right away.
+    ratchet.thread.wait_all({t1, t2, t3, t1})
 end
 
 local r = ratchet.new(function ()
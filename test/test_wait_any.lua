@@ -0,0 +1,42 @@
+require "ratchet"
+
+local kernel
+local done = {}
+
+local function child(name, secs)
+    ratchet.thread.timer(secs)
+    done[name] = true
+end
+
+local function ctx1()
+    -- The first thread to finish wins.
+    local slow = ratchet.thread.attach(child, "slow", 0.5)
+    local fast = ratchet.thread.attach(child, "fast", 0.1)
+    assert(fast == ratchet.thread.wait_any({slow, fast, 2.0}))
+    assert(done.fast and not done.slow)
+
+    -- A timeout wins over a thread that takes too long.
+    assert(0.1 == ratchet.thread.wait_any({slow, 0.1}))
+
+    -- Finished threads are returned right away.
+    assert(fast == ratchet.thread.wait_any({slow, fast}))
+
+    -- Objects with a file descriptor are ready when it is readable.
+    local ch = ratchet.channel(1)
+    local sender = ratchet.thread.attach(function ()
+        ratchet.thread.timer(0.1)
+        ch:send("data")
+    end)
+    assert(ch == ratchet.thread.wait_any({slow, ch, 2.0}))
+    assert(ch:recv() == "data")
+
+    -- Threads left over from earlier calls do not wake this one later.
+    ratchet.thread.wait_all({slow})
+    assert(done.slow)
+    assert(nil == ratchet.thread.wait_any({}))
+end
+
+kernel = ratchet.new(ctx1)
+kernel:loop()
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et:
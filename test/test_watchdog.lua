@@ -0,0 +1,41 @@
+require "ratchet"
+
+local kernel
+local stalls = {}
+
+local function busy(secs)
+    local start = os.clock()
+    while os.clock() - start < secs do
+    end
+end
+
+local function well_behaved()
+    for i=1, 5 do
+        ratchet.thread.yield()
+    end
+end
+
+local function ctx1()
+    ratchet.thread.wait_all({
+        ratchet.thread.attach(well_behaved),
+        ratchet.thread.attach(busy, 0.2),
+    })
+end
+
+kernel = ratchet.new(ctx1)
+assert(kernel:get_watchdog() == 0)
+kernel:set_watchdog(0.05, function (thread, elapsed, traceback)
+    table.insert(stalls, {thread = thread, elapsed = elapsed, traceback = traceback})
+end)
+assert(kernel:get_watchdog() == 0.05)
+kernel:loop()
+
+assert(#stalls == 1)
+assert(stalls[1].elapsed >= 0.05)
+assert(stalls[1].traceback:find("busy"))
+assert(kernel:stats().stalls == 1)
+
+kernel:set_watchdog(nil)
+assert(kernel:get_watchdog() == 0)
+
+-- vim:foldmethod=marker:sw=4:ts=4:sts=4:et: